@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#include <SDL2/SDL.h>
+
+#include "bench.h"
+#include "convert.h"
+#include "convert_check.h"
+
+#define BENCH_FRAMES 200
+#define WARMUP_FRAMES 10
+#define CONVERT_FRAMES 60
+
+static const struct {
+    int width, height;
+} sizes[] = {
+    {  640,  480 },
+    { 1280,  720 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+};
+
+#define NUMSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+/* texture formats frames are uploaded straight into, with the size of */
+/* one camera frame relative to width*height (in halves) */
+static const struct {
+    Uint32      format;
+    const char *name;
+    int         halves;
+} formats[] = {
+    { SDL_PIXELFORMAT_YUY2, "YUY2", 4 },
+    { SDL_PIXELFORMAT_NV12, "NV12", 3 },
+};
+
+#define NUMFORMATS (sizeof(formats) / sizeof(formats[0]))
+
+/* stand-in for a camera buffer, laid out as V4L2 would */
+struct frame {
+    Uint8 *data;
+    int    stride;     /* bytes per line of the first plane */
+    int    width, height;
+    Uint32 format;
+};
+
+static double
+elapsed_ms ( Uint64 start ) {
+    return (SDL_GetPerformanceCounter() - start) * 1000.0 /
+        SDL_GetPerformanceFrequency();
+}
+
+/* SDL_LockTexture then memcpy every row, as render() used to */
+static int
+upload_lock ( SDL_Texture *texture, const struct frame *f ) {
+    Uint8 *pixels;
+    int pitch;
+    int rows = f->format == SDL_PIXELFORMAT_NV12 ? f->height * 3 / 2 : f->height;
+    int bytes = f->format == SDL_PIXELFORMAT_NV12 ? f->width : f->width * 2;
+
+    if ( SDL_LockTexture( texture, NULL, (void **) &pixels, &pitch ) < 0 ) {
+        return 0;
+    }
+
+    for ( int y=0; y<rows; y++ ) {
+        memcpy( pixels + y*pitch, f->data + y*f->stride, bytes );
+    }
+
+    SDL_UnlockTexture(texture);
+    return 1;
+}
+
+/* hand the buffer straight to SDL with its own stride */
+static int
+upload_update ( SDL_Texture *texture, const struct frame *f ) {
+    if ( f->format == SDL_PIXELFORMAT_NV12 ) {
+        const Uint8 *uv = f->data + f->stride * f->height;
+        return SDL_UpdateNVTexture( 
+            texture, NULL, f->data, f->stride, uv, f->stride ) == 0;
+    }
+
+    return SDL_UpdateTexture( texture, NULL, f->data, f->stride ) == 0;
+}
+
+/* average milliseconds per frame for one upload path, -1 on failure */
+static double
+time_upload ( SDL_Renderer *renderer, SDL_Texture *texture,
+    const struct frame *f,
+    int (*upload) ( SDL_Texture *, const struct frame * ) ) {
+    for ( int i=0; i<WARMUP_FRAMES; i++ ) {
+        if ( upload(texture, f) == 0 ) { return -1; }
+    }
+
+    /* Draw and present every frame, so the renderer actually consumes */
+    /* the texture and a lazy upload can't look faster than it is. */
+    Uint64 start = SDL_GetPerformanceCounter();
+    for ( int i=0; i<BENCH_FRAMES; i++ ) {
+        if ( upload(texture, f) == 0 ||
+            SDL_RenderCopy(renderer, texture, NULL, NULL) < 0 ) {
+            return -1;
+        }
+        SDL_RenderPresent(renderer);
+    }
+
+    return elapsed_ms(start) / BENCH_FRAMES;
+}
+
+/* 0 if a frame couldn't be uploaded */
+static int
+bench_format ( SDL_Renderer *renderer, int size, int format ) {
+    struct frame f;
+    size_t bytes;
+    int ok = 1;
+
+    f.width = sizes[size].width;
+    f.height = sizes[size].height;
+    f.format = formats[format].format;
+    f.stride = f.format == SDL_PIXELFORMAT_NV12 ? f.width : f.width * 2;
+    bytes = (size_t) f.width * f.height * formats[format].halves / 2;
+
+    f.data = malloc(bytes);
+    SDL_Texture *texture = SDL_CreateTexture( 
+        renderer, f.format, SDL_TEXTUREACCESS_STREAMING, f.width, f.height
+    );
+
+    if ( f.data == NULL || texture == NULL ) {
+        fprintf( stdout, "%4dx%-4d %s  unavailable\n", f.width, f.height,
+            formats[format].name
+        );
+    } else {
+        for ( size_t i=0; i<bytes; i++ ) { f.data[i] = i * 7; }
+
+        double lock = time_upload(renderer, texture, &f, upload_lock);
+        double update = lock < 0 ? -1 : time_upload(renderer, texture, &f, upload_update);
+
+        if ( lock < 0 || update < 0 ) {
+            fprintf( stderr, "%4dx%-4d %s  upload failed: %s\n", f.width, f.height,
+                formats[format].name, SDL_GetError()
+            );
+            ok = 0;
+        } else {
+            fprintf( stdout, "%4dx%-4d %s  lock+copy %7.3f ms  update %7.3f ms"
+                "  (%.0f MB/s)\n",
+                f.width, f.height, formats[format].name, lock, update,
+                update > 0 ? bytes / update / 1000.0 : 0.0
+            );
+        }
+    }
+
+    if (texture) { SDL_DestroyTexture(texture); }
+    free(f.data);
+
+    return ok;
+}
+
+/* Time every conversion kernel the CPU can run at 1080p and check it */
+/* against the scalar reference, including at a width that leaves a tail */
+/* for the scalar code to finish. 0 if any of them didn't match. */
+static int
+bench_convert ( void ) {
+    struct convert_sample f, odd;
+    int all = 1;
+
+    memset(&f, 0, sizeof(struct convert_sample));
+    memset(&odd, 0, sizeof(struct convert_sample));
+    if ( convert_sample_alloc(&f, 1920, 1080) == 0 ||
+        convert_sample_alloc(&odd, 1000, 6) == 0 ) {
+        fprintf( stderr, "conversion: out of memory\n" );
+        convert_sample_free(&f);
+        convert_sample_free(&odd);
+        return 0;
+    }
+
+    fprintf( stdout, "YUV to RGB at 1920x1080, %d frames each (best: %s)\n",
+        CONVERT_FRAMES, convert_isa_name( convert_best() )
+    );
+
+    for ( int isa=0; isa<CONVERT_NUM_ISAS; isa++ ) {
+        if ( convert_use(isa) == 0 ) { continue; }
+
+        for ( int nv12=0; nv12<2; nv12++ ) {
+            for ( int out=0; out<CONVERT_NUM_OUTPUTS; out++ ) {
+                int exact = convert_matches_scalar(&f, isa, nv12, out) &&
+                    convert_matches_scalar(&odd, isa, nv12, out);
+                all = all && exact;
+
+                convert_use(isa);
+                Uint64 start = SDL_GetPerformanceCounter();
+                for ( int i=0; i<CONVERT_FRAMES; i++ ) {
+                    convert_sample_rgb(&f, nv12, out, f.out);
+                }
+                double ms = elapsed_ms(start) / CONVERT_FRAMES;
+
+                fprintf( stdout, "%-6s %s -> %-5s %7.3f ms  %6.1f fps  %s\n",
+                    convert_isa_name(isa), nv12 ? "NV12" : "YUYV",
+                    convert_output_name(out), ms, 1000.0 / ms,
+                    exact ? "exact" : "MISMATCH"
+                );
+            }
+
+            int exact = convert_i420_matches_scalar(&f, isa, nv12, f.height) &&
+                convert_i420_matches_scalar(&odd, isa, nv12, odd.height) &&
+                convert_i420_matches_scalar(&odd, isa, nv12, odd.height - 1);
+            all = all && exact;
+
+            convert_use(isa);
+            Uint64 start = SDL_GetPerformanceCounter();
+            for ( int i=0; i<CONVERT_FRAMES; i++ ) {
+                convert_sample_i420(&f, nv12, f.height, f.out);
+            }
+            double ms = elapsed_ms(start) / CONVERT_FRAMES;
+
+            fprintf( stdout, "%-6s %s -> I420  %7.3f ms  %6.1f fps  %s\n",
+                convert_isa_name(isa), nv12 ? "NV12" : "YUYV",
+                ms, 1000.0 / ms, exact ? "exact" : "MISMATCH"
+            );
+        }
+    }
+
+    convert_use( convert_best() );
+    convert_sample_free(&f);
+    convert_sample_free(&odd);
+
+    if ( all == 0 ) {
+        fprintf( stderr, "A conversion kernel doesn't match the scalar code\n" );
+    }
+
+    return all;
+}
+
+int
+bench_run ( void ) {
+    SDL_Window   *window = NULL;
+    SDL_Renderer *renderer = NULL;
+
+    /* a kernel that is wrong fails the run, however fast it is */
+    int exact = bench_convert();
+
+    if ( SDL_Init( SDL_INIT_VIDEO ) < 0 ) {
+        fprintf( stderr, "SDL_Init : %s\n", SDL_GetError() );
+        return 0;
+    }
+
+    if ( SDL_CreateWindowAndRenderer( 
+            320, 240, SDL_WINDOW_HIDDEN, &window, &renderer ) < 0 ) {
+        fprintf( stderr, "SDL_CreateWindowAndRenderer : %s\n", SDL_GetError() );
+        SDL_Quit();
+        return 0;
+    }
+
+    /* timings after a failed upload would mean nothing */
+    int ok = 1;
+    fprintf( stdout, "texture upload, %d frames each\n", BENCH_FRAMES );
+    for ( size_t i=0; i<NUMSIZES && ok; i++ ) {
+        for ( size_t j=0; j<NUMFORMATS && ok; j++ ) {
+            ok = bench_format(renderer, i, j);
+        }
+    }
+
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+
+    return ok && exact;
+}
@@ -0,0 +1,11 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* Time the YUV to RGB kernels (checking each against the scalar one) and */
+/* the ways we have of getting camera frames into a texture at a range of */
+/* common resolutions, printing the results to stdout. Needs no camera. */
+/* Returns 0 if a kernel didn't match, SDL could not be brought up or */
+/* a frame failed to upload. */
+int bench_run ( void );
+
+#endif
@@ -5,19 +5,76 @@
 #include <fcntl.h>     /* open */
 #include <unistd.h>    /* close */
 #include <memory.h>    /* memset */
+#include <pthread.h>   /* pthread_create */
+#include <signal.h>    /* sigwait */
+#include <stdatomic.h> /* atomic_exchange */
 #include <sys/mman.h>  /* mmap */
 #include <sys/ioctl.h> /* ioctl */
+#include <sys/epoll.h> /* epoll_wait */
+#include <sys/eventfd.h> /* eventfd */
+#include <sys/signalfd.h> /* signalfd */
+#include <time.h>      /* clock_gettime */
 
 #include <linux/videodev2.h>
 
 #include <SDL2/SDL.h>
 
+#include "bench.h"
+#include "fdserver.h"
+#include "frame.h"
+#include "httpd.h"
+#include "hud.h"
+#include "latency.h"
+#include "metrics.h"
+#include "mjpeg.h"
+#include "mkv.h"
+#include "prebuffer.h"
+#include "recorder.h"
+#include "shmbus.h"
+#include "snapshot.h"
+#include "source.h"
+#include "trace.h"
+#include "y4m.h"
+
 #define DEFAULT_SCREEN_WIDTH  800
 #define DEFAULT_SCREEN_HEIGHT 600
 #define DEFAULT_VIDEODEVICE   "/dev/video0"
+#define DEFAULT_FRAMERATE     30
+#define DEFAULT_EVENT_PREFIX  "event"
+#define DEFAULT_SNAPSHOT_PREFIX "snapshot"
 
 #define APP_NAME "Camera"
 #define NUMBUFS  16
+#define MAX_DECODERS 16
+#define MAX_SINKS    8
+
+/* released buffers are tracked as bits in a word */
+_Static_assert( NUMBUFS <= FRAME_MAX_BUFFERS, "NUMBUFS must fit in the release mask" );
+
+/* Capture formats we know how to put on screen, cheapest to display first. */
+/* MJPEG comes last since it needs a full decode, but it is often the only */
+/* way to get high resolutions at a decent frame rate over USB2. */
+struct pixfmt {
+    __u32       fourcc;
+    Uint32      texture;   /* SDL texture format frames are displayed with */
+    const char *path;      /* how frames get into the texture */
+};
+
+static const struct pixfmt pixfmts[] = {
+    { V4L2_PIX_FMT_NV12,  SDL_PIXELFORMAT_NV12,  "direct"                 },
+    { V4L2_PIX_FMT_YUYV,  SDL_PIXELFORMAT_YUY2,  "direct"                 },
+    { V4L2_PIX_FMT_GREY,  SDL_PIXELFORMAT_IYUV,  "luma with flat chroma"  },
+    { V4L2_PIX_FMT_MJPEG, SDL_PIXELFORMAT_RGB24, "jpeg decode"            },
+};
+
+#define NUMPIXFMTS (sizeof(pixfmts) / sizeof(pixfmts[0]))
+
+/* a candidate capture configuration */
+struct mode {
+    const struct pixfmt *pf;
+    __u32 width, height;
+    struct v4l2_fract interval;   /* time per frame, 0/0 when unknown */
+};
 
 struct state {
     /* camera properties */    
@@ -25,86 +82,1026 @@ struct state {
     struct v4l2_format fmt;
     struct v4l2_requestbuffers rb;
     struct v4l2_buffer buf;
+    struct v4l2_buffer bufs[NUMBUFS]; /* most recent dequeue of each buffer */
+    const struct pixfmt *pixfmt;      /* negotiated capture format */
+    struct mjpeg_decoder *decoder;    /* MJPEG decode on the render thread */
+    struct mjpeg_pool    *pool;       /* or MJPEG decode on worker threads */
     
-    int   fd;
-    void *mem[NUMBUFS];   
+    int    fd;
+    struct source *source;    /* frames from a pattern or recording, not fd */
+    void  *mem[NUMBUFS];   
+    size_t len[NUMBUFS];
+    int    dmafd[NUMBUFS];    /* buffers exported as dmabuf, -1 if not */
+    int    stride;            /* bytes per line of the first plane */
+    size_t frame_size;        /* bytes an uncompressed frame must fill */
+    size_t texture_size;      /* bytes a frame takes in the texture */
+
+    /* capture thread - owns fd and is the only one to (de)queue buffers */
+    pthread_t   capture;
+    int         capturing;   /* 1 while the capture thread is running */
+    int         epoll_fd;    /* waits on fd, wake_fd and signal_fd */
+    int         wake_fd;     /* eventfd - buffers released or quit requested */
+    int         signal_fd;   /* SIGUSR1 - trigger an event */
+    atomic_int  trigger;     /* flag - 1 when the sinks should be triggered */
+    int         queued;      /* buffers currently owned by the driver */
+    atomic_int  depth;       /* queued, for other threads to look at */
+    int         polling;     /* 1 while fd is armed in epoll_fd */
+    atomic_int  latest;      /* newest frame not yet taken for display, or -1 */
+    Uint32      frame_event; /* SDL event posted when a frame is published */
+    struct frame_bufs   frames; /* who still holds which buffer */
+    struct frame_format format; /* passed to sinks when they are created */
+    struct sink *sinks[MAX_SINKS]; /* consumers other than the display */
+    int          nsinks;
+    struct snapshot *snapshot; /* newest frame as a JPEG on demand */
+    struct metrics  *metrics;  /* counters for /metrics, the HUD and the title */
+    struct trace    *trace;    /* pipeline spans for -T, NULL when not tracing */
+    struct trace_ring *capture_trace; /* spans this thread records */
+    atomic_int  monotonic;   /* 1 if frames are stamped on CLOCK_MONOTONIC */
+    int64_t     dequeued_us[NUMBUFS]; /* when each buffer last came back */
+    struct latency to_dequeue; /* sensor timestamp to VIDIOC_DQBUF */
+    uint32_t    next_sequence; /* sequence the next frame ought to have */
+    int         sequenced;   /* 1 once a frame has set next_sequence */
+    struct metrics_slot *capture_slot; /* counters this thread keeps */
 
     /* screen properties */
     SDL_Window   *window;
     SDL_Renderer *renderer;
     SDL_Texture  *texture;
+    SDL_Texture  *targets[MJPEG_POOL_TARGETS(MAX_DECODERS)]; /* pool output */
+    int           ntargets;
+    int           shown_target; /* target on screen, -1 before the first */
+    struct v4l2_buffer shown; /* frame currently in texture */
+    int           has_frame;  /* 1 once the texture holds a camera frame */
+    int           dirty;      /* window needs repainting regardless */
+    int           lock_upload; /* copy through SDL_LockTexture */
+    Uint8        *flat;       /* neutral chroma plane for GREY */
+    int64_t       captured_us; /* sensor time of the frame uploaded, -1 unknown */
+    int64_t       uploaded_us; /* when it got into the texture */
+    int           unpresented; /* 1 until that frame has been presented */
+    struct latency to_upload;  /* VIDIOC_DQBUF to frame in the texture */
+    struct latency to_present; /* texture to SDL_RenderPresent returning */
+    struct latency end_to_end; /* sensor timestamp to SDL_RenderPresent */
+    struct metrics_slot *render_slot;
+    struct trace_ring *render_trace;
+    struct latency recent;    /* sensor to present since the last stats */
+    struct hud   *hud;        /* performance overlay */
+    int           show_hud;   /* 1 while it is drawn, toggled with o */
+
+    /* where the counters were at the last once a second update */
+    Uint32        stats_ticks;
+    int64_t       stats_cpu_us;
+    uint64_t      stats_captured, stats_presents;
+    uint64_t      title_drops[2];
 
     /* general properties */
+    int headless;            /* no window, frames only go to sinks */
     int width, height;       /* camera/screen resolution */
-    int quit;                /* flag - 1 when program should quit */
+    atomic_int quit;         /* flag - 1 when program should quit */
 };
 
 struct args {
     char *videodevice;
+    char *pixelformat;       /* fourcc to insist on, NULL to pick one */
     int   width, height;
+    int   framerate;
+    int   decoders;          /* MJPEG decode threads */
+    int   lock_upload;       /* copy frames in through SDL_LockTexture */
+    int   benchmark;         /* time texture uploads and exit */
+    char *shm_name;          /* publish frames on a shared memory bus */
+    char *socket_path;       /* pass frames to clients of a unix socket */
+    char *http_addr;         /* stream MJPEG to browsers */
+    char *record_path;       /* write raw frames to a file */
+    char *y4m_path;          /* write YUV4MPEG2 to a file or stdout */
+    char *mkv_path;          /* record MJPEG as is into Matroska */
+    int   segment;           /* seconds per file for -o and -m, 0 for one file */
+    int   prebuffer;         /* seconds held for a triggered dump, 0 for none */
+    int   prebuffer_kbps;    /* rate the prebuffer is sized for, 0 to guess */
+    char *trace_path;        /* Chrome trace of the pipeline written on exit */
     int   fullscreen;
+    int   headless;          /* capture for the sinks only, no SDL */
+    int   fast;              /* play a pattern or recording without pacing */
 };
 
-static void
-usage ( const char *progname ) {
-    fprintf( stdout, "usage: %s [options]\n", progname );
-    fprintf( stdout, "\n" );
-    fprintf( stdout, "options:\n" );
-    fprintf( stdout, "\t-d Path to video device\n" );
-    fprintf( stdout, "\t-W Screen width\n" );
-    fprintf( stdout, "\t-H Screen height\n" );
-    fprintf( stdout, "\t-f Run in fullscreen mode\n" );
-    fprintf( stdout, "\t-h Print this help message\n" );
+static void
+usage ( const char *progname ) {
+    fprintf( stdout, "usage: %s [options]\n", progname );
+    fprintf( stdout, "\n" );
+    fprintf( stdout, "options:\n" );
+    fprintf( stdout, "\t-d Path to video device, \"pattern\" for test bars, or a recording to play\n" );
+    fprintf( stdout, "\t   (raw with its .idx, Y4M or Matroska MJPEG, or bare raw sized by -W -H -p -r)\n" );
+    fprintf( stdout, "\t-W Screen width\n" );
+    fprintf( stdout, "\t-H Screen height\n" );
+    fprintf( stdout, "\t-r Capture frame rate\n" );
+    fprintf( stdout, "\t-p Capture pixel format (MJPG, NV12, YUYV, GREY)\n" );
+    fprintf( stdout, "\t-j MJPEG decoder threads\n" );
+    fprintf( stdout, "\t-l Upload frames with SDL_LockTexture and memcpy\n" );
+    fprintf( stdout, "\t-B Benchmark conversion and texture upload and exit\n" );
+    fprintf( stdout, "\t-s Publish frames to shared memory object (e.g. /camera0)\n" );
+    fprintf( stdout, "\t-u Serve frames as file descriptors on unix socket\n" );
+    fprintf( stdout, "\t-w Stream MJPEG over HTTP on [host:]port (host defaults to 127.0.0.1),\n" );
+    fprintf( stdout, "\t   stills at /snapshot.jpg and Prometheus counters at /metrics\n" );
+    fprintf( stdout, "\t-o Record raw frames to file, with a .idx frame index\n" );
+    fprintf( stdout, "\t-y Write YUV4MPEG2 to file, - for stdout\n" );
+    fprintf( stdout, "\t-m Record MJPEG frames into a Matroska file without re-encoding\n" );
+    fprintf( stdout, "\t-S Split -o and -m recordings into files this many seconds long\n" );
+    fprintf( stdout, "\t-e Keep this many seconds of frames, written to " DEFAULT_EVENT_PREFIX "-* on t, SIGUSR1\n" );
+    fprintf( stdout, "\t   or a socket trigger\n" );
+    fprintf( stdout, "\t-b Bit rate in kbps to size the -e buffer for\n" );
+    fprintf( stdout, "\t-T Trace the frame pipeline, written to file as Chrome trace JSON on exit\n" );
+    fprintf( stdout, "\t-f Run in fullscreen mode\n" );
+    fprintf( stdout, "\t--headless Capture without a window, for -s, -u, -w, -o, -y, -m and -e\n" );
+    fprintf( stdout, "\t--fast Play a pattern or recording as fast as frames are taken, not in real time\n" );
+    fprintf( stdout, "\t-h Print this help message\n" );
+
+
+    exit(0);
+}
+
+static void
+parse_args ( struct args *args, int argc, char *argv[] ) {
+    /* set up default values */
+    args->videodevice = DEFAULT_VIDEODEVICE;
+    args->width = DEFAULT_SCREEN_WIDTH;
+    args->height = DEFAULT_SCREEN_HEIGHT;
+    args->framerate = DEFAULT_FRAMERATE;
+    args->pixelformat = NULL;
+    args->decoders = 1;
+    args->lock_upload = 0;
+    args->benchmark = 0;
+    args->shm_name = NULL;
+    args->socket_path = NULL;
+    args->http_addr = NULL;
+    args->record_path = NULL;
+    args->y4m_path = NULL;
+    args->mkv_path = NULL;
+    args->segment = 0;
+    args->prebuffer = 0;
+    args->prebuffer_kbps = 0;
+    args->trace_path = NULL;
+    args->fullscreen = 0;
+    args->headless = 0;
+    args->fast = 0;
+
+    /* get command line input */
+    for ( int i = 1; i < argc; i++ ) {
+        if ( strcmp( argv[i], "--headless" ) == 0 ) {
+            args->headless = 1;
+        } else if ( strcmp( argv[i], "--fast" ) == 0 ) {
+            args->fast = 1;
+        } else if ( argv[i][0] == '-' ) {
+            /* found a flag - check what it means */
+            switch ( argv[i][1] ) {
+            case 'd': 
+                args->videodevice = argv[++i]; 
+                break;
+            case 'W':
+                args->width = atoi(argv[++i]);
+                break;
+            case 'H':
+                args->height = atoi(argv[++i]);
+                break;
+            case 'r':
+                args->framerate = atoi(argv[++i]);
+                break;
+            case 'p':
+                args->pixelformat = argv[++i];
+                break;
+            case 'j':
+                args->decoders = atoi(argv[++i]);
+                break;
+            case 'l':
+                args->lock_upload = 1;
+                break;
+            case 'B':
+                args->benchmark = 1;
+                break;
+            case 's':
+                args->shm_name = argv[++i];
+                break;
+            case 'u':
+                args->socket_path = argv[++i];
+                break;
+            case 'w':
+                args->http_addr = argv[++i];
+                break;
+            case 'o':
+                args->record_path = argv[++i];
+                break;
+            case 'y':
+                args->y4m_path = argv[++i];
+                break;
+            case 'm':
+                args->mkv_path = argv[++i];
+                break;
+            case 'S':
+                args->segment = atoi(argv[++i]);
+                break;
+            case 'e':
+                args->prebuffer = atoi(argv[++i]);
+                break;
+            case 'b':
+                args->prebuffer_kbps = atoi(argv[++i]);
+                break;
+            case 'T':
+                args->trace_path = argv[++i];
+                break;
+            case 'f':
+                args->fullscreen = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+            default:
+                fprintf( stderr, "Unexpected flag : %s\n", argv[i] );
+                break;
+            }
+        } else {
+            /* program doesn't expect any arguments */
+            fprintf( stderr, "Unexpected argument : %s\n", argv[i] ); 
+        }
+    }
+}
+
+static void
+queue_buffer ( struct state *s, int index ) {
+    struct v4l2_buffer buf;
+    int64_t start = trace_now(s->capture_trace);
+
+    memset( &buf, 0, sizeof(struct v4l2_buffer) );
+    buf.index = index;
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if ( s->source ? source_queue( s->source, index ) < 0 :
+        ioctl( s->fd, VIDIOC_QBUF, &buf ) < 0 ) {
+        fprintf( stderr, "Failed to requeue buffer %d\n", errno );
+        return;
+    }
+
+    trace_end( s->capture_trace, "QBUF", start, s->bufs[index].sequence );
+    s->queued++;
+}
+
+/* called from other threads when they are done with a buffer */
+static void
+release_buffer ( struct state *s, int index ) {
+    frame_release(&s->frames, index);
+}
+
+/* capture thread dropping one of the references it handed out */
+static void
+drop_buffer ( struct state *s, int index ) {
+    if ( frame_drop(&s->frames, index) ) { queue_buffer(s, index); }
+}
+
+static void
+requeue_released ( struct state *s ) {
+    unsigned int mask = frame_take_released(&s->frames);
+
+    for ( int i=0; mask != 0; i++, mask >>= 1 ) {
+        if ( mask & 1 ) { queue_buffer(s, i); }
+    }
+}
+
+/* With no buffers queued the driver reports POLLERR continuously, so the */
+/* camera is only watched while it has somewhere to put a frame. */
+static void
+arm_camera ( struct state *s ) {
+    struct epoll_event ev;
+    int polling = s->queued > 0;
+
+    atomic_store_explicit(&s->depth, s->queued, memory_order_relaxed);
+
+    if ( polling == s->polling ) { return; }
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = polling ? EPOLLIN : 0;
+    ev.data.fd = s->fd;
+    if ( epoll_ctl( s->epoll_fd, EPOLL_CTL_MOD, s->fd, &ev ) < 0 ) {
+        perror("epoll_ctl");
+        return;
+    }
+
+    s->polling = polling;
+}
+
+/* wake the render thread for a new frame */
+static void
+notify_render ( struct state *s ) {
+    SDL_Event e;
+
+    memset(&e, 0, sizeof(SDL_Event));
+    e.type = s->frame_event;
+    SDL_PushEvent(&e);
+}
+
+/* Hand a dequeued buffer to every consumer. Each one that keeps it takes */
+/* a reference; the buffer goes back to the driver when the last is gone. */
+static void
+publish_frame ( struct state *s, struct v4l2_buffer *buf ) {
+    int index = buf->index;
+    struct frame f;
+
+    s->bufs[index] = *buf;
+    frame_hold(&s->frames, index);
+
+    f.owner = &s->frames;
+    f.index = index;
+    f.data = s->mem[index];
+    f.bytesused = buf->bytesused;
+    f.sequence = buf->sequence;
+    f.timestamp = buf->timestamp;
+    f.dmafd = s->dmafd[index];
+
+    if ( s->snapshot ) { snapshot_update(s->snapshot, &f); }
+
+    /* sinks see every frame */
+    for ( int i=0; i<s->nsinks; i++ ) {
+        s->sinks[i]->push(s->sinks[i], &f);
+    }
+
+    if ( s->pool ) {
+        /* MJPEG decoders take every frame they have room for */
+        frame_ref(&f);
+        if ( mjpeg_pool_submit( 
+                s->pool, index, f.data, f.bytesused,
+                f.sequence, f.timestamp ) == 0 ) {
+            metrics_add(s->capture_slot, METRIC_APP_DROPS, 1);
+            drop_buffer(s, index);
+        }
+    } else if ( s->renderer ) {
+        /* publish the frame, taking back whatever was there before */
+        frame_ref(&f);
+        int old = atomic_exchange( &s->latest, index );
+        if ( old >= 0 ) {
+            /* render thread never got round to that one */
+            metrics_add(s->capture_slot, METRIC_APP_DROPS, 1);
+            drop_buffer(s, old);
+        } else {
+            /* slot was empty so the render thread may be asleep */
+            notify_render(s);
+        }
+    }
+
+    /* done with our own reference */
+    drop_buffer(s, index);
+}
+
+/* Frames the driver lost show up as gaps in the sequence numbers, or as */
+/* buffers it hands back flagged with an error. Drivers that don't count */
+/* frames leave sequence at 0, which never looks like a gap. */
+static void
+count_driver_drops ( struct state *s, const struct v4l2_buffer *buf ) {
+    unsigned int lost = 0;
+
+    if ( s->sequenced && buf->sequence > s->next_sequence ) {
+        lost = buf->sequence - s->next_sequence;
+    }
+    s->next_sequence = buf->sequence + 1;
+    s->sequenced = 1;
+
+    if ( buf->flags & V4L2_BUF_FLAG_ERROR ) { lost++; }
+    if ( lost ) { metrics_add(s->capture_slot, METRIC_DRIVER_DROPS, lost); }
+}
+
+/* Drain every frame the driver has ready. Returns 0 on a fatal error. */
+static int
+dequeue_frames ( struct state *s ) {
+    struct v4l2_buffer buf;
+
+    for (;;) {
+        memset(&buf, 0, sizeof(struct v4l2_buffer));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        int64_t start = trace_now(s->capture_trace);
+        if ( s->source ? source_dequeue( s->source, &buf ) < 0 :
+            ioctl(s->fd, VIDIOC_DQBUF, &buf) < 0 ) {
+            if ( errno == EAGAIN || errno == EINTR ) { return 1; }
+            if ( errno == EPIPE ) {
+                fprintf( stderr, "End of stream\n" );
+                return 0;
+            }
+            /* EIO marks a single corrupted frame, anything else is fatal */
+            fprintf( stderr, "Failed to dequeue buffer %d\n", errno );
+            return errno == EIO;
+        }
+
+        trace_end( s->capture_trace, "DQBUF", start, buf.sequence );
+        s->queued--;
+        count_driver_drops(s, &buf);
+
+        /* contents can't be trusted, straight back to the driver */
+        if ( buf.flags & V4L2_BUF_FLAG_ERROR ) {
+            queue_buffer(s, buf.index);
+            continue;
+        }
+        metrics_add(s->capture_slot, METRIC_FRAMES_CAPTURED, 1);
+
+        /* only a monotonic timestamp can be compared with our own clock */
+        int64_t now = latency_now_us();
+        int monotonic = (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+            V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+        atomic_store_explicit(&s->monotonic, monotonic, memory_order_relaxed);
+        s->dequeued_us[buf.index] = now;
+        if ( monotonic ) {
+            latency_record( &s->to_dequeue, now -
+                ((int64_t) buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec) );
+        }
+
+        publish_frame(s, &buf);
+    }
+}
+
+/* Flag an event for the sinks, from any thread. They are triggered on */
+/* the capture thread so that it happens between two pushes. */
+static void
+request_trigger ( struct state *s ) {
+    atomic_store(&s->trigger, 1);
+    frame_wake(&s->frames);
+}
+
+/* for the frame socket, which only knows us as a void pointer */
+static void
+socket_trigger ( void *arg ) {
+    request_trigger(arg);
+}
+
+static void
+trigger_sinks ( struct state *s ) {
+    int n = 0;
+
+    for ( int i=0; i<s->nsinks; i++ ) {
+        if ( s->sinks[i]->trigger ) {
+            s->sinks[i]->trigger(s->sinks[i]);
+            n++;
+        }
+    }
+
+    if ( n == 0 ) { fprintf( stderr, "Event triggered with no -e buffer to save\n" ); }
+}
+
+/* Capture thread. Sleeps in epoll until the camera has a frame or the */
+/* render thread hands buffers back, then hands the newest frame to the */
+/* render thread through s->latest. A frame the render thread never picked */
+/* up is requeued straight away, so a slow present costs us displayed */
+/* frames but never stalls the camera. */
+static void *
+capture ( void *arg ) {
+    struct state *s = arg;
+    struct epoll_event events[3];
+
+    while ( atomic_load(&s->quit) == 0 ) {
+        arm_camera(s);
+
+        int64_t waited = latency_now_us();
+        int n = epoll_wait( s->epoll_fd, events, 3, -1 );
+        metrics_add(s->capture_slot, METRIC_DEQUEUE_WAIT_US, latency_now_us() - waited);
+        if ( n < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            perror("epoll_wait");
+            break;
+        }
+
+        for ( int i=0; i<n; i++ ) {
+            if ( events[i].data.fd == s->wake_fd ) {
+                uint64_t count;
+                if ( read( s->wake_fd, &count, sizeof(count) ) < 0 ) {
+                    perror("eventfd");
+                }
+            } else if ( events[i].data.fd == s->signal_fd ) {
+                struct signalfd_siginfo si;
+                if ( read( s->signal_fd, &si, sizeof(si) ) == sizeof(si) ) {
+                    atomic_store(&s->trigger, 1);
+                }
+            } else if ( dequeue_frames(s) == 0 ) {
+                /* no more frames are coming so shut the whole thing down */
+                atomic_store(&s->quit, 1);
+                if ( s->headless ) {
+                    kill( getpid(), SIGTERM );
+                } else {
+                    SDL_Event e;
+                    memset(&e, 0, sizeof(SDL_Event));
+                    e.type = SDL_QUIT;
+                    SDL_PushEvent(&e);
+                }
+            }
+        }
+
+        if ( atomic_exchange(&s->trigger, 0) ) { trigger_sinks(s); }
+        requeue_released(s);
+    }
+
+    return NULL;
+}
+
+/* set up the descriptors the capture thread sleeps on */
+static int
+init_capture ( struct state *s ) {
+    struct epoll_event ev;
+    sigset_t usr1;
+
+    s->wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( s->wake_fd < 0 ) {
+        perror("eventfd");
+        return 0;
+    }
+    frame_bufs_init(&s->frames, s->wake_fd);
+
+    s->epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+    if ( s->epoll_fd < 0 ) {
+        perror("epoll_create1");
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = EPOLLIN;
+    ev.data.fd = s->wake_fd;
+    if ( epoll_ctl( s->epoll_fd, EPOLL_CTL_ADD, s->wake_fd, &ev ) < 0 ) {
+        perror("epoll_ctl");
+        return 0;
+    }
+
+    /* SIGUSR1 is blocked in every thread (see main) and read from here */
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    s->signal_fd = signalfd( -1, &usr1, SFD_NONBLOCK | SFD_CLOEXEC );
+    if ( s->signal_fd < 0 ) {
+        perror("signalfd");
+        return 0;
+    }
+
+    ev.data.fd = s->signal_fd;
+    if ( epoll_ctl( s->epoll_fd, EPOLL_CTL_ADD, s->signal_fd, &ev ) < 0 ) {
+        perror("epoll_ctl");
+        return 0;
+    }
+
+    /* camera starts out armed since every buffer is queued */
+    ev.data.fd = s->fd;
+    if ( epoll_ctl( s->epoll_fd, EPOLL_CTL_ADD, s->fd, &ev ) < 0 ) {
+        perror("epoll_ctl");
+        return 0;
+    }
+    s->polling = 1;
+
+    return 1;
+}
+
+static const struct pixfmt *
+find_pixfmt ( __u32 fourcc ) {
+    for ( size_t i=0; i<NUMPIXFMTS; i++ ) {
+        if ( pixfmts[i].fourcc == fourcc ) { return &pixfmts[i]; }
+    }
+    return NULL;
+}
+
+static const char *
+fourcc_name ( __u32 fourcc, char name[5] ) {
+    for ( int i=0; i<4; i++ ) { name[i] = (fourcc >> (8*i)) & 0xff; }
+    name[4] = '\0';
+    return name;
+}
+
+/* frames per second of a mode, or the requested rate if the driver */
+/* would not tell us */
+static double
+mode_rate ( const struct mode *m, int framerate ) {
+    if ( m->interval.numerator == 0 ) { return framerate; }
+    return (double) m->interval.denominator / m->interval.numerator;
+}
+
+static long
+mode_distance ( const struct mode *m, struct args *a ) {
+    return labs( (long) m->width - a->width ) +
+        labs( (long) m->height - a->height );
+}
+
+/* 1 if mode m is a better match for the request than mode best */
+static int
+better_mode ( const struct mode *m, const struct mode *best, struct args *a ) {
+    long dm = mode_distance(m, a), db = mode_distance(best, a);
+    if ( dm != db ) { return dm < db; }
+
+    /* at the same size, hitting the frame rate matters more than cost */
+    int fm = mode_rate(m, a->framerate) >= a->framerate;
+    int fb = mode_rate(best, a->framerate) >= a->framerate;
+    if ( fm != fb ) { return fm; }
+
+    /* formats are listed cheapest first */
+    return m->pf < best->pf;
+}
+
+/* closest frame size the camera offers for a format */
+static void
+choose_size ( struct state *s, struct args *a, struct mode *m ) {
+    struct v4l2_frmsizeenum fs;
+
+    memset( &fs, 0, sizeof(struct v4l2_frmsizeenum) );
+    fs.pixel_format = m->pf->fourcc;
+
+    /* driver can't list sizes - ask for what we want and let S_FMT decide */
+    m->width = a->width;
+    m->height = a->height;
+    if ( ioctl( s->fd, VIDIOC_ENUM_FRAMESIZES, &fs ) < 0 ) { return; }
+
+    if ( fs.type == V4L2_FRMSIZE_TYPE_DISCRETE ) {
+        struct mode c = *m;
+        long best = -1;
+
+        do {
+            c.width = fs.discrete.width;
+            c.height = fs.discrete.height;
+            if ( best < 0 || mode_distance(&c, a) < best ) {
+                best = mode_distance(&c, a);
+                *m = c;
+            }
+            fs.index++;
+        } while ( ioctl( s->fd, VIDIOC_ENUM_FRAMESIZES, &fs ) == 0 );
+    } else {
+        /* stepwise or continuous - clamp to the range and round to a step */
+        struct v4l2_frmsize_stepwise *sw = &fs.stepwise;
+        __u32 w = a->width < (int) sw->min_width ? sw->min_width : a->width;
+        __u32 h = a->height < (int) sw->min_height ? sw->min_height : a->height;
+        if ( w > sw->max_width )  { w = sw->max_width; }
+        if ( h > sw->max_height ) { h = sw->max_height; }
+        if ( sw->step_width > 1 ) {
+            w = sw->min_width + (w - sw->min_width) / sw->step_width * sw->step_width;
+        }
+        if ( sw->step_height > 1 ) {
+            h = sw->min_height + (h - sw->min_height) / sw->step_height * sw->step_height;
+        }
+        m->width = w;
+        m->height = h;
+    }
+}
+
+/* Frame interval for a format and size. Picks the slowest rate that still */
+/* meets the request, or the fastest available if none does. */
+static void
+choose_interval ( struct state *s, struct args *a, struct mode *m ) {
+    struct v4l2_frmivalenum fi;
+
+    memset( &fi, 0, sizeof(struct v4l2_frmivalenum) );
+    fi.pixel_format = m->pf->fourcc;
+    fi.width = m->width;
+    fi.height = m->height;
+
+    m->interval.numerator = 0;
+    m->interval.denominator = 0;
+    if ( ioctl( s->fd, VIDIOC_ENUM_FRAMEINTERVALS, &fi ) < 0 ) { return; }
+
+    if ( fi.type == V4L2_FRMIVAL_TYPE_DISCRETE ) {
+        struct mode c = *m;
+
+        do {
+            c.interval = fi.discrete;
+            if ( c.interval.numerator != 0 ) {
+                double rc = mode_rate(&c, a->framerate);
+                double rm = mode_rate(m, a->framerate);
+                int    ok = rc >= a->framerate;
+
+                if ( m->interval.numerator == 0 ||
+                    ( ok && (rm < a->framerate || rc < rm) ) ||
+                    ( !ok && rm < a->framerate && rc > rm ) ) {
+                    *m = c;
+                }
+            }
+            fi.index++;
+        } while ( ioctl( s->fd, VIDIOC_ENUM_FRAMEINTERVALS, &fi ) == 0 );
+    } else {
+        /* stepwise or continuous - clamp 1/framerate into the range */
+        struct mode fast = *m, slow = *m;
+        fast.interval = fi.stepwise.min;
+        slow.interval = fi.stepwise.max;
+
+        if ( fast.interval.numerator && mode_rate(&fast, 0) < a->framerate ) {
+            *m = fast;
+        } else if ( slow.interval.numerator && mode_rate(&slow, 0) > a->framerate ) {
+            *m = slow;
+        } else {
+            m->interval.numerator = 1;
+            m->interval.denominator = a->framerate;
+        }
+    }
+}
+
+/* the format asked for with -p, 0 if there wasn't one */
+static int
+parse_fourcc ( struct args *a, __u32 *fourcc ) {
+    *fourcc = 0;
+    if ( a->pixelformat == NULL ) { return 1; }
+
+    char code[4] = { ' ', ' ', ' ', ' ' };
+    memcpy( code, a->pixelformat, strnlen( a->pixelformat, 4 ) );
+    *fourcc = v4l2_fourcc( code[0], code[1], code[2], code[3] );
+    if ( find_pixfmt(*fourcc) == NULL ) {
+        fprintf( stderr, "Unsupported pixel format : %s\n", a->pixelformat );
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Walk every format, size and frame interval the camera offers and pick */
+/* the cheapest way of getting the requested resolution and frame rate. */
+static int
+choose_mode ( struct state *s, struct args *a, struct mode *best ) {
+    struct v4l2_fmtdesc fd;
+    __u32 wanted;
+
+    if ( parse_fourcc(a, &wanted) == 0 ) { return 0; }
+
+    best->pf = NULL;
+
+    memset( &fd, 0, sizeof(struct v4l2_fmtdesc) );
+    fd.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for ( fd.index = 0; ioctl( s->fd, VIDIOC_ENUM_FMT, &fd ) == 0; fd.index++ ) {
+        struct mode m;
+
+        m.pf = find_pixfmt(fd.pixelformat);
+        if ( m.pf == NULL ) { continue; }
+        if ( wanted && m.pf->fourcc != wanted ) { continue; }
+
+        choose_size(s, a, &m);
+        choose_interval(s, a, &m);
+
+        if ( best->pf == NULL || better_mode(&m, best, a) ) { *best = m; }
+    }
+
+    if ( best->pf == NULL ) {
+        fprintf( stderr, "%s offers no pixel format we can display\n",
+            a->videodevice
+        );
+        return 0;
+    }
+
+    return 1;
+}
+
+/* try to run the camera at the chosen frame rate - not fatal if it won't */
+static void
+set_interval ( struct state *s, const struct mode *m ) {
+    struct v4l2_streamparm parm;
+
+    if ( m->interval.numerator == 0 ) { return; }
+
+    memset( &parm, 0, sizeof(struct v4l2_streamparm) );
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if ( ioctl( s->fd, VIDIOC_G_PARM, &parm ) < 0 ) { return; }
+    if ( (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) == 0 ) { return; }
+
+    parm.parm.capture.timeperframe = m->interval;
+    if ( ioctl( s->fd, VIDIOC_S_PARM, &parm ) < 0 ) {
+        fprintf( stderr, "Unable to set frame interval %d\n", errno );
+    }
+}
+
+/* shared memory bus - every frame is copied in on the capture thread */
+struct shm_sink {
+    struct sink    sink;
+    struct shmbus *bus;
+    unsigned long  dropped;   /* frames too big for a slot */
+};
+
+static void
+shm_push ( struct sink *sink, const struct frame *f ) {
+    struct shm_sink *shm = (struct shm_sink *) sink;
+    if ( shmbus_publish( shm->bus, f->data, f->bytesused, f->sequence,
+            frame_time_us(f) ) == 0 ) {
+        shm->dropped++;
+    }
+}
+
+static void
+shm_destroy ( struct sink *sink ) {
+    struct shm_sink *shm = (struct shm_sink *) sink;
+    if ( shm->dropped ) {
+        fprintf( stderr, "Shared memory bus dropped %lu frames too big for a slot\n",
+            shm->dropped );
+    }
+    shmbus_close(shm->bus);
+    free(shm);
+}
+
+static struct sink *
+shm_sink_create ( const char *name, const struct frame_format *fmt ) {
+    struct shmbus_info info;
+    struct shm_sink *shm = calloc(1, sizeof(struct shm_sink));
+    if ( shm == NULL ) { return NULL; }
+
+    memset( &info, 0, sizeof(struct shmbus_info) );
+    info.pixelformat = fmt->pixelformat;
+    info.width = fmt->width;
+    info.height = fmt->height;
+    info.stride = fmt->stride;
+    info.slot_size = fmt->sizeimage;
+
+    shm->bus = shmbus_create(name, &info);
+    if ( shm->bus == NULL ) {
+        free(shm);
+        return NULL;
+    }
+
+    shm->sink.name = "shared memory bus";
+    shm->sink.push = shm_push;
+    shm->sink.destroy = shm_destroy;
+
+    return &shm->sink;
+}
+
+static int
+add_sink ( struct state *s, struct sink *sink, const char *what ) {
+    if ( sink == NULL ) {
+        fprintf( stderr, "Unable to start %s\n", what );
+        return 0;
+    }
+
+    if ( s->nsinks == MAX_SINKS ) {
+        fprintf( stderr, "Too many outputs, not starting %s\n", what );
+        sink->destroy(sink);
+        return 0;
+    }
+
+    s->sinks[s->nsinks++] = sink;
+    return 1;
+}
+
+/* start every output asked for on the command line */
+static int
+init_sinks ( struct state *s, struct args *a ) {
+    if ( a->shm_name && 
+        add_sink( s, shm_sink_create(a->shm_name, &s->format), "shared memory bus" ) == 0 ) {
+        return 0;
+    }
+
+    if ( a->socket_path && 
+        add_sink( s, fdserver_create(a->socket_path, &s->format, socket_trigger, s), "frame socket" ) == 0 ) {
+        return 0;
+    }
+
+    if ( a->http_addr && 
+        add_sink( s, httpd_create(a->http_addr, &s->format, s->snapshot, s->metrics), "HTTP server" ) == 0 ) {
+        return 0;
+    }
+
+    if ( a->record_path && 
+        add_sink( s, recorder_create(a->record_path, &s->format, a->segment), "recorder" ) == 0 ) {
+        return 0;
+    }
+
+    if ( a->y4m_path && 
+        add_sink( s, y4m_create(a->y4m_path, &s->format), "Y4M output" ) == 0 ) {
+        return 0;
+    }
+
+    if ( a->mkv_path && 
+        add_sink( s, mkv_sink_create(a->mkv_path, &s->format, a->segment), "MJPEG recorder" ) == 0 ) {
+        return 0;
+    }
+
+    if ( a->prebuffer &&
+        add_sink( s, prebuffer_create(DEFAULT_EVENT_PREFIX, &s->format,
+            a->prebuffer, a->prebuffer_kbps), "event prebuffer" ) == 0 ) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Export every buffer as a dmabuf so other stages and processes can */
+/* share frames without copying. Older drivers can't, which is not fatal - */
+/* consumers check dmafd and fall back on the mapping. */
+static void
+export_buffers ( struct state *s ) {
+    struct v4l2_exportbuffer eb;
+
+    for ( int i=0; i<NUMBUFS; i++ ) {
+        memset( &eb, 0, sizeof(struct v4l2_exportbuffer) );
+        eb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        eb.index = i;
+        eb.flags = O_RDONLY | O_CLOEXEC;
+        if ( ioctl( s->fd, VIDIOC_EXPBUF, &eb ) < 0 ) {
+            fprintf( stderr, "Unable to export buffer %d as dmabuf %d\n", i, errno );
+            return;
+        }
+
+        s->dmafd[i] = eb.fd;
+    }
+}
+
+/* decoder pool callbacks, called from the worker threads */
+static void
+pool_release ( void *ctx, int index ) {
+    release_buffer(ctx, index);
+}
+
+static void
+pool_ready ( void *ctx ) {
+    notify_render(ctx);
+}
+
+static const struct mjpeg_pool_ops pool_ops = { pool_release, pool_ready };
+
+/* lock a pool target and let the decoders write straight into it */
+static void
+give_target ( struct state *s, int target ) {
+    void *pixels;
+    int pitch;
+
+    if ( SDL_LockTexture( s->targets[target], NULL, &pixels, &pitch ) < 0 ) {
+        fprintf( stderr, "SDL_LockTexture : %s\n", SDL_GetError() );
+        return;
+    }
+
+    mjpeg_pool_give(s->pool, target, pixels, pitch);
+}
+
+/* Parallel MJPEG decode. Each worker decodes into the locked memory of */
+/* its own texture, the render thread unlocks and shows whichever comes */
+/* out next, then locks the previous one and hands it back. */
+static int
+init_decoders ( struct state *s, struct args *a ) {
+    int workers = a->decoders > MAX_DECODERS ? MAX_DECODERS : a->decoders;
+
+    s->pool = mjpeg_pool_create( workers, s->width, s->height, &pool_ops, s );
+    if ( s->pool == NULL ) {
+        fprintf( stderr, "Unable to start MJPEG decoders\n" );
+        return 0;
+    }
+
+    for ( ; s->ntargets < MJPEG_POOL_TARGETS(workers); s->ntargets++ ) {
+        s->targets[s->ntargets] = SDL_CreateTexture(
+            s->renderer, s->pixfmt->texture, SDL_TEXTUREACCESS_STREAMING,
+            s->width, s->height
+        );
+
+        if ( s->targets[s->ntargets] == NULL ) {
+            fprintf( stderr, "SDL_CreateTexture : %s\n", SDL_GetError() );
+            return 0;
+        }
+
+        give_target(s, s->ntargets);
+    }
+
+    return 1;
+}
+
+/* window, renderer and textures - everything the headless mode skips */
+static int
+init_display ( struct state *s, struct args *a ) {
+    /* initialize SDL which will be used for rendering */
+    if ( SDL_Init( SDL_INIT_VIDEO ) < 0 ) {
+        fprintf( stderr, "SDL_Init : %s\n", SDL_GetError() );
+        return 0;
+    }
+
+    int stat = SDL_CreateWindowAndRenderer( 
+        s->width, s->height, a->fullscreen * SDL_WINDOW_FULLSCREEN_DESKTOP,
+        &s->window, &s->renderer
+    );
+
+    if ( stat < 0 ) {
+        fprintf( stderr, "SDL_CreateWindowAndRenderer : %s\n", SDL_GetError() );
+        return 0;
+    }
 
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+    SDL_RenderSetLogicalSize(s->renderer, s->width, s->height);
+    SDL_SetWindowTitle(s->window, APP_NAME);
 
-    exit(0);
-}
+    s->hud = hud_create( s->renderer, s->height );
+    if ( s->hud == NULL ) { return 0; }
 
-static void
-parse_args ( struct args *args, int argc, char *argv[] ) {
-    /* set up default values */
-    args->videodevice = DEFAULT_VIDEODEVICE;
-    args->width = DEFAULT_SCREEN_WIDTH;
-    args->height = DEFAULT_SCREEN_HEIGHT;
-    args->fullscreen = 0;
+    /* Pixel format comes from the negotiated capture format. */
+    /* We're going to write pixels directly to texture so enable streaming. */
+    if ( s->pixfmt->fourcc == V4L2_PIX_FMT_MJPEG && a->decoders > 1 ) {
+        if ( init_decoders(s, a) == 0 ) { return 0; }
+    } else {
+        s->texture =SDL_CreateTexture( 
+            s->renderer, s->pixfmt->texture, SDL_TEXTUREACCESS_STREAMING,
+            s->width, s->height
+        );
 
-    /* get command line input */
-    for ( int i = 1; i < argc; i++ ) {
-        if ( argv[i][0] == '-' ) {
-            /* found a flag - check what it means */
-            switch ( argv[i][1] ) {
-            case 'd': 
-                args->videodevice = argv[++i]; 
-                break;
-            case 'W':
-                args->width = atoi(argv[++i]);
-                break;
-            case 'H':
-                args->height = atoi(argv[++i]);
-                break;
-            case 'f':
-                args->fullscreen = 1;
-                break;
-            case 'h':
-                usage(argv[0]);
-            default:
-                fprintf( stderr, "Unexpected flag : %s\n", argv[i] );
-                break;
-            }
-        } else {
-            /* program doesn't expect any arguments */
-            fprintf( stderr, "Unexpected argument : %s\n", argv[i] ); 
+        if ( s->texture == NULL ) {
+            fprintf( stderr, "SDL_CreateTexture : %s\n", SDL_GetError() );
+            return 0;
         }
     }
+
+    /* the capture thread wakes the render loop with this event */
+    s->frame_event = SDL_RegisterEvents(1);
+    if ( s->frame_event == (Uint32) -1 ) {
+        fprintf( stderr, "SDL_RegisterEvents : %s\n", SDL_GetError() );
+        return 0;
+    }
+
+    return 1;
 }
 
+/* Negotiate a format with a V4L2 device, map its buffers and start it */
+/* streaming with every buffer queued. */
 static int
-init ( struct state *s, struct args *a ) {
-    /* zero everything in program state */
-    memset(s, 0, sizeof(struct state));
-    
-    /* open camera file */
-    s->fd = open(a->videodevice, O_RDWR);
+open_camera ( struct state *s, struct args *a ) {
+    /* open camera file - non-blocking so the capture thread can use epoll */
+    s->fd = open(a->videodevice, O_RDWR | O_NONBLOCK);
     if ( s->fd < 0 ) { 
         perror(a->videodevice);
         return 0;
@@ -126,19 +1123,38 @@ init ( struct state *s, struct args *a ) {
         return 0;   
     }
 
+    /* work out the best format the camera can give us */
+    struct mode mode;
+    if ( choose_mode(s, a, &mode) == 0 ) { return 0; }
+
     /* set up the camera's capture format */
     s->fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    s->fmt.fmt.pix.width = a->width;
-    s->fmt.fmt.pix.height = a->height;    
+    s->fmt.fmt.pix.width = mode.width;
+    s->fmt.fmt.pix.height = mode.height;    
     s->fmt.fmt.pix.field = V4L2_FIELD_ANY;
-    /* I guess you should query this from cap? */
-    s->fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV; 
+    s->fmt.fmt.pix.pixelformat = mode.pf->fourcc; 
 
-    if ( ioctl(s->fd, VIDIOC_S_FMT, s->fmt) < 0 ) {
+    if ( ioctl(s->fd, VIDIOC_S_FMT, &s->fmt) < 0 ) {
         fprintf( stderr, "%s cannot set format\n", a->videodevice );
         return 0; 
     }
 
+    /* drivers are allowed to hand back a different format */
+    s->pixfmt = find_pixfmt(s->fmt.fmt.pix.pixelformat);
+    if ( s->pixfmt == NULL ) {
+        fprintf( stderr, "%s changed to an unsupported format\n", a->videodevice );
+        return 0;
+    }
+
+    set_interval(s, &mode);
+
+    char name[5];
+    fprintf( stderr, "Capturing %s %dx%d at %.2f fps (%s)\n",
+        fourcc_name(s->pixfmt->fourcc, name),
+        s->fmt.fmt.pix.width, s->fmt.fmt.pix.height,
+        mode_rate(&mode, a->framerate), s->pixfmt->path
+    );
+
     /* Setting the format can succeed if the resolution is not supported. */
     /* This block checks for problems with resolution and updates accordingly */
     if ( s->fmt.fmt.pix.width != a->width ||
@@ -159,6 +1175,16 @@ init ( struct state *s, struct args *a ) {
     s->width = a->width;
     s->height = a->height;
 
+    /* drivers may pad lines, only fall back on packed rows if they don't say */
+    s->stride = s->fmt.fmt.pix.bytesperline;
+    if ( s->stride == 0 ) {
+        s->stride = s->pixfmt->fourcc == V4L2_PIX_FMT_YUYV ? s->width * 2 : s->width;
+    }
+
+    /* the rest of what sinks get told is filled in by init */
+    s->format.sizeimage = s->fmt.fmt.pix.sizeimage;
+    s->format.fps = mode_rate(&mode, a->framerate);
+
     /* set up how we will get data from camera (use memory mapping) */
     s->rb.count = NUMBUFS;
     s->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -186,10 +1212,15 @@ init ( struct state *s, struct args *a ) {
 
         if ( s->mem[i] == MAP_FAILED ) {
             fprintf (stderr, "Unable to map buffer %d\n", i);
+            s->mem[i] = NULL;
             return 0;
         }
+
+        s->len[i] = s->buf.length;
     }
 
+    export_buffers(s);
+
     /* queue buffers */    
     for ( int i=0; i<NUMBUFS; i++ ) {
         memset( &s->buf, 0, sizeof(struct v4l2_buffer));
@@ -200,6 +1231,7 @@ init ( struct state *s, struct args *a ) {
             fprintf (stderr, "Unable to queue buffer %d\n", i);
             return 0;
         }
+        s->queued++;
     }
     
     /* enable streaming from the camera */
@@ -209,32 +1241,163 @@ init ( struct state *s, struct args *a ) {
         return 0;
     }
 
-    /* initialize SDL which will be used for rendering */
-    if ( SDL_Init( SDL_INIT_VIDEO ) < 0 ) {
-        fprintf( stderr, "SDL_Init : %s\n", SDL_GetError() );
+    return 1;
+}
+
+/* A test pattern or recording in place of the camera. Its buffers all */
+/* start out queued, like the camera's, and it has a descriptor that */
+/* polls readable when a frame is due. */
+static int
+open_source ( struct state *s, struct args *a ) {
+    struct source_request req;
+
+    if ( parse_fourcc(a, &req.pixelformat) == 0 ) { return 0; }
+    req.width = a->width;
+    req.height = a->height;
+    req.fps = a->framerate;
+
+    s->source = source_open( a->videodevice, &req, NUMBUFS, a->fast );
+    if ( s->source == NULL ) {
+        fprintf( stderr, "Unable to play %s\n", a->videodevice );
         return 0;
     }
 
-    int stat = SDL_CreateWindowAndRenderer( 
-        s->width, s->height, a->fullscreen * SDL_WINDOW_FULLSCREEN_DESKTOP,
-        &s->window, &s->renderer
+    const struct frame_format *fmt = source_format(s->source);
+    s->pixfmt = find_pixfmt(fmt->pixelformat);
+    if ( s->pixfmt == NULL ) {
+        fprintf( stderr, "%s is in a format we can't display\n", a->videodevice );
+        return 0;
+    }
+
+    char name[5];
+    fprintf( stderr, "Playing %s %s %dx%d at %.2f fps (%s)%s\n", a->videodevice,
+        fourcc_name(s->pixfmt->fourcc, name), fmt->width, fmt->height, fmt->fps,
+        s->pixfmt->path, a->fast ? " as fast as possible" : ""
     );
 
-    if ( stat < 0 ) {
-        fprintf( stderr, "SDL_CreateWindowAndRenderer : %s\n", SDL_GetError() );
+    /* the window is sized for the frames, as with a camera */
+    a->width = s->width = fmt->width;
+    a->height = s->height = fmt->height;
+    s->stride = fmt->stride;
+    s->format.sizeimage = fmt->sizeimage;
+    s->format.fps = fmt->fps;
+
+    for ( int i=0; i<NUMBUFS; i++ ) {
+        s->mem[i] = source_buffer( s->source, i, &s->len[i] );
+    }
+    s->fd = source_fd(s->source);
+    s->queued = NUMBUFS;
+
+    return 1;
+}
+
+static int
+init ( struct state *s, struct args *a ) {
+    /* zero everything in program state */
+    memset(s, 0, sizeof(struct state));
+    atomic_init(&s->latest, -1);
+    s->shown_target = -1;
+    s->headless = a->headless;
+    s->epoll_fd = -1;
+    s->wake_fd = -1;
+    s->signal_fd = -1;
+    atomic_init(&s->trigger, 0);
+    atomic_init(&s->monotonic, 0);
+    atomic_init(&s->depth, 0);
+    for ( int i=0; i<NUMBUFS; i++ ) { s->dmafd[i] = -1; }
+
+    /* one slot for the capture thread, one for render */
+    s->metrics = metrics_create();
+    if ( s->metrics == NULL ) {
+        fprintf( stderr, "Failed to allocate metrics\n" );
         return 0;
     }
+    s->capture_slot = metrics_slot(s->metrics);
+    s->render_slot = metrics_slot(s->metrics);
 
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-    SDL_RenderSetLogicalSize(s->renderer, s->width, s->height);
-    SDL_SetWindowTitle(s->window, APP_NAME);
+    if ( a->trace_path ) {
+        s->trace = trace_create(a->trace_path);
+        if ( s->trace == NULL ) {
+            fprintf( stderr, "Failed to start trace : %s\n", a->trace_path );
+            return 0;
+        }
+        s->capture_trace = trace_ring(s->trace, "capture");
+        s->render_trace = trace_ring(s->trace, "render");
+    }
+    
+    /* anything that isn't a pattern or a file is taken for a camera */
+    if ( source_handles(a->videodevice) ) {
+        if ( open_source(s, a) == 0 ) { return 0; }
+    } else if ( open_camera(s, a) == 0 ) {
+        return 0;
+    }
 
-    /* Pixel format should match that of the camera for simplicity. */
-    /* We're going to write pixels directly to texture so enable streaming. */
-    s->texture =SDL_CreateTexture( 
-        s->renderer, SDL_PIXELFORMAT_YUY2, SDL_TEXTUREACCESS_STREAMING,
-        s->width, s->height
-    );
+    /* nothing gets decoded unless it is going on screen */
+    if ( s->pixfmt->fourcc == V4L2_PIX_FMT_MJPEG && a->decoders <= 1 &&
+        s->headless == 0 ) {
+        s->decoder = mjpeg_create();
+        if ( s->decoder == NULL ) {
+            fprintf( stderr, "Unable to create MJPEG decoder\n" );
+            return 0;
+        }
+    }
+
+    s->frame_size = (size_t) s->stride * s->height;
+    if ( s->pixfmt->fourcc == V4L2_PIX_FMT_NV12 ) {
+        s->frame_size += s->frame_size / 2;
+    }
+
+    /* RGB24 out of the decoder, two bytes a pixel for YUYV, and 4:2:0 */
+    /* for NV12 and GREY, which gets its flat chroma */
+    s->texture_size = (size_t) s->width * s->height;
+    switch ( s->pixfmt->fourcc ) {
+    case V4L2_PIX_FMT_MJPEG: s->texture_size *= 3; break;
+    case V4L2_PIX_FMT_YUYV:  s->texture_size *= 2; break;
+    default:                 s->texture_size += s->texture_size / 2; break;
+    }
+
+    /* what sinks get told about the stream */
+    s->format.pixelformat = s->pixfmt->fourcc;
+    s->format.width = s->width;
+    s->format.height = s->height;
+    s->format.stride = s->stride;
+    if ( s->format.sizeimage < s->frame_size ) { s->format.sizeimage = s->frame_size; }
+
+    /* GREY is shown with both chroma planes held at neutral */
+    s->lock_upload = a->lock_upload;
+    if ( s->pixfmt->fourcc == V4L2_PIX_FMT_GREY && s->headless == 0 ) {
+        s->flat = malloc( (size_t) s->width * s->height / 4 );
+        if ( s->flat == NULL ) {
+            fprintf( stderr, "Out of memory\n" );
+            return 0;
+        }
+        memset( s->flat, 128, (size_t) s->width * s->height / 4 );
+    }
+
+    if ( s->headless == 0 && init_display(s, a) == 0 ) { return 0; }
+
+    /* stills for the s key and the HTTP server */
+    if ( s->headless == 0 || a->http_addr ) {
+        s->snapshot = snapshot_create(&s->format);
+        if ( s->snapshot == NULL ) {
+            fprintf( stderr, "Unable to set up snapshots\n" );
+            return 0;
+        }
+    }
+
+    if ( init_sinks(s, a) == 0 ) { return 0; }
+    if ( s->headless && s->nsinks == 0 ) {
+        fprintf( stderr, "Running headless with nowhere to send frames\n" );
+    }
+
+    /* from here on only the capture thread touches the camera */
+    if ( init_capture(s) == 0 ) { return 0; }
+
+    if ( pthread_create( &s->capture, NULL, capture, s ) != 0 ) {
+        fprintf( stderr, "Unable to start capture thread\n" );
+        return 0;
+    }
+    s->capturing = 1;
 
     return 1;
 }
@@ -243,75 +1406,414 @@ static void
 handle_events ( struct state *s ) {
     SDL_Event e;
 
-    while ( SDL_PollEvent(&e) ) {
+    /* sleep until something happens - new frames arrive as events too */
+    if ( SDL_WaitEvent(&e) == 0 ) { return; }
+
+    do {
         switch (e.type) {
         case SDL_QUIT:
-            s->quit = 1;
+            atomic_store(&s->quit, 1);
             break;
         case SDL_KEYDOWN:
-            if ( e.key.keysym.sym == SDLK_q ) { s->quit = 1; }
+            if ( e.key.keysym.sym == SDLK_q ) { atomic_store(&s->quit, 1); }
+            if ( e.key.keysym.sym == SDLK_t ) { request_trigger(s); }
+            if ( e.key.keysym.sym == SDLK_s ) { snapshot_save_later(s->snapshot, DEFAULT_SNAPSHOT_PREFIX); }
+            if ( e.key.keysym.sym == SDLK_o ) {
+                s->show_hud = !s->show_hud;
+                s->dirty = 1;
+            }
             break;     
+        case SDL_WINDOWEVENT:
+            /* window contents were lost or rescaled - present again */
+            if ( e.window.event == SDL_WINDOWEVENT_EXPOSED ||
+                e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED ) {
+                s->dirty = 1;
+            }
+            break;
         }
+    } while ( SDL_PollEvent(&e) );
+}
+
+/* Let SDL read straight out of the mapped camera buffer. Saves a full */
+/* frame memcpy over locking, and copes with padded lines for free. */
+static int
+update_frame ( struct state *s, int index ) {
+    const Uint8 *y = s->mem[index];
+    int ok = -1;
+
+    switch ( s->pixfmt->fourcc ) {
+    case V4L2_PIX_FMT_YUYV:
+        ok = SDL_UpdateTexture( s->texture, NULL, y, s->stride );
+        break;
+    case V4L2_PIX_FMT_NV12:
+        /* chroma follows luma with the same stride */
+        ok = SDL_UpdateNVTexture( 
+            s->texture, NULL, y, s->stride, y + s->stride*s->height, s->stride
+        );
+        break;
+    case V4L2_PIX_FMT_GREY:
+        ok = SDL_UpdateYUVTexture( 
+            s->texture, NULL, y, s->stride, 
+            s->flat, s->width/2, s->flat, s->width/2
+        );
+        break;
+    }
+
+    if ( ok < 0 ) {
+        fprintf( stderr, "SDL_UpdateTexture : %s\n", SDL_GetError() );
+        return 0;
     }
+
+    return 1;
 }
 
+/* Copy rows of bytes between planes whose lines may be padded */
+/* differently. When neither side pads it is one contiguous copy, */
+/* otherwise one memcpy per row - both end up in libc's vectorized copy. */
 static void
-render ( struct state *s ) {
-    void *pixels;
-    int pitch;
-
-    /* dequeue the next frame from the camera */
-    memset(&s->buf, 0, sizeof(struct v4l2_buffer));
-    s->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    s->buf.memory = V4L2_MEMORY_MMAP;
-    if ( ioctl(s->fd, VIDIOC_DQBUF, &s->buf) < 0 ) {
-        fprintf( stderr, "Failed to dequeue buffer %d\n", errno );
+copy_plane ( Uint8 *dst, int dst_pitch, const Uint8 *src, int src_pitch,
+    int bytes, int rows ) {
+    if ( dst_pitch == bytes && src_pitch == bytes ) {
+        memcpy( dst, src, (size_t) bytes * rows );
         return;
     }
 
-    SDL_LockTexture( s->texture, NULL, &pixels, &pitch );
-    
-    /* FIXME: Should be better behaviour to handle pixels size != 2 bytes */
-    if ( pitch/s->width != sizeof(Uint16) ) {
-        fprintf( stderr, "mismatch between texture size and buffer size\n" );
-    } else {
-        /* copy camera buffer over to texture */ 
-        memcpy( 
-            pixels, s->mem[s->buf.index], s->width*s->height*sizeof(Uint16) 
+    for ( int y=0; y<rows; y++ ) {
+        memcpy( dst, src, bytes );
+        dst += dst_pitch;
+        src += src_pitch;
+    }
+}
+
+static void
+fill_plane ( Uint8 *dst, int dst_pitch, int value, int bytes, int rows ) {
+    for ( int y=0; y<rows; y++, dst += dst_pitch ) {
+        memset( dst, value, bytes );
+    }
+}
+
+/* get a frame into the texture, returns 0 if it had to be dropped */
+static int
+upload_frame ( struct state *s, int index ) {
+    const struct v4l2_buffer *buf = &s->bufs[index];
+    const Uint8 *src = s->mem[index];
+    Uint8 *pixels;
+    int pitch, ok = 1;
+    int64_t start;
+
+    /* a short uncompressed frame would leave stale rows on screen */
+    if ( s->pixfmt->fourcc != V4L2_PIX_FMT_MJPEG && 
+        buf->bytesused != 0 && buf->bytesused < s->frame_size ) {
+        fprintf( stderr, "Dropping short frame %u (%u of %zu bytes)\n",
+            buf->sequence, buf->bytesused, s->frame_size
+        );
+        return 0;
+    }
+
+    /* MJPEG has to be decoded into locked memory whichever way */
+    if ( s->pixfmt->fourcc != V4L2_PIX_FMT_MJPEG && s->lock_upload == 0 ) {
+        start = trace_now(s->render_trace);
+        ok = update_frame(s, index);
+        trace_end( s->render_trace, "SDL_UpdateTexture", start, buf->sequence );
+        return ok;
+    }
+
+    start = trace_now(s->render_trace);
+    if ( SDL_LockTexture( s->texture, NULL, (void **) &pixels, &pitch ) < 0 ) {
+        fprintf( stderr, "SDL_LockTexture : %s\n", SDL_GetError() );
+        return 0;
+    }
+    trace_end( s->render_trace, "SDL_LockTexture", start, buf->sequence );
+    start = trace_now(s->render_trace);
+
+    /* texture pitch and camera stride are independent of each other */
+    switch ( s->pixfmt->fourcc ) {
+    case V4L2_PIX_FMT_MJPEG:
+        ok = mjpeg_decode( 
+            s->decoder, src, buf->bytesused,
+            pixels, pitch, s->width, s->height
+        );
+        break;
+    case V4L2_PIX_FMT_YUYV:
+        copy_plane( pixels, pitch, src, s->stride, s->width*2, s->height );
+        break;
+    case V4L2_PIX_FMT_NV12:
+        /* luma plane followed by interleaved chroma at half height */
+        copy_plane( pixels, pitch, src, s->stride, s->width, s->height );
+        copy_plane( 
+            pixels + pitch*s->height, pitch, src + s->stride*s->height,
+            s->stride, s->width, s->height/2
         );
+        break;
+    case V4L2_PIX_FMT_GREY:
+        /* no colour - both quarter size chroma planes sit at 128 */
+        copy_plane( pixels, pitch, src, s->stride, s->width, s->height );
+        fill_plane( 
+            pixels + pitch*s->height, (pitch+1)/2, 128, s->width/2, s->height
+        );
+        break;
     }
 
+    trace_end( s->render_trace,
+        s->pixfmt->fourcc == V4L2_PIX_FMT_MJPEG ? "decode" : "copy",
+        start, buf->sequence );
+
+    start = trace_now(s->render_trace);
     SDL_UnlockTexture( s->texture );
+    trace_end( s->render_trace, "SDL_UnlockTexture", start, buf->sequence );
 
-    /* queue next frame for this buffer */
-    if ( ioctl( s->fd, VIDIOC_QBUF, &s->buf ) < 0 ) {
-        fprintf( stderr, "Failed to requeue buffer %d\n", errno );
+    return ok;
+}
+
+/* 1 if buf is the frame already shown, e.g. a driver handing the same */
+/* buffer out twice. Timestamp is checked too for drivers that never set */
+/* sequence. */
+static int
+is_shown ( struct state *s, const struct v4l2_buffer *buf ) {
+    return s->has_frame &&
+        buf->sequence == s->shown.sequence &&
+        buf->timestamp.tv_sec == s->shown.timestamp.tv_sec &&
+        buf->timestamp.tv_usec == s->shown.timestamp.tv_usec;
+}
+
+/* A frame has just got into the texture. Its time to the screen is */
+/* measured when the next SDL_RenderPresent returns. */
+static void
+mark_uploaded ( struct state *s, struct timeval timestamp, int64_t dequeued_us ) {
+    s->uploaded_us = latency_now_us();
+    s->captured_us = -1;
+    if ( atomic_load_explicit(&s->monotonic, memory_order_relaxed) ) {
+        s->captured_us = (int64_t) timestamp.tv_sec * 1000000 + timestamp.tv_usec;
+    }
+    latency_record( &s->to_upload, s->uploaded_us - dequeued_us );
+    s->unpresented = 1;
+}
+
+static void
+mark_presented ( struct state *s ) {
+    if ( s->unpresented == 0 ) { return; }
+
+    int64_t now = latency_now_us();
+    latency_record( &s->to_present, now - s->uploaded_us );
+    if ( s->captured_us >= 0 ) {
+        latency_record( &s->end_to_end, now - s->captured_us );
+        latency_record( &s->recent, now - s->captured_us );
+    }
+    s->unpresented = 0;
+}
+
+/* show the newest frame out of the decoder pool, 1 if there was one */
+static int
+take_decoded ( struct state *s ) {
+    struct mjpeg_frame f;
+
+    if ( mjpeg_pool_take(s->pool, &f) == 0 ) { return 0; }
+
+    int64_t start = trace_now(s->render_trace);
+    SDL_UnlockTexture( s->targets[f.target] );
+    trace_end( s->render_trace, "SDL_UnlockTexture", start, f.sequence );
+    mark_uploaded( s, f.timestamp, f.submitted_us );
+    metrics_add(s->render_slot, METRIC_UPLOAD_BYTES, s->texture_size);
+    if ( f.skipped ) { metrics_add(s->render_slot, METRIC_APP_DROPS, f.skipped); }
+
+    /* previous frame is off screen now so the decoders can reuse it */
+    if ( s->shown_target >= 0 ) { give_target(s, s->shown_target); }
+
+    s->shown_target = f.target;
+    s->texture = s->targets[f.target];
+    s->shown.sequence = f.sequence;
+    s->shown.timestamp = f.timestamp;
+    s->has_frame = 1;
+
+    return 1;
+}
+
+static int64_t
+cpu_time_us ( void ) {
+    struct timespec ts;
+
+    clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &ts );
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Once a second, rates over the last second for the overlay and the */
+/* drop counts in the window title when they have changed. */
+static void
+update_stats ( struct state *s ) {
+    char text[256], percentiles[64];
+    Uint32 now = SDL_GetTicks();
+    Uint32 elapsed = now - s->stats_ticks;
+
+    if ( elapsed < 1000 ) { return; }
+    s->stats_ticks = now;
+
+    uint64_t captured = metrics_get(s->metrics, METRIC_FRAMES_CAPTURED);
+    uint64_t presents = metrics_get(s->metrics, METRIC_FRAMES_PRESENTED);
+    uint64_t driver = metrics_get(s->metrics, METRIC_DRIVER_DROPS);
+    uint64_t app = metrics_get(s->metrics, METRIC_APP_DROPS);
+    int64_t cpu_us = cpu_time_us();
+
+    if ( driver != s->title_drops[0] || app != s->title_drops[1] ) {
+        s->title_drops[0] = driver;
+        s->title_drops[1] = app;
+        snprintf( text, sizeof(text), "%s - dropped %llu by driver, %llu by app",
+            APP_NAME, (unsigned long long) driver, (unsigned long long) app );
+        SDL_SetWindowTitle(s->window, text);
+    }
+
+    if ( s->recent.total ) {
+        snprintf( percentiles, sizeof(percentiles), "p50 %5.1f ms  p99 %5.1f ms",
+            latency_percentile(&s->recent, 50) / 1000.0,
+            latency_percentile(&s->recent, 99) / 1000.0 );
+    } else {
+        snprintf( percentiles, sizeof(percentiles), "-" );
+    }
+
+    snprintf( text, sizeof(text),
+        "capture %5.1f fps  present %5.1f fps\n"
+        "latency %s\n"
+        "queued  %2d/%d  cpu %3.0f%%\n"
+        "dropped %llu driver  %llu app",
+        (captured - s->stats_captured) * 1000.0 / elapsed,
+        (presents - s->stats_presents) * 1000.0 / elapsed,
+        percentiles,
+        atomic_load_explicit(&s->depth, memory_order_relaxed), NUMBUFS,
+        (cpu_us - s->stats_cpu_us) / (elapsed * 10.0),
+        (unsigned long long) driver, (unsigned long long) app );
+    hud_set_text(s->hud, text);
+
+    s->stats_captured = captured;
+    s->stats_presents = presents;
+    s->stats_cpu_us = cpu_us;
+    memset( &s->recent, 0, sizeof(struct latency) );
+
+    /* no frames coming in shouldn't freeze the numbers */
+    if ( s->show_hud ) { s->dirty = 1; }
+}
+
+static void
+render ( struct state *s ) {
+    int64_t started = latency_now_us();
+    int present = s->dirty;
+
+    update_stats(s);
+
+    if ( s->pool && take_decoded(s) ) { present = 1; }
+
+    /* take the newest frame from the capture thread, if there is one */
+    int index = atomic_exchange( &s->latest, -1 );
+
+    if ( index >= 0 ) {
+        if ( is_shown( s, &s->bufs[index] ) ) {
+            /* same frame again, nothing lost */
+        } else if ( upload_frame(s, index) ) {
+            s->shown = s->bufs[index];
+            s->has_frame = 1;
+            present = 1;
+            mark_uploaded( s, s->shown.timestamp, s->dequeued_us[index] );
+            metrics_add(s->render_slot, METRIC_UPLOAD_BYTES, s->texture_size);
+        } else {
+            metrics_add(s->render_slot, METRIC_APP_DROPS, 1);
+        }
+
+        /* texture has its own copy now so the camera can have it back */
+        release_buffer(s, index);
     }
 
+    /* nothing changed since the last present */
+    if ( present == 0 ) { return; }
+    s->dirty = 0;
+
     /* update screen and present texture */
+    int64_t start = trace_now(s->render_trace);
     SDL_RenderClear(s->renderer);
-    SDL_RenderCopy(s->renderer, s->texture, NULL, NULL);
+    if (s->texture) { SDL_RenderCopy(s->renderer, s->texture, NULL, NULL); }
+    if (s->show_hud) { hud_draw(s->hud); }
+    trace_end( s->render_trace, "SDL_RenderCopy", start, s->shown.sequence );
+
+    start = trace_now(s->render_trace);
     SDL_RenderPresent(s->renderer);
+    trace_end( s->render_trace, "SDL_RenderPresent", start, s->shown.sequence );
+    mark_presented(s);
+
+    metrics_add(s->render_slot, METRIC_FRAMES_PRESENTED, 1);
+    metrics_add(s->render_slot, METRIC_RENDER_US, latency_now_us() - started);
+}
+
+/* nothing to do but wait for a signal while the sinks get on with it */
+static void
+wait_headless ( struct state *s, const sigset_t *signals ) {
+    int sig;
+
+    while ( atomic_load(&s->quit) == 0 ) {
+        if ( sigwait( signals, &sig ) != 0 ) { continue; }
+        atomic_store(&s->quit, 1);
+    }
 }
 
 static void
 quit ( struct state *s ) {
-    /* disable streaming from the camera */
-    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if ( ioctl(s->fd, VIDIOC_STREAMOFF, &type) < 0 ) {
-        fprintf( stderr, "Unable to stop capture %d\n", errno);
+    /* tell the capture thread to finish up and wait for it */
+    atomic_store(&s->quit, 1);
+    if (s->capturing) {
+        frame_wake(&s->frames);
+        pthread_join(s->capture, NULL);
     }
 
-    /* unmap all the buffers used for storing camera frames */
-    for ( int i=0; i<NUMBUFS; i++ ) {
-        munmap( s->mem[i], s->buf.length);
+    /* sinks may still be reading camera buffers too */
+    for ( int i=0; i<s->nsinks; i++ ) {
+        s->sinks[i]->destroy(s->sinks[i]);
+    }
+    snapshot_destroy(s->snapshot);
+
+    /* decoders read from the camera buffers so stop them before unmapping */
+    mjpeg_pool_destroy(s->pool);
+
+    /* every thread that measured is done, render's being this one */
+    latency_print( &s->to_dequeue, "sensor to dequeue" );
+    latency_print( &s->to_upload,  "dequeue to upload" );
+    latency_print( &s->to_present, "upload to present" );
+    latency_print( &s->end_to_end, "sensor to present" );
+    if ( s->capturing ) {
+        fprintf( stderr, "Captured %llu frames, dropped %llu by driver, %llu by app\n",
+            (unsigned long long) metrics_get(s->metrics, METRIC_FRAMES_CAPTURED),
+            (unsigned long long) metrics_get(s->metrics, METRIC_DRIVER_DROPS),
+            (unsigned long long) metrics_get(s->metrics, METRIC_APP_DROPS) );
+    }
+    trace_destroy(s->trace);
+
+    if ( s->source ) {
+        /* the source owns its buffers and descriptor */
+        source_destroy(s->source);
+    } else if ( s->fd > 0 ) {
+        /* disable streaming from the camera */
+        int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if ( ioctl(s->fd, VIDIOC_STREAMOFF, &type) < 0 ) {
+            fprintf( stderr, "Unable to stop capture %d\n", errno);
+        }
+
+        /* unmap all the buffers used for storing camera frames */
+        for ( int i=0; i<NUMBUFS; i++ ) {
+            if (s->mem[i]) { munmap( s->mem[i], s->len[i] ); }
+            if (s->dmafd[i] >= 0) { close(s->dmafd[i]); }
+        }
+
+        /* close file descriptor for the camera */
+        close(s->fd);
     }
+    if (s->epoll_fd >= 0) { close(s->epoll_fd); }
+    if (s->wake_fd >= 0)  { close(s->wake_fd); }
+    if (s->signal_fd >= 0) { close(s->signal_fd); }
 
-    /* close file descriptor for the camera */
-    if (s->fd) { close(s->fd); }
+    mjpeg_destroy(s->decoder);
+    free(s->flat);
+    metrics_destroy(s->metrics);
 
     /* release SDL resources */
-    if (s->texture)  { SDL_DestroyTexture(s->texture); }
+    if ( s->headless ) { return; }
+    hud_destroy(s->hud);
+    for ( int i=0; i<s->ntargets; i++ ) { SDL_DestroyTexture(s->targets[i]); }
+    if (s->texture && s->ntargets == 0) { SDL_DestroyTexture(s->texture); }
     if (s->renderer) { SDL_DestroyRenderer(s->renderer); }
     if (s->window)   { SDL_DestroyWindow(s->window); }
     SDL_Quit();
@@ -325,6 +1827,27 @@ main ( int argc, char *argv[] ) {
     /* get command line args */
     parse_args(&args, argc, argv);
 
+    /* benchmark doesn't need a camera */
+    if ( args.benchmark ) {
+        return bench_run() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* With no window there is no SDL_QUIT, so Ctrl-C and friends are */
+    /* taken with sigwait instead. Blocked before any thread is started */
+    /* so that they all inherit the mask and only main sees them. */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    if ( args.headless ) { pthread_sigmask(SIG_BLOCK, &signals, NULL); }
+
+    /* SIGUSR1 triggers an event in either mode and goes to a signalfd */
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
     /* initialize program and quit if anything goes wrong */
     if ( init(&state, &args) == 0 ) {
         quit(&state);
@@ -332,7 +1855,11 @@ main ( int argc, char *argv[] ) {
     }
 
     /* run the program until the user quits */
-    while ( state.quit == 0 ) {
+    if ( args.headless ) {
+        wait_headless(&state, &signals);
+    }
+
+    while ( atomic_load(&state.quit) == 0 ) {
         handle_events(&state);
         render(&state);
     }
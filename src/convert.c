@@ -0,0 +1,731 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <pthread.h>
+
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86 1
+#include <immintrin.h>
+#define TARGET(isa) __attribute__((target(isa)))
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#define CONVERT_ARM 1
+#include <arm_neon.h>
+#endif
+
+/* Fixed point BT.601 limited range, scaled by 64:                        */
+/*   c = 75*(Y-16), d = U-128, e = V-128                                 */
+/*   R = (c + 102*e + 32) >> 6                                           */
+/*   G = (c - 25*d - 52*e + 32) >> 6                                     */
+/*   B = (c + 129*d + 32) >> 6                                           */
+/* Every intermediate fits in 16 bits except large positive B, which the */
+/* SIMD code saturates - that only happens once the result is over 511 so */
+/* it clamps to 255 either way and the output stays bit exact.           */
+#define CY  75
+#define CRV 102
+#define CGU 25
+#define CGV 52
+#define CBU 129
+
+typedef void (*yuyv_row_fn) ( uint8_t *dst, const uint8_t *src, int width,
+    int out );
+typedef void (*nv12_row_fn) ( uint8_t *dst, const uint8_t *y,
+    const uint8_t *uv, int width, int out );
+typedef void (*i420_rows_fn) ( uint8_t *y0, uint8_t *y1, uint8_t *u,
+    uint8_t *v, const uint8_t *s0, const uint8_t *s1, int width );
+typedef void (*split_row_fn) ( uint8_t *u, uint8_t *v, const uint8_t *uv,
+    int width );
+
+struct kernels {
+    yuyv_row_fn  yuyv;
+    nv12_row_fn  nv12;
+    i420_rows_fn yuyv_i420;
+    split_row_fn split_uv;
+};
+
+static const int output_sizes[CONVERT_NUM_OUTPUTS] = { 3, 4, 4 };
+static const char *output_names[CONVERT_NUM_OUTPUTS] = { "RGB24", "RGBA", "BGRA" };
+static const char *isa_names[CONVERT_NUM_ISAS] = { "scalar", "sse2", "avx2", "neon" };
+
+int
+convert_output_size ( enum convert_output out ) {
+    return output_sizes[out];
+}
+
+const char *
+convert_output_name ( enum convert_output out ) {
+    return output_names[out];
+}
+
+const char *
+convert_isa_name ( enum convert_isa isa ) {
+    return isa_names[isa];
+}
+
+/* --- scalar reference --------------------------------------------------- */
+
+static inline uint8_t
+clamp ( int v ) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline void
+put_pixel ( uint8_t *dst, int y, int u, int v, int out ) {
+    int c = CY * (y - 16), d = u - 128, e = v - 128;
+    uint8_t r = clamp( (c + CRV*e + 32) >> 6 );
+    uint8_t g = clamp( (c - CGU*d - CGV*e + 32) >> 6 );
+    uint8_t b = clamp( (c + CBU*d + 32) >> 6 );
+
+    switch ( out ) {
+    case CONVERT_RGB24:
+        dst[0] = r; dst[1] = g; dst[2] = b;
+        break;
+    case CONVERT_RGBA:
+        dst[0] = r; dst[1] = g; dst[2] = b; dst[3] = 255;
+        break;
+    case CONVERT_BGRA:
+        dst[0] = b; dst[1] = g; dst[2] = r; dst[3] = 255;
+        break;
+    }
+}
+
+static void
+yuyv_row_scalar ( uint8_t *dst, const uint8_t *src, int width, int out ) {
+    int bpp = output_sizes[out];
+
+    for ( int x=0; x<width; x+=2, src+=4, dst+=2*bpp ) {
+        put_pixel( dst, src[0], src[1], src[3], out );
+        put_pixel( dst + bpp, src[2], src[1], src[3], out );
+    }
+}
+
+static void
+nv12_row_scalar ( uint8_t *dst, const uint8_t *y, const uint8_t *uv,
+    int width, int out ) {
+    int bpp = output_sizes[out];
+
+    for ( int x=0; x<width; x+=2, y+=2, uv+=2, dst+=2*bpp ) {
+        put_pixel( dst, y[0], uv[0], uv[1], out );
+        put_pixel( dst + bpp, y[1], uv[0], uv[1], out );
+    }
+}
+
+/* Two rows of YUYV to two rows of luma and one row each of U and V, */
+/* chroma averaged over the rows rounding up like the SIMD averages do. */
+static void
+yuyv_i420_scalar ( uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+    const uint8_t *s0, const uint8_t *s1, int width ) {
+    for ( int x=0; x<width; x += 2, s0 += 4, s1 += 4 ) {
+        *y0++ = s0[0];
+        *y0++ = s0[2];
+        *y1++ = s1[0];
+        *y1++ = s1[2];
+        *u++ = (s0[1] + s1[1] + 1) >> 1;
+        *v++ = (s0[3] + s1[3] + 1) >> 1;
+    }
+}
+
+/* interleaved CbCr to separate planes, width in chroma samples */
+static void
+split_uv_scalar ( uint8_t *u, uint8_t *v, const uint8_t *uv, int width ) {
+    for ( int x=0; x<width; x++, uv += 2 ) {
+        u[x] = uv[0];
+        v[x] = uv[1];
+    }
+}
+
+/* --- SSE2 ------------------------------------------------------------- */
+
+#ifdef CONVERT_X86
+
+/* 8 pixels of 16 bit Y, U and V to 16 bit R, G and B */
+TARGET("sse2") static inline void
+yuv_sse2 ( __m128i y, __m128i u, __m128i v, __m128i *r, __m128i *g,
+    __m128i *b ) {
+    __m128i c = _mm_mullo_epi16( _mm_sub_epi16( y, _mm_set1_epi16(16) ),
+        _mm_set1_epi16(CY) );
+    __m128i d = _mm_sub_epi16( u, _mm_set1_epi16(128) );
+    __m128i e = _mm_sub_epi16( v, _mm_set1_epi16(128) );
+    __m128i round = _mm_set1_epi16(32);
+
+    *r = _mm_adds_epi16( c, _mm_mullo_epi16( e, _mm_set1_epi16(CRV) ) );
+    *g = _mm_subs_epi16( c, _mm_mullo_epi16( d, _mm_set1_epi16(CGU) ) );
+    *g = _mm_subs_epi16( *g, _mm_mullo_epi16( e, _mm_set1_epi16(CGV) ) );
+    *b = _mm_adds_epi16( c, _mm_mullo_epi16( d, _mm_set1_epi16(CBU) ) );
+
+    *r = _mm_srai_epi16( _mm_adds_epi16( *r, round ), 6 );
+    *g = _mm_srai_epi16( _mm_adds_epi16( *g, round ), 6 );
+    *b = _mm_srai_epi16( _mm_adds_epi16( *b, round ), 6 );
+}
+
+/* write 16 pixels held as 8 bit R, G and B vectors */
+TARGET("sse2") static inline void
+store_sse2 ( uint8_t *dst, __m128i r, __m128i g, __m128i b, int out ) {
+    __m128i a = _mm_set1_epi8( (char) 0xff );
+    __m128i px[4];
+
+    if ( out == CONVERT_BGRA ) {
+        __m128i t = r; r = b; b = t;
+    }
+
+    __m128i rg_lo = _mm_unpacklo_epi8( r, g ), rg_hi = _mm_unpackhi_epi8( r, g );
+    __m128i ba_lo = _mm_unpacklo_epi8( b, a ), ba_hi = _mm_unpackhi_epi8( b, a );
+    px[0] = _mm_unpacklo_epi16( rg_lo, ba_lo );
+    px[1] = _mm_unpackhi_epi16( rg_lo, ba_lo );
+    px[2] = _mm_unpacklo_epi16( rg_hi, ba_hi );
+    px[3] = _mm_unpackhi_epi16( rg_hi, ba_hi );
+
+    if ( out != CONVERT_RGB24 ) {
+        for ( int i=0; i<4; i++ ) {
+            _mm_storeu_si128( (__m128i *) (dst + 16*i), px[i] );
+        }
+        return;
+    }
+
+    /* SSE2 has no byte shuffle, so drop alpha on the way out */
+    uint8_t rgba[64];
+    for ( int i=0; i<4; i++ ) {
+        _mm_storeu_si128( (__m128i *) (rgba + 16*i), px[i] );
+    }
+    for ( int i=0; i<16; i++ ) {
+        dst[3*i+0] = rgba[4*i+0];
+        dst[3*i+1] = rgba[4*i+1];
+        dst[3*i+2] = rgba[4*i+2];
+    }
+}
+
+/* split 8 YUYV pixels into 16 bit Y and per-pixel U and V */
+TARGET("sse2") static inline void
+split_yuyv_sse2 ( __m128i p, __m128i *y, __m128i *u, __m128i *v ) {
+    __m128i uv = _mm_srli_epi16( p, 8 );       /* U0 V0 U1 V1 ... */
+
+    *y = _mm_and_si128( p, _mm_set1_epi16(0xff) );
+    *u = _mm_and_si128( uv, _mm_set1_epi32(0xffff) );
+    *u = _mm_or_si128( *u, _mm_slli_epi32( *u, 16 ) );
+    *v = _mm_srli_epi32( uv, 16 );
+    *v = _mm_or_si128( *v, _mm_slli_epi32( *v, 16 ) );
+}
+
+TARGET("sse2") static void
+yuyv_row_sse2 ( uint8_t *dst, const uint8_t *src, int width, int out ) {
+    int bpp = output_sizes[out];
+    int x = 0;
+
+    for ( ; x + 16 <= width; x += 16, src += 32, dst += 16*bpp ) {
+        __m128i y, u, v, r0, g0, b0, r1, g1, b1;
+
+        split_yuyv_sse2( _mm_loadu_si128( (const __m128i *) src ), &y, &u, &v );
+        yuv_sse2( y, u, v, &r0, &g0, &b0 );
+        split_yuyv_sse2( _mm_loadu_si128( (const __m128i *) (src+16) ), &y, &u, &v );
+        yuv_sse2( y, u, v, &r1, &g1, &b1 );
+
+        store_sse2( dst, _mm_packus_epi16( r0, r1 ), _mm_packus_epi16( g0, g1 ),
+            _mm_packus_epi16( b0, b1 ), out );
+    }
+
+    yuyv_row_scalar( dst, src, width - x, out );
+}
+
+TARGET("sse2") static void
+nv12_row_sse2 ( uint8_t *dst, const uint8_t *y, const uint8_t *uv,
+    int width, int out ) {
+    int bpp = output_sizes[out];
+    int x = 0;
+
+    for ( ; x + 16 <= width; x += 16, y += 16, uv += 16, dst += 16*bpp ) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i y8 = _mm_loadu_si128( (const __m128i *) y );
+        __m128i c8 = _mm_loadu_si128( (const __m128i *) uv );
+        __m128i u = _mm_and_si128( c8, _mm_set1_epi16(0xff) );
+        __m128i v = _mm_srli_epi16( c8, 8 );
+        __m128i r0, g0, b0, r1, g1, b1;
+
+        /* each chroma sample covers two pixels */
+        yuv_sse2( _mm_unpacklo_epi8( y8, zero ), _mm_unpacklo_epi16( u, u ),
+            _mm_unpacklo_epi16( v, v ), &r0, &g0, &b0 );
+        yuv_sse2( _mm_unpackhi_epi8( y8, zero ), _mm_unpackhi_epi16( u, u ),
+            _mm_unpackhi_epi16( v, v ), &r1, &g1, &b1 );
+
+        store_sse2( dst, _mm_packus_epi16( r0, r1 ), _mm_packus_epi16( g0, g1 ),
+            _mm_packus_epi16( b0, b1 ), out );
+    }
+
+    nv12_row_scalar( dst, y, uv, width - x, out );
+}
+
+TARGET("sse2") static void
+yuyv_i420_sse2 ( uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+    const uint8_t *s0, const uint8_t *s1, int width ) {
+    __m128i lo = _mm_set1_epi16(0xff), zero = _mm_setzero_si128();
+    int x = 0;
+
+    for ( ; x + 16 <= width; x += 16, s0 += 32, s1 += 32, y0 += 16, y1 += 16,
+            u += 8, v += 8 ) {
+        __m128i a0 = _mm_loadu_si128( (const __m128i *) s0 );
+        __m128i b0 = _mm_loadu_si128( (const __m128i *) (s0+16) );
+        __m128i a1 = _mm_loadu_si128( (const __m128i *) s1 );
+        __m128i b1 = _mm_loadu_si128( (const __m128i *) (s1+16) );
+
+        _mm_storeu_si128( (__m128i *) y0,
+            _mm_packus_epi16( _mm_and_si128( a0, lo ), _mm_and_si128( b0, lo ) ) );
+        _mm_storeu_si128( (__m128i *) y1,
+            _mm_packus_epi16( _mm_and_si128( a1, lo ), _mm_and_si128( b1, lo ) ) );
+
+        /* U0 V0 U1 V1 ... of both rows, averaged */
+        __m128i c = _mm_avg_epu8(
+            _mm_packus_epi16( _mm_srli_epi16( a0, 8 ), _mm_srli_epi16( b0, 8 ) ),
+            _mm_packus_epi16( _mm_srli_epi16( a1, 8 ), _mm_srli_epi16( b1, 8 ) ) );
+
+        _mm_storel_epi64( (__m128i *) u, _mm_packus_epi16( _mm_and_si128( c, lo ), zero ) );
+        _mm_storel_epi64( (__m128i *) v, _mm_packus_epi16( _mm_srli_epi16( c, 8 ), zero ) );
+    }
+
+    yuyv_i420_scalar( y0, y1, u, v, s0, s1, width - x );
+}
+
+TARGET("sse2") static void
+split_uv_sse2 ( uint8_t *u, uint8_t *v, const uint8_t *uv, int width ) {
+    __m128i lo = _mm_set1_epi16(0xff);
+    int x = 0;
+
+    for ( ; x + 16 <= width; x += 16, uv += 32 ) {
+        __m128i a = _mm_loadu_si128( (const __m128i *) uv );
+        __m128i b = _mm_loadu_si128( (const __m128i *) (uv+16) );
+
+        _mm_storeu_si128( (__m128i *) (u+x),
+            _mm_packus_epi16( _mm_and_si128( a, lo ), _mm_and_si128( b, lo ) ) );
+        _mm_storeu_si128( (__m128i *) (v+x),
+            _mm_packus_epi16( _mm_srli_epi16( a, 8 ), _mm_srli_epi16( b, 8 ) ) );
+    }
+
+    split_uv_scalar( u+x, v+x, uv, width - x );
+}
+
+/* --- AVX2 ------------------------------------------------------------- */
+
+TARGET("avx2") static inline void
+yuv_avx2 ( __m256i y, __m256i u, __m256i v, __m256i *r, __m256i *g,
+    __m256i *b ) {
+    __m256i c = _mm256_mullo_epi16( _mm256_sub_epi16( y, _mm256_set1_epi16(16) ),
+        _mm256_set1_epi16(CY) );
+    __m256i d = _mm256_sub_epi16( u, _mm256_set1_epi16(128) );
+    __m256i e = _mm256_sub_epi16( v, _mm256_set1_epi16(128) );
+    __m256i round = _mm256_set1_epi16(32);
+
+    *r = _mm256_adds_epi16( c, _mm256_mullo_epi16( e, _mm256_set1_epi16(CRV) ) );
+    *g = _mm256_subs_epi16( c, _mm256_mullo_epi16( d, _mm256_set1_epi16(CGU) ) );
+    *g = _mm256_subs_epi16( *g, _mm256_mullo_epi16( e, _mm256_set1_epi16(CGV) ) );
+    *b = _mm256_adds_epi16( c, _mm256_mullo_epi16( d, _mm256_set1_epi16(CBU) ) );
+
+    *r = _mm256_srai_epi16( _mm256_adds_epi16( *r, round ), 6 );
+    *g = _mm256_srai_epi16( _mm256_adds_epi16( *g, round ), 6 );
+    *b = _mm256_srai_epi16( _mm256_adds_epi16( *b, round ), 6 );
+}
+
+/* write 32 pixels held as 8 bit R, G and B vectors in pixel order */
+TARGET("avx2") static inline void
+store_avx2 ( uint8_t *dst, __m256i r, __m256i g, __m256i b, int out ) {
+    __m256i a = _mm256_set1_epi8( (char) 0xff );
+    __m256i q[4], px[4];
+
+    if ( out == CONVERT_BGRA ) {
+        __m256i t = r; r = b; b = t;
+    }
+
+    /* unpacks work within 128 bit lanes, so pixels come out as */
+    /* q0 = 0-3|16-19, q1 = 4-7|20-23, q2 = 8-11|24-27, q3 = 12-15|28-31 */
+    __m256i rg_lo = _mm256_unpacklo_epi8( r, g ), rg_hi = _mm256_unpackhi_epi8( r, g );
+    __m256i ba_lo = _mm256_unpacklo_epi8( b, a ), ba_hi = _mm256_unpackhi_epi8( b, a );
+    q[0] = _mm256_unpacklo_epi16( rg_lo, ba_lo );
+    q[1] = _mm256_unpackhi_epi16( rg_lo, ba_lo );
+    q[2] = _mm256_unpacklo_epi16( rg_hi, ba_hi );
+    q[3] = _mm256_unpackhi_epi16( rg_hi, ba_hi );
+    px[0] = _mm256_permute2x128_si256( q[0], q[1], 0x20 );
+    px[1] = _mm256_permute2x128_si256( q[2], q[3], 0x20 );
+    px[2] = _mm256_permute2x128_si256( q[0], q[1], 0x31 );
+    px[3] = _mm256_permute2x128_si256( q[2], q[3], 0x31 );
+
+    if ( out != CONVERT_RGB24 ) {
+        for ( int i=0; i<4; i++ ) {
+            _mm256_storeu_si256( (__m256i *) (dst + 32*i), px[i] );
+        }
+        return;
+    }
+
+    /* squeeze each group of 4 RGBA pixels into 12 bytes. Stores overlap */
+    /* the next group's bytes except for the last, which is cut short */
+    const __m256i pack = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+    );
+    for ( int i=0; i<4; i++ ) {
+        __m256i p = _mm256_shuffle_epi8( px[i], pack );
+        __m128i lo = _mm256_castsi256_si128(p);
+        __m128i hi = _mm256_extracti128_si256( p, 1 );
+
+        _mm_storeu_si128( (__m128i *) (dst + 24*i), lo );
+        if ( i < 3 ) {
+            _mm_storeu_si128( (__m128i *) (dst + 24*i + 12), hi );
+        } else {
+            _mm_storel_epi64( (__m128i *) (dst + 24*i + 12), hi );
+            uint32_t tail = (uint32_t) _mm_cvtsi128_si32( _mm_srli_si128( hi, 8 ) );
+            memcpy( dst + 24*i + 20, &tail, 4 );
+        }
+    }
+}
+
+TARGET("avx2") static inline void
+split_yuyv_avx2 ( __m256i p, __m256i *y, __m256i *u, __m256i *v ) {
+    __m256i uv = _mm256_srli_epi16( p, 8 );
+
+    *y = _mm256_and_si256( p, _mm256_set1_epi16(0xff) );
+    *u = _mm256_and_si256( uv, _mm256_set1_epi32(0xffff) );
+    *u = _mm256_or_si256( *u, _mm256_slli_epi32( *u, 16 ) );
+    *v = _mm256_srli_epi32( uv, 16 );
+    *v = _mm256_or_si256( *v, _mm256_slli_epi32( *v, 16 ) );
+}
+
+TARGET("avx2") static void
+yuyv_row_avx2 ( uint8_t *dst, const uint8_t *src, int width, int out ) {
+    int bpp = output_sizes[out];
+    int x = 0;
+
+    for ( ; x + 32 <= width; x += 32, src += 64, dst += 32*bpp ) {
+        __m256i y, u, v, r0, g0, b0, r1, g1, b1;
+
+        split_yuyv_avx2( _mm256_loadu_si256( (const __m256i *) src ), &y, &u, &v );
+        yuv_avx2( y, u, v, &r0, &g0, &b0 );
+        split_yuyv_avx2( _mm256_loadu_si256( (const __m256i *) (src+32) ), &y, &u, &v );
+        yuv_avx2( y, u, v, &r1, &g1, &b1 );
+
+        /* pack interleaves the lanes of both halves - put them back */
+        store_avx2( dst,
+            _mm256_permute4x64_epi64( _mm256_packus_epi16( r0, r1 ), 0xd8 ),
+            _mm256_permute4x64_epi64( _mm256_packus_epi16( g0, g1 ), 0xd8 ),
+            _mm256_permute4x64_epi64( _mm256_packus_epi16( b0, b1 ), 0xd8 ),
+            out
+        );
+    }
+
+    yuyv_row_scalar( dst, src, width - x, out );
+}
+
+TARGET("avx2") static void
+nv12_row_avx2 ( uint8_t *dst, const uint8_t *y, const uint8_t *uv,
+    int width, int out ) {
+    int bpp = output_sizes[out];
+    int x = 0;
+
+    for ( ; x + 32 <= width; x += 32, y += 32, uv += 32, dst += 32*bpp ) {
+        __m256i zero = _mm256_setzero_si256();
+        __m256i y8 = _mm256_loadu_si256( (const __m256i *) y );
+        __m256i c8 = _mm256_loadu_si256( (const __m256i *) uv );
+        __m256i u = _mm256_and_si256( c8, _mm256_set1_epi16(0xff) );
+        __m256i v = _mm256_srli_epi16( c8, 8 );
+        __m256i r0, g0, b0, r1, g1, b1;
+
+        /* lo halves hold pixels 0-7|16-23 and hi halves 8-15|24-31 for */
+        /* both luma and chroma, so packing restores pixel order */
+        yuv_avx2( _mm256_unpacklo_epi8( y8, zero ), _mm256_unpacklo_epi16( u, u ),
+            _mm256_unpacklo_epi16( v, v ), &r0, &g0, &b0 );
+        yuv_avx2( _mm256_unpackhi_epi8( y8, zero ), _mm256_unpackhi_epi16( u, u ),
+            _mm256_unpackhi_epi16( v, v ), &r1, &g1, &b1 );
+
+        store_avx2( dst, _mm256_packus_epi16( r0, r1 ),
+            _mm256_packus_epi16( g0, g1 ), _mm256_packus_epi16( b0, b1 ), out );
+    }
+
+    nv12_row_scalar( dst, y, uv, width - x, out );
+}
+
+/* packus works within 128 bit lanes, so every pack is followed by a */
+/* permute to put the quarters back in order */
+TARGET("avx2") static inline __m256i
+pack_avx2 ( __m256i a, __m256i b ) {
+    return _mm256_permute4x64_epi64( _mm256_packus_epi16( a, b ), 0xd8 );
+}
+
+TARGET("avx2") static void
+yuyv_i420_avx2 ( uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+    const uint8_t *s0, const uint8_t *s1, int width ) {
+    __m256i lo = _mm256_set1_epi16(0xff);
+    int x = 0;
+
+    for ( ; x + 32 <= width; x += 32, s0 += 64, s1 += 64, y0 += 32, y1 += 32,
+            u += 16, v += 16 ) {
+        __m256i a0 = _mm256_loadu_si256( (const __m256i *) s0 );
+        __m256i b0 = _mm256_loadu_si256( (const __m256i *) (s0+32) );
+        __m256i a1 = _mm256_loadu_si256( (const __m256i *) s1 );
+        __m256i b1 = _mm256_loadu_si256( (const __m256i *) (s1+32) );
+
+        _mm256_storeu_si256( (__m256i *) y0,
+            pack_avx2( _mm256_and_si256( a0, lo ), _mm256_and_si256( b0, lo ) ) );
+        _mm256_storeu_si256( (__m256i *) y1,
+            pack_avx2( _mm256_and_si256( a1, lo ), _mm256_and_si256( b1, lo ) ) );
+
+        __m256i c = _mm256_avg_epu8(
+            pack_avx2( _mm256_srli_epi16( a0, 8 ), _mm256_srli_epi16( b0, 8 ) ),
+            pack_avx2( _mm256_srli_epi16( a1, 8 ), _mm256_srli_epi16( b1, 8 ) ) );
+
+        __m256i uu = pack_avx2( _mm256_and_si256( c, lo ), _mm256_setzero_si256() );
+        __m256i vv = pack_avx2( _mm256_srli_epi16( c, 8 ), _mm256_setzero_si256() );
+        _mm_storeu_si128( (__m128i *) u, _mm256_castsi256_si128(uu) );
+        _mm_storeu_si128( (__m128i *) v, _mm256_castsi256_si128(vv) );
+    }
+
+    yuyv_i420_scalar( y0, y1, u, v, s0, s1, width - x );
+}
+
+TARGET("avx2") static void
+split_uv_avx2 ( uint8_t *u, uint8_t *v, const uint8_t *uv, int width ) {
+    __m256i lo = _mm256_set1_epi16(0xff);
+    int x = 0;
+
+    for ( ; x + 32 <= width; x += 32, uv += 64 ) {
+        __m256i a = _mm256_loadu_si256( (const __m256i *) uv );
+        __m256i b = _mm256_loadu_si256( (const __m256i *) (uv+32) );
+
+        _mm256_storeu_si256( (__m256i *) (u+x),
+            pack_avx2( _mm256_and_si256( a, lo ), _mm256_and_si256( b, lo ) ) );
+        _mm256_storeu_si256( (__m256i *) (v+x),
+            pack_avx2( _mm256_srli_epi16( a, 8 ), _mm256_srli_epi16( b, 8 ) ) );
+    }
+
+    split_uv_scalar( u+x, v+x, uv, width - x );
+}
+
+#endif /* CONVERT_X86 */
+
+/* --- NEON ------------------------------------------------------------- */
+
+#ifdef CONVERT_ARM
+
+/* 8 pixels of 16 bit Y, U and V to saturated 8 bit R, G and B */
+static inline void
+yuv_neon ( int16x8_t y, int16x8_t u, int16x8_t v, uint8x8_t *r,
+    uint8x8_t *g, uint8x8_t *b ) {
+    int16x8_t c = vmulq_n_s16( vsubq_s16( y, vdupq_n_s16(16) ), CY );
+    int16x8_t d = vsubq_s16( u, vdupq_n_s16(128) );
+    int16x8_t e = vsubq_s16( v, vdupq_n_s16(128) );
+    int16x8_t round = vdupq_n_s16(32);
+
+    int16x8_t rr = vqaddq_s16( c, vmulq_n_s16( e, CRV ) );
+    int16x8_t gg = vqsubq_s16( vqsubq_s16( c, vmulq_n_s16( d, CGU ) ),
+        vmulq_n_s16( e, CGV ) );
+    int16x8_t bb = vqaddq_s16( c, vmulq_n_s16( d, CBU ) );
+
+    /* shift then saturate to 0..255, same as the scalar clamp */
+    *r = vqshrun_n_s16( vqaddq_s16( rr, round ), 6 );
+    *g = vqshrun_n_s16( vqaddq_s16( gg, round ), 6 );
+    *b = vqshrun_n_s16( vqaddq_s16( bb, round ), 6 );
+}
+
+static inline int16x8_t
+widen ( uint8x8_t x ) {
+    return vreinterpretq_s16_u16( vmovl_u8(x) );
+}
+
+/* 32 pixels given as even and odd luma with one chroma pair per two */
+static inline void
+pairs_neon ( uint8_t *dst, uint8x16_t ye, uint8x16_t yo, uint8x16_t u8,
+    uint8x16_t v8, int out ) {
+    uint8x8_t r[4], g[4], b[4];
+    int16x8_t ul = widen( vget_low_u8(u8) ), uh = widen( vget_high_u8(u8) );
+    int16x8_t vl = widen( vget_low_u8(v8) ), vh = widen( vget_high_u8(v8) );
+
+    yuv_neon( widen( vget_low_u8(ye) ), ul, vl, &r[0], &g[0], &b[0] );
+    yuv_neon( widen( vget_low_u8(yo) ), ul, vl, &r[1], &g[1], &b[1] );
+    yuv_neon( widen( vget_high_u8(ye) ), uh, vh, &r[2], &g[2], &b[2] );
+    yuv_neon( widen( vget_high_u8(yo) ), uh, vh, &r[3], &g[3], &b[3] );
+
+    /* interleave even and odd pixels back into order */
+    uint8x8x2_t rz0 = vzip_u8( r[0], r[1] ), rz1 = vzip_u8( r[2], r[3] );
+    uint8x8x2_t gz0 = vzip_u8( g[0], g[1] ), gz1 = vzip_u8( g[2], g[3] );
+    uint8x8x2_t bz0 = vzip_u8( b[0], b[1] ), bz1 = vzip_u8( b[2], b[3] );
+    uint8x16_t rs[2] = { vcombine_u8( rz0.val[0], rz0.val[1] ),
+        vcombine_u8( rz1.val[0], rz1.val[1] ) };
+    uint8x16_t gs[2] = { vcombine_u8( gz0.val[0], gz0.val[1] ),
+        vcombine_u8( gz1.val[0], gz1.val[1] ) };
+    uint8x16_t bs[2] = { vcombine_u8( bz0.val[0], bz0.val[1] ),
+        vcombine_u8( bz1.val[0], bz1.val[1] ) };
+
+    for ( int i=0; i<2; i++ ) {
+        if ( out == CONVERT_RGB24 ) {
+            uint8x16x3_t px = { { rs[i], gs[i], bs[i] } };
+            vst3q_u8( dst + 48*i, px );
+        } else {
+            uint8x16_t first = out == CONVERT_RGBA ? rs[i] : bs[i];
+            uint8x16_t third = out == CONVERT_RGBA ? bs[i] : rs[i];
+            uint8x16x4_t px = { { first, gs[i], third, vdupq_n_u8(255) } };
+            vst4q_u8( dst + 64*i, px );
+        }
+    }
+}
+
+static void
+yuyv_row_neon ( uint8_t *dst, const uint8_t *src, int width, int out ) {
+    int bpp = output_sizes[out];
+    int x = 0;
+
+    for ( ; x + 32 <= width; x += 32, src += 64, dst += 32*bpp ) {
+        uint8x16x4_t p = vld4q_u8(src);    /* Y0, U, Y1, V */
+        pairs_neon( dst, p.val[0], p.val[2], p.val[1], p.val[3], out );
+    }
+
+    yuyv_row_scalar( dst, src, width - x, out );
+}
+
+static void
+nv12_row_neon ( uint8_t *dst, const uint8_t *y, const uint8_t *uv,
+    int width, int out ) {
+    int bpp = output_sizes[out];
+    int x = 0;
+
+    for ( ; x + 32 <= width; x += 32, y += 32, uv += 32, dst += 32*bpp ) {
+        uint8x16x2_t yy = vld2q_u8(y);
+        uint8x16x2_t cc = vld2q_u8(uv);
+        pairs_neon( dst, yy.val[0], yy.val[1], cc.val[0], cc.val[1], out );
+    }
+
+    nv12_row_scalar( dst, y, uv, width - x, out );
+}
+
+static void
+yuyv_i420_neon ( uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+    const uint8_t *s0, const uint8_t *s1, int width ) {
+    int x = 0;
+
+    for ( ; x + 32 <= width; x += 32, s0 += 64, s1 += 64, y0 += 32, y1 += 32,
+            u += 16, v += 16 ) {
+        uint8x16x4_t p0 = vld4q_u8(s0);    /* Y0, U, Y1, V */
+        uint8x16x4_t p1 = vld4q_u8(s1);
+        uint8x16x2_t l0 = { { p0.val[0], p0.val[2] } };
+        uint8x16x2_t l1 = { { p1.val[0], p1.val[2] } };
+
+        vst2q_u8( y0, l0 );
+        vst2q_u8( y1, l1 );
+        vst1q_u8( u, vrhaddq_u8( p0.val[1], p1.val[1] ) );
+        vst1q_u8( v, vrhaddq_u8( p0.val[3], p1.val[3] ) );
+    }
+
+    yuyv_i420_scalar( y0, y1, u, v, s0, s1, width - x );
+}
+
+static void
+split_uv_neon ( uint8_t *u, uint8_t *v, const uint8_t *uv, int width ) {
+    int x = 0;
+
+    for ( ; x + 16 <= width; x += 16, uv += 32 ) {
+        uint8x16x2_t c = vld2q_u8(uv);
+        vst1q_u8( u+x, c.val[0] );
+        vst1q_u8( v+x, c.val[1] );
+    }
+
+    split_uv_scalar( u+x, v+x, uv, width - x );
+}
+
+#endif /* CONVERT_ARM */
+
+/* --- dispatch --------------------------------------------------------- */
+
+static const struct kernels all_kernels[CONVERT_NUM_ISAS] = {
+    [CONVERT_SCALAR] = { yuyv_row_scalar, nv12_row_scalar,
+                         yuyv_i420_scalar, split_uv_scalar },
+#ifdef CONVERT_X86
+    [CONVERT_SSE2]   = { yuyv_row_sse2, nv12_row_sse2,
+                         yuyv_i420_sse2, split_uv_sse2 },
+    [CONVERT_AVX2]   = { yuyv_row_avx2, nv12_row_avx2,
+                         yuyv_i420_avx2, split_uv_avx2 },
+#endif
+#ifdef CONVERT_ARM
+    [CONVERT_NEON]   = { yuyv_row_neon, nv12_row_neon,
+                         yuyv_i420_neon, split_uv_neon },
+#endif
+};
+
+static const struct kernels *kernels;
+static pthread_once_t dispatch_once = PTHREAD_ONCE_INIT;
+
+static int
+supported ( enum convert_isa isa ) {
+    if ( all_kernels[isa].yuyv == NULL ) { return 0; }
+
+#ifdef CONVERT_X86
+    __builtin_cpu_init();
+    if ( isa == CONVERT_SSE2 ) { return __builtin_cpu_supports("sse2"); }
+    if ( isa == CONVERT_AVX2 ) { return __builtin_cpu_supports("avx2"); }
+#endif
+
+    return 1;
+}
+
+enum convert_isa
+convert_best ( void ) {
+    for ( int isa = CONVERT_NUM_ISAS - 1; isa > CONVERT_SCALAR; isa-- ) {
+        if ( supported(isa) ) { return isa; }
+    }
+    return CONVERT_SCALAR;
+}
+
+static void
+pick_best ( void ) {
+    if ( kernels == NULL ) { kernels = &all_kernels[convert_best()]; }
+}
+
+int
+convert_use ( enum convert_isa isa ) {
+    if ( isa >= CONVERT_NUM_ISAS || supported(isa) == 0 ) { return 0; }
+    kernels = &all_kernels[isa];
+    return 1;
+}
+
+void
+convert_yuyv ( uint8_t *dst, int dst_pitch, const uint8_t *src,
+    int src_pitch, int width, int height, enum convert_output out ) {
+    pthread_once( &dispatch_once, pick_best );
+
+    for ( int y=0; y<height; y++, dst += dst_pitch, src += src_pitch ) {
+        kernels->yuyv( dst, src, width, out );
+    }
+}
+
+void
+convert_nv12 ( uint8_t *dst, int dst_pitch, const uint8_t *y,
+    int y_pitch, const uint8_t *uv, int uv_pitch, int width, int height,
+    enum convert_output out ) {
+    pthread_once( &dispatch_once, pick_best );
+
+    for ( int row=0; row<height; row++, dst += dst_pitch, y += y_pitch ) {
+        kernels->nv12( dst, y, uv + (row/2) * uv_pitch, width, out );
+    }
+}
+
+void
+convert_yuyv_i420 ( uint8_t *y, int y_pitch, uint8_t *u, uint8_t *v,
+    int uv_pitch, const uint8_t *src, int src_pitch, int width, int height ) {
+    pthread_once( &dispatch_once, pick_best );
+
+    for ( int row=0; row<height; row += 2 ) {
+        /* an odd last row is paired with itself */
+        int next = row + 1 < height ? 1 : 0;
+
+        kernels->yuyv_i420( y, y + next*y_pitch, u, v,
+            src, src + next*src_pitch, width );
+
+        y += 2*y_pitch;
+        src += 2*src_pitch;
+        u += uv_pitch;
+        v += uv_pitch;
+    }
+}
+
+void
+convert_split_uv ( uint8_t *u, uint8_t *v, int dst_pitch, const uint8_t *uv,
+    int uv_pitch, int width, int height ) {
+    pthread_once( &dispatch_once, pick_best );
+
+    for ( int row=0; row<height; row++, u += dst_pitch, v += dst_pitch, uv += uv_pitch ) {
+        kernels->split_uv( u, v, uv, width );
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdint.h>
+
+/* YUV to RGB conversion for consumers that can't take camera formats as */
+/* they come (snapshots, encoders, analytics). BT.601 limited range with */
+/* 6 bit fixed point coefficients; every implementation produces exactly */
+/* the same bytes as the scalar one. Widths must be even. */
+/* Also repacking into planar I420 for encoders, likewise exact. */
+/* Only the Y4M writer uses I420 so far; the RGB kernels are run by the */
+/* benchmark and "make check" until a consumer needs them. */
+
+enum convert_output {
+    CONVERT_RGB24,    /* R, G, B */
+    CONVERT_RGBA,     /* R, G, B, 255 */
+    CONVERT_BGRA,     /* B, G, R, 255 */
+    CONVERT_NUM_OUTPUTS
+};
+
+enum convert_isa {
+    CONVERT_SCALAR,
+    CONVERT_SSE2,
+    CONVERT_AVX2,
+    CONVERT_NEON,
+    CONVERT_NUM_ISAS
+};
+
+/* bytes per pixel of an output format */
+int convert_output_size ( enum convert_output out );
+const char *convert_output_name ( enum convert_output out );
+
+/* The best implementation this CPU supports is used unless told */
+/* otherwise. convert_use returns 0 if the CPU can't run the one asked for. */
+enum convert_isa convert_best ( void );
+int convert_use ( enum convert_isa isa );
+const char *convert_isa_name ( enum convert_isa isa );
+
+/* packed YUYV (YUY2) to RGB */
+void convert_yuyv ( uint8_t *dst, int dst_pitch, const uint8_t *src,
+    int src_pitch, int width, int height, enum convert_output out );
+
+/* NV12 - full size luma plane and half size interleaved CbCr plane */
+void convert_nv12 ( uint8_t *dst, int dst_pitch, const uint8_t *y,
+    int y_pitch, const uint8_t *uv, int uv_pitch, int width, int height,
+    enum convert_output out );
+
+/* packed YUYV to planar I420 - luma as is, chroma averaged over each */
+/* pair of rows. u and v planes are width/2 by (height+1)/2. */
+void convert_yuyv_i420 ( uint8_t *y, int y_pitch, uint8_t *u, uint8_t *v,
+    int uv_pitch, const uint8_t *src, int src_pitch, int width, int height );
+
+/* interleaved CbCr (the second plane of NV12) into separate U and V */
+/* planes. width and height are of the chroma plane, in samples. */
+void convert_split_uv ( uint8_t *u, uint8_t *v, int dst_pitch,
+    const uint8_t *uv, int uv_pitch, int width, int height );
+
+#endif
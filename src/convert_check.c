@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <memory.h>
+
+#include "convert_check.h"
+
+int
+convert_sample_alloc ( struct convert_sample *s, int width, int height ) {
+    size_t px = (size_t) width * height;
+
+    memset( s, 0, sizeof(struct convert_sample) );
+    s->width = width;
+    s->height = height;
+    s->yuyv = malloc(px * 2);
+    s->y = malloc(px);
+    s->uv = malloc(px / 2);
+    s->ref = malloc(px * 4);
+    s->out = malloc(px * 4);
+    if ( !s->yuyv || !s->y || !s->uv || !s->ref || !s->out ) { return 0; }
+
+    srand(width * height);
+    for ( size_t i=0; i<px*2; i++ ) { s->yuyv[i] = rand(); }
+    for ( size_t i=0; i<px; i++ )   { s->y[i] = rand(); }
+    for ( size_t i=0; i<px/2; i++ ) { s->uv[i] = rand(); }
+
+    return 1;
+}
+
+void
+convert_sample_free ( struct convert_sample *s ) {
+    free(s->yuyv);
+    free(s->y);
+    free(s->uv);
+    free(s->ref);
+    free(s->out);
+    memset( s, 0, sizeof(struct convert_sample) );
+}
+
+void
+convert_sample_rgb ( struct convert_sample *s, int nv12,
+    enum convert_output out, uint8_t *dst ) {
+    int pitch = s->width * convert_output_size(out);
+
+    if ( nv12 ) {
+        convert_nv12( dst, pitch, s->y, s->width, s->uv, s->width,
+            s->width, s->height, out );
+    } else {
+        convert_yuyv( dst, pitch, s->yuyv, s->width * 2,
+            s->width, s->height, out );
+    }
+}
+
+/* YUYV to I420, or just the chroma split for NV12 */
+size_t
+convert_sample_i420 ( struct convert_sample *s, int nv12, int height,
+    uint8_t *dst ) {
+    int cw = s->width / 2, ch = (height + 1) / 2;
+    uint8_t *u = dst + (size_t) s->width * height;
+    uint8_t *v = u + (size_t) cw * ch;
+
+    if ( nv12 ) {
+        convert_split_uv( u, v, cw, s->uv, s->width, cw, ch );
+    } else {
+        convert_yuyv_i420( dst, s->width, u, v, cw, s->yuyv, s->width * 2,
+            s->width, height );
+    }
+
+    return (size_t) s->width * height + 2 * (size_t) cw * ch;
+}
+
+int
+convert_matches_scalar ( struct convert_sample *s, enum convert_isa isa,
+    int nv12, enum convert_output out ) {
+    size_t bytes = (size_t) s->width * s->height * convert_output_size(out);
+
+    if ( convert_use(isa) == 0 ) { return 0; }
+    convert_sample_rgb(s, nv12, out, s->out);
+    convert_use(CONVERT_SCALAR);
+    convert_sample_rgb(s, nv12, out, s->ref);
+
+    return memcmp( s->ref, s->out, bytes ) == 0;
+}
+
+int
+convert_i420_matches_scalar ( struct convert_sample *s, enum convert_isa isa,
+    int nv12, int height ) {
+    size_t bytes = (size_t) s->width * s->height * 4;
+
+    if ( convert_use(isa) == 0 ) { return 0; }
+    memset( s->ref, 0, bytes );
+    memset( s->out, 0, bytes );
+    bytes = convert_sample_i420(s, nv12, height, s->out);
+    convert_use(CONVERT_SCALAR);
+    convert_sample_i420(s, nv12, height, s->ref);
+
+    return memcmp( s->ref, s->out, bytes ) == 0;
+}
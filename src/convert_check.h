@@ -0,0 +1,41 @@
+#ifndef CONVERT_CHECK_H
+#define CONVERT_CHECK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "convert.h"
+
+/* Checking the conversion kernels against the scalar ones. Needs nothing */
+/* but convert.c, so "make check" can run it without SDL or a display, */
+/* and the benchmark uses the same frames to time them. */
+
+/* Frame of random YUYV and NV12, random so the kernels hit their */
+/* saturating corners as well as the common cases. */
+struct convert_sample {
+    int      width, height;
+    uint8_t *yuyv, *y, *uv;
+    uint8_t *ref, *out;          /* RGBA sized output */
+};
+
+/* 0 if out of memory, free it either way */
+int convert_sample_alloc ( struct convert_sample *s, int width, int height );
+void convert_sample_free ( struct convert_sample *s );
+
+/* the sample's YUYV, or NV12, through the current implementation */
+void convert_sample_rgb ( struct convert_sample *s, int nv12,
+    enum convert_output out, uint8_t *dst );
+
+/* into dst laid out as I420, returning the bytes written. height may be */
+/* odd to check the last row pairs with itself. */
+size_t convert_sample_i420 ( struct convert_sample *s, int nv12, int height,
+    uint8_t *dst );
+
+/* 1 if isa gives byte for byte the same output as the scalar code. These */
+/* leave the scalar code in use. */
+int convert_matches_scalar ( struct convert_sample *s, enum convert_isa isa,
+    int nv12, enum convert_output out );
+int convert_i420_matches_scalar ( struct convert_sample *s, enum convert_isa isa,
+    int nv12, int height );
+
+#endif
@@ -0,0 +1,476 @@
+#define _GNU_SOURCE      /* memfd_create, accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>       /* errno */
+#include <fcntl.h>       /* O_* */
+#include <memory.h>      /* memcpy */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>      /* close */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>    /* memfd_create */
+#include <sys/socket.h>
+#include <sys/stat.h>    /* lstat */
+#include <sys/un.h>
+
+#include "fdserver.h"
+
+#define MAX_CLIENTS 16
+#define MAX_CREDITS 8
+
+/* epoll tags beyond the client slots */
+#define TAG_LISTEN  MAX_CLIENTS
+#define TAG_WAKE    (MAX_CLIENTS + 1)
+
+struct client {
+    int          fd;         /* -1 when the slot is free */
+    unsigned int credits;    /* 0 until the client subscribes */
+    unsigned int in_flight;  /* frames it holds */
+    uint32_t     held;       /* bit i - holds buffer i */
+    uint32_t     has_fd;     /* bit i - already has buffer i's fd */
+    uint32_t     dropped;    /* frames missed since the last one sent */
+};
+
+struct fdserver {
+    struct sink         sink;
+    struct frame_format format;
+    char               *path;
+
+    pthread_t           thread;
+    int                 running;
+    atomic_int          quit;
+    int                 listen_fd;
+    int                 epoll_fd;
+    int                 wake_fd;
+    void              (*trigger) ( void *arg );
+    void               *trigger_arg;
+
+    /* capture thread -> server thread, one frame deep like the display */
+    struct frame        incoming[FRAME_MAX_BUFFERS];
+    atomic_int          pending;
+
+    /* server thread only */
+    struct frame        frames[FRAME_MAX_BUFFERS]; /* frames clients may hold */
+    int                 memfd[FRAME_MAX_BUFFERS];  /* copies when there's no dmabuf */
+    void               *memmap[FRAME_MAX_BUFFERS];
+    struct client       clients[MAX_CLIENTS];
+};
+
+static void
+wake ( struct fdserver *srv ) {
+    uint64_t one = 1;
+
+    if ( write( srv->wake_fd, &one, sizeof(one) ) < 0 && errno != EAGAIN ) {
+        perror("eventfd");
+    }
+}
+
+static void
+push ( struct sink *sink, const struct frame *f ) {
+    struct fdserver *srv = (struct fdserver *) sink;
+
+    frame_ref(f);
+    srv->incoming[f->index] = *f;
+
+    /* a frame the server thread hasn't got to yet is replaced */
+    int old = atomic_exchange( &srv->pending, f->index );
+    if ( old >= 0 ) {
+        frame_unref(&srv->incoming[old]);
+    } else {
+        wake(srv);
+    }
+}
+
+static int
+send_msg ( int fd, const struct fdserver_msg *msg, int passfd ) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { (void *) msg, sizeof(struct fdserver_msg) };
+    struct msghdr mh;
+
+    memset( &mh, 0, sizeof(struct msghdr) );
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if ( passfd >= 0 ) {
+        memset( control, 0, sizeof(control) );
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy( CMSG_DATA(cm), &passfd, sizeof(int) );
+    }
+
+    return sendmsg( fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL ) == sizeof(struct fdserver_msg);
+}
+
+static void
+drop_client ( struct fdserver *srv, struct client *c ) {
+    epoll_ctl( srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL );
+    close(c->fd);
+
+    /* whatever it still held goes back to the camera */
+    for ( int i=0; i<FRAME_MAX_BUFFERS; i++ ) {
+        if ( c->held & (1u << i) ) { frame_unref(&srv->frames[i]); }
+    }
+
+    memset( c, 0, sizeof(struct client) );
+    c->fd = -1;
+}
+
+static void
+accept_client ( struct fdserver *srv ) {
+    struct fdserver_msg hello;
+    struct epoll_event ev;
+    struct client *c = NULL;
+
+    int fd = accept4( srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if ( fd < 0 ) { return; }
+
+    for ( int i=0; i<MAX_CLIENTS && c == NULL; i++ ) {
+        if ( srv->clients[i].fd < 0 ) { c = &srv->clients[i]; }
+    }
+
+    if ( c == NULL ) {
+        fprintf( stderr, "%s: too many clients\n", srv->path );
+        close(fd);
+        return;
+    }
+
+    memset( &hello, 0, sizeof(struct fdserver_msg) );
+    hello.type = FDSERVER_HELLO;
+    hello.version = FDSERVER_VERSION;
+    hello.pixelformat = srv->format.pixelformat;
+    hello.width = srv->format.width;
+    hello.height = srv->format.height;
+    hello.stride = srv->format.stride;
+    hello.sizeimage = srv->format.sizeimage;
+    if ( send_msg(fd, &hello, -1) == 0 ) {
+        close(fd);
+        return;
+    }
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = EPOLLIN;
+    ev.data.u32 = c - srv->clients;
+    if ( epoll_ctl( srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev ) < 0 ) {
+        perror("epoll_ctl");
+        close(fd);
+        return;
+    }
+
+    memset( c, 0, sizeof(struct client) );
+    c->fd = fd;
+}
+
+/* read everything the client has sent, 0 if it has gone away */
+static int
+read_client ( struct fdserver *srv, struct client *c ) {
+    struct fdserver_msg msg;
+
+    for (;;) {
+        ssize_t n = recv( c->fd, &msg, sizeof(struct fdserver_msg), MSG_DONTWAIT );
+        if ( n < 0 ) { return errno == EAGAIN || errno == EINTR; }
+        if ( n == 0 ) { return 0; }
+        if ( n != sizeof(struct fdserver_msg) ) { continue; }
+
+        switch ( msg.type ) {
+        case FDSERVER_SUBSCRIBE:
+            c->credits = msg.credits > MAX_CREDITS ? MAX_CREDITS : msg.credits;
+            break;
+        case FDSERVER_RELEASE:
+            if ( msg.buffer < FRAME_MAX_BUFFERS && (c->held & (1u << msg.buffer)) ) {
+                c->held &= ~(1u << msg.buffer);
+                c->in_flight--;
+                frame_unref(&srv->frames[msg.buffer]);
+            }
+            break;
+        case FDSERVER_TRIGGER:
+            if ( srv->trigger ) { srv->trigger(srv->trigger_arg); }
+            break;
+        }
+    }
+}
+
+/* fd a buffer is shared through, copying the frame into a memfd if the */
+/* driver couldn't export it. -1 if neither works. */
+static int
+buffer_fd ( struct fdserver *srv, const struct frame *f, int *copied ) {
+    int i = f->index;
+
+    if ( f->dmafd >= 0 ) { return f->dmafd; }
+
+    if ( srv->memfd[i] < 0 ) {
+        srv->memfd[i] = memfd_create( "camera-frame", MFD_CLOEXEC );
+        if ( srv->memfd[i] < 0 ) {
+            perror("memfd_create");
+            return -1;
+        }
+
+        if ( ftruncate( srv->memfd[i], srv->format.sizeimage ) < 0 ) {
+            perror("ftruncate");
+            close(srv->memfd[i]);
+            srv->memfd[i] = -1;
+            return -1;
+        }
+
+        srv->memmap[i] = mmap( NULL, srv->format.sizeimage,
+            PROT_READ | PROT_WRITE, MAP_SHARED, srv->memfd[i], 0 );
+        if ( srv->memmap[i] == MAP_FAILED ) {
+            perror("mmap");
+            srv->memmap[i] = NULL;
+            close(srv->memfd[i]);
+            srv->memfd[i] = -1;
+            return -1;
+        }
+    }
+
+    /* once per frame however many clients get it. Nobody can be looking */
+    /* at the old contents since the camera only reuses a free buffer. */
+    if ( *copied == 0 ) {
+        size_t n = f->bytesused < srv->format.sizeimage ? f->bytesused : srv->format.sizeimage;
+        memcpy( srv->memmap[i], f->data, n );
+        *copied = 1;
+    }
+
+    return srv->memfd[i];
+}
+
+/* offer a frame to every subscribed client that has room for it */
+static void
+fan_out ( struct fdserver *srv, int index ) {
+    struct frame *f = &srv->frames[index];
+    struct fdserver_msg msg;
+    int copied = 0;
+
+    *f = srv->incoming[index];
+
+    memset( &msg, 0, sizeof(struct fdserver_msg) );
+    msg.type = FDSERVER_FRAME;
+    msg.buffer = index;
+    msg.sequence = f->sequence;
+    msg.bytesused = f->bytesused;
+    msg.timestamp_us = frame_time_us(f);
+
+    for ( int i=0; i<MAX_CLIENTS; i++ ) {
+        struct client *c = &srv->clients[i];
+        if ( c->fd < 0 || c->credits == 0 ) { continue; }
+
+        /* a slow client misses frames rather than holding up the camera */
+        if ( c->in_flight >= c->credits ) {
+            c->dropped++;
+            continue;
+        }
+
+        int fd = -1;
+        if ( (c->has_fd & (1u << index)) == 0 ) {
+            fd = buffer_fd(srv, f, &copied);
+            if ( fd < 0 ) { continue; }
+        } else if ( f->dmafd < 0 ) {
+            buffer_fd(srv, f, &copied);
+        }
+
+        msg.flags = (f->dmafd >= 0 ? FDSERVER_DMABUF : FDSERVER_MEMFD) |
+            (fd >= 0 ? FDSERVER_FD : 0);
+        msg.dropped = c->dropped;
+
+        frame_ref(f);
+        if ( send_msg(c->fd, &msg, fd) == 0 ) {
+            int err = errno;
+            frame_unref(f);
+            if ( err == EAGAIN ) {
+                c->dropped++;
+            } else {
+                drop_client(srv, c);
+            }
+            continue;
+        }
+
+        if ( fd >= 0 ) { c->has_fd |= 1u << index; }
+        c->held |= 1u << index;
+        c->in_flight++;
+        c->dropped = 0;
+    }
+
+    /* the reference push took */
+    frame_unref(f);
+}
+
+static void *
+serve ( void *arg ) {
+    struct fdserver *srv = arg;
+    struct epoll_event events[MAX_CLIENTS + 2];
+
+    while ( atomic_load(&srv->quit) == 0 ) {
+        int n = epoll_wait( srv->epoll_fd, events, MAX_CLIENTS + 2, -1 );
+        if ( n < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            perror("epoll_wait");
+            break;
+        }
+
+        for ( int i=0; i<n; i++ ) {
+            uint32_t tag = events[i].data.u32;
+
+            if ( tag == TAG_LISTEN ) {
+                accept_client(srv);
+            } else if ( tag == TAG_WAKE ) {
+                uint64_t count;
+                if ( read( srv->wake_fd, &count, sizeof(count) ) < 0 ) {
+                    perror("eventfd");
+                }
+
+                int index = atomic_exchange( &srv->pending, -1 );
+                if ( index >= 0 ) { fan_out(srv, index); }
+            } else if ( srv->clients[tag].fd >= 0 &&
+                ( (events[i].events & (EPOLLHUP | EPOLLERR)) ||
+                  read_client(srv, &srv->clients[tag]) == 0 ) ) {
+                drop_client(srv, &srv->clients[tag]);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void
+destroy ( struct sink *sink ) {
+    struct fdserver *srv = (struct fdserver *) sink;
+
+    if ( srv->running ) {
+        atomic_store(&srv->quit, 1);
+        wake(srv);
+        pthread_join(srv->thread, NULL);
+    }
+
+    for ( int i=0; i<MAX_CLIENTS; i++ ) {
+        if ( srv->clients[i].fd >= 0 ) { drop_client(srv, &srv->clients[i]); }
+    }
+
+    int index = atomic_exchange( &srv->pending, -1 );
+    if ( index >= 0 ) { frame_unref(&srv->incoming[index]); }
+
+    for ( int i=0; i<FRAME_MAX_BUFFERS; i++ ) {
+        if ( srv->memmap[i] ) { munmap( srv->memmap[i], srv->format.sizeimage ); }
+        if ( srv->memfd[i] >= 0 ) { close(srv->memfd[i]); }
+    }
+
+    if ( srv->listen_fd >= 0 ) {
+        close(srv->listen_fd);
+        unlink(srv->path);
+    }
+    if ( srv->epoll_fd >= 0 ) { close(srv->epoll_fd); }
+    if ( srv->wake_fd >= 0 )  { close(srv->wake_fd); }
+
+    free(srv->path);
+    free(srv);
+}
+
+static int
+watch ( struct fdserver *srv, int fd, uint32_t tag ) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = EPOLLIN;
+    ev.data.u32 = tag;
+    if ( epoll_ctl( srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev ) < 0 ) {
+        perror("epoll_ctl");
+        return 0;
+    }
+
+    return 1;
+}
+
+struct sink *
+fdserver_create ( const char *path, const struct frame_format *fmt,
+    void (*trigger) ( void *arg ), void *arg ) {
+    struct sockaddr_un addr;
+    struct fdserver *srv = calloc(1, sizeof(struct fdserver));
+    if ( srv == NULL ) { return NULL; }
+
+    srv->sink.name = "frame socket";
+    srv->sink.push = push;
+    srv->sink.destroy = destroy;
+    srv->format = *fmt;
+    srv->path = strdup(path);
+    srv->trigger = trigger;
+    srv->trigger_arg = arg;
+    srv->listen_fd = -1;
+    srv->epoll_fd = -1;
+    atomic_init(&srv->quit, 0);
+    atomic_init(&srv->pending, -1);
+    for ( int i=0; i<FRAME_MAX_BUFFERS; i++ ) { srv->memfd[i] = -1; }
+    for ( int i=0; i<MAX_CLIENTS; i++ ) { srv->clients[i].fd = -1; }
+
+    srv->wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( srv->wake_fd < 0 ) {
+        perror("eventfd");
+        destroy(&srv->sink);
+        return NULL;
+    }
+
+    if ( strlen(path) >= sizeof(addr.sun_path) ) {
+        fprintf( stderr, "%s: socket path too long\n", path );
+        destroy(&srv->sink);
+        return NULL;
+    }
+
+    memset( &addr, 0, sizeof(struct sockaddr_un) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, path );
+
+    srv->listen_fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( srv->listen_fd < 0 ) {
+        perror("socket");
+        destroy(&srv->sink);
+        return NULL;
+    }
+
+    /* a socket left behind by a previous run, but nothing else */
+    struct stat st;
+    if ( lstat( path, &st ) == 0 ) {
+        if ( S_ISSOCK(st.st_mode) == 0 ) {
+            fprintf( stderr, "%s exists and is not a socket\n", path );
+            close(srv->listen_fd);
+            srv->listen_fd = -1;
+            destroy(&srv->sink);
+            return NULL;
+        }
+        unlink(path);
+    }
+    if ( bind( srv->listen_fd, (struct sockaddr *) &addr, sizeof(addr) ) < 0 ||
+        listen( srv->listen_fd, MAX_CLIENTS ) < 0 ) {
+        perror(path);
+        close(srv->listen_fd);
+        srv->listen_fd = -1;
+        destroy(&srv->sink);
+        return NULL;
+    }
+
+    srv->epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+    if ( srv->epoll_fd < 0 ) {
+        perror("epoll_create1");
+        destroy(&srv->sink);
+        return NULL;
+    }
+
+    if ( watch(srv, srv->listen_fd, TAG_LISTEN) == 0 ||
+        watch(srv, srv->wake_fd, TAG_WAKE) == 0 ) {
+        destroy(&srv->sink);
+        return NULL;
+    }
+
+    if ( pthread_create( &srv->thread, NULL, serve, srv ) != 0 ) {
+        fprintf( stderr, "Unable to start frame socket thread\n" );
+        destroy(&srv->sink);
+        return NULL;
+    }
+    srv->running = 1;
+
+    return &srv->sink;
+}
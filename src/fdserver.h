@@ -0,0 +1,70 @@
+#ifndef FDSERVER_H
+#define FDSERVER_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+/* Frame handoff over a local socket. Clients connect to a SOCK_SEQPACKET */
+/* unix socket and are sent every frame as a file descriptor (the capture */
+/* buffer itself as a dmabuf, or a memfd copy on drivers that can't export */
+/* one) using SCM_RIGHTS. Nothing but a small message goes over the socket. */
+/*                                                                         */
+/* Protocol, one struct fdserver_msg per packet:                           */
+/*   server -> HELLO      stream format, sent on connect                   */
+/*   client -> SUBSCRIBE  credits = how many frames it may hold at once    */
+/*   server -> FRAME      buffer index, with the buffer's fd attached the  */
+/*                        first time that buffer is sent to this client -  */
+/*                        keep it, later frames in the buffer only name it */
+/*   client -> RELEASE    done with buffer, the camera can have it back    */
+/*   client -> TRIGGER    flag an event, as the t key does                 */
+/*                                                                         */
+/* A client holding as many frames as it has credits, or whose socket is   */
+/* full, simply misses frames; the count is in the next FRAME's dropped.   */
+/* Frames are read-only, map the fd with PROT_READ. Closing the socket     */
+/* releases everything the client held.                                    */
+
+#define FDSERVER_VERSION 1
+
+enum fdserver_type {
+    FDSERVER_HELLO = 1,
+    FDSERVER_SUBSCRIBE,
+    FDSERVER_FRAME,
+    FDSERVER_RELEASE,
+    FDSERVER_TRIGGER,
+};
+
+/* FRAME flags */
+#define FDSERVER_FD     0x1  /* an fd for the buffer is attached */
+#define FDSERVER_DMABUF 0x2  /* buffer is the capture buffer as a dmabuf */
+#define FDSERVER_MEMFD  0x4  /* buffer is a memfd copy of the frame */
+
+struct fdserver_msg {
+    uint32_t type;
+    uint32_t flags;
+
+    /* HELLO */
+    uint32_t version;
+    uint32_t pixelformat;    /* V4L2 fourcc */
+    uint32_t width, height;
+    uint32_t stride;
+    uint32_t sizeimage;      /* size to map a buffer fd with */
+
+    /* SUBSCRIBE */
+    uint32_t credits;
+
+    /* FRAME and RELEASE */
+    uint32_t buffer;
+    uint32_t sequence;
+    uint32_t bytesused;
+    uint32_t dropped;        /* frames this client missed since the last */
+    int64_t  timestamp_us;
+};
+
+/* Listen on path (replacing a stale socket) and serve frames from a */
+/* thread of its own. The returned sink's push never blocks. trigger is */
+/* called with arg, on the server thread, for every TRIGGER received. */
+struct sink *fdserver_create ( const char *path, const struct frame_format *fmt,
+    void (*trigger) ( void *arg ), void *arg );
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+
+void
+frame_bufs_init ( struct frame_bufs *b, int wake_fd ) {
+    for ( int i=0; i<FRAME_MAX_BUFFERS; i++ ) { atomic_init(&b->refs[i], 0); }
+    atomic_init(&b->released, 0);
+    b->wake_fd = wake_fd;
+}
+
+void
+frame_hold ( struct frame_bufs *b, int index ) {
+    atomic_store(&b->refs[index], 1);
+}
+
+int
+frame_drop ( struct frame_bufs *b, int index ) {
+    return atomic_fetch_sub(&b->refs[index], 1) == 1;
+}
+
+unsigned int
+frame_take_released ( struct frame_bufs *b ) {
+    return atomic_exchange(&b->released, 0);
+}
+
+void
+frame_wake ( struct frame_bufs *b ) {
+    uint64_t one = 1;
+
+    if ( write( b->wake_fd, &one, sizeof(one) ) < 0 && errno != EAGAIN ) {
+        perror("eventfd");
+    }
+}
+
+void
+frame_release ( struct frame_bufs *b, int index ) {
+    if ( atomic_fetch_sub(&b->refs[index], 1) != 1 ) { return; }
+
+    /* only the first release since the capture thread last looked needs */
+    /* to wake it, the rest get picked up in the same pass */
+    if ( atomic_fetch_or( &b->released, 1u << index ) == 0 ) {
+        frame_wake(b);
+    }
+}
+
+void
+frame_ref ( const struct frame *f ) {
+    atomic_fetch_add(&f->owner->refs[f->index], 1);
+}
+
+void
+frame_unref ( const struct frame *f ) {
+    frame_release(f->owner, f->index);
+}
+
+int64_t
+frame_time_us ( const struct frame *f ) {
+    return (int64_t) f->timestamp.tv_sec * 1000000 + f->timestamp.tv_usec;
+}
+
+size_t
+frame_typical_size ( const struct frame_format *fmt ) {
+    /* sizeimage is a worst case for JPEG, two bits a pixel is more like it */
+    if ( fmt->pixelformat == V4L2_PIX_FMT_MJPEG ) {
+        return (size_t) fmt->width * fmt->height / 4;
+    }
+    return fmt->sizeimage;
+}
@@ -0,0 +1,75 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+
+/* most capture buffers we can track, one bit each in a release mask */
+#define FRAME_MAX_BUFFERS 32
+
+/* Ownership of the capture buffers. Every holder of a frame has a */
+/* reference; when the last one goes the buffer is marked released and */
+/* the capture thread is woken through wake_fd to requeue it. */
+struct frame_bufs {
+    atomic_int  refs[FRAME_MAX_BUFFERS];
+    atomic_uint released;    /* bit i set when buffer i can be requeued */
+    int         wake_fd;     /* eventfd written when released goes non-zero */
+};
+
+/* What every frame from a capture session has in common. */
+struct frame_format {
+    uint32_t pixelformat;    /* V4L2 fourcc */
+    int      width, height;
+    int      stride;         /* bytes per line of the first plane */
+    size_t   sizeimage;      /* largest a frame can be */
+    double   fps;            /* nominal frame rate */
+};
+
+/* A captured frame as handed to consumers. */
+struct frame {
+    struct frame_bufs *owner;
+    int                index;      /* capture buffer */
+    const void        *data;
+    size_t             bytesused;
+    uint32_t           sequence;
+    struct timeval     timestamp;  /* when the driver captured it */
+    int                dmafd;      /* buffer as a dmabuf, -1 if not exported */
+};
+
+/* A consumer fed from the capture thread. push is called for every frame */
+/* and must not block; anything that wants the frame after push returns */
+/* takes a reference with frame_ref. trigger is optional; it is called */
+/* on the capture thread, between pushes, when the user flags an event. */
+struct sink {
+    const char *name;
+    void (*push) ( struct sink *sink, const struct frame *f );
+    void (*trigger) ( struct sink *sink );
+    void (*destroy) ( struct sink *sink );
+};
+
+void frame_bufs_init ( struct frame_bufs *b, int wake_fd );
+
+/* capture thread - a freshly dequeued buffer starts with one reference */
+void frame_hold ( struct frame_bufs *b, int index );
+
+/* capture thread - drop a reference, 1 if it was the last one and the */
+/* caller should requeue the buffer itself */
+int frame_drop ( struct frame_bufs *b, int index );
+
+/* capture thread - collect every buffer released since the last call */
+unsigned int frame_take_released ( struct frame_bufs *b );
+
+/* any thread */
+void frame_wake ( struct frame_bufs *b );
+void frame_release ( struct frame_bufs *b, int index );
+void frame_ref ( const struct frame *f );
+void frame_unref ( const struct frame *f );
+
+int64_t frame_time_us ( const struct frame *f );
+
+/* about how many bytes a frame takes, for sizing buffers and files */
+size_t frame_typical_size ( const struct frame_format *fmt );
+
+#endif
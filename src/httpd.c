@@ -0,0 +1,802 @@
+#define _GNU_SOURCE      /* accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>       /* errno */
+#include <memory.h>      /* memcpy */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>      /* close */
+#include <arpa/inet.h>   /* inet_pton */
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <linux/videodev2.h>
+
+#include "httpd.h"
+#include "mjpeg.h"
+
+#define MAX_CLIENTS  32
+#define REQUEST_MAX  2048
+#define JPEG_QUALITY 80
+
+/* one per client, the newest, and one being filled */
+#define MAX_PARTS    (MAX_CLIENTS + 2)
+
+/* epoll tags beyond the client slots */
+#define TAG_LISTEN   MAX_CLIENTS
+#define TAG_WAKE     (MAX_CLIENTS + 1)
+
+#define BOUNDARY "camera-frame"
+
+static const char stream_reply[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=" BOUNDARY "\r\n"
+    "Cache-Control: no-cache, no-store\r\n"
+    "Pragma: no-cache\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char not_found_reply[] =
+    "HTTP/1.0 404 Not Found\r\n"
+    "Content-Type: text/plain\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "Not found\n";
+
+static const char unavailable_reply[] =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "No frame yet\n";
+
+static const char bad_request_reply[] =
+    "HTTP/1.0 400 Bad Request\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char error_reply[] =
+    "HTTP/1.0 500 Internal Server Error\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char part_trailer[] = "\r\n";
+
+/* a frame ready to go out, shared by every client sending it */
+struct part {
+    int            refs;     /* clients sending it, plus one while newest */
+    unsigned long  serial;
+    char           header[128];
+    size_t         header_len;
+    unsigned char *jpeg;
+    size_t         size, cap;
+};
+
+enum client_state {
+    CLIENT_READING,          /* waiting for the whole request */
+    CLIENT_STREAMING,        /* sent a part for every frame */
+    CLIENT_WAITING,          /* for the still thread to make a JPEG */
+    CLIENT_SNAPSHOT,         /* sent one JPEG */
+    CLIENT_CLOSING,          /* goes once the reply is out */
+};
+
+struct client {
+    int            fd;       /* -1 when the slot is free */
+    int            state;
+    char           request[REQUEST_MAX];
+    size_t         got;
+    const char    *reply;    /* response headers, or a whole response */
+    size_t         reply_len, reply_sent;
+    char           head[160];    /* reply headers made for this client */
+    struct snapshot_jpeg *still;
+    char          *text;     /* whole /metrics response, malloc'd */
+    struct part   *part;     /* part being sent, NULL between parts */
+    size_t         sent;     /* of part, header and trailer included */
+    unsigned long  last;     /* serial of the last part finished */
+    int            writing;  /* EPOLLOUT is armed */
+};
+
+struct httpd {
+    struct sink         sink;
+    struct frame_format format;
+    char               *addr;
+    struct snapshot    *snap;
+    struct metrics     *metrics;
+
+    pthread_t           thread;
+    int                 running;
+    atomic_int          quit;
+    int                 listen_fd;
+    int                 epoll_fd;
+    int                 wake_fd;
+
+    /* capture thread -> server thread, one frame deep like the display */
+    struct frame        incoming[FRAME_MAX_BUFFERS];
+    atomic_int          pending;
+
+    /* server thread <-> still thread, JPEGs for /snapshot.jpg are made */
+    /* over there so an encode never holds up the clients */
+    pthread_t           still_thread;
+    int                 still_running;
+    pthread_mutex_t     still_lock;
+    pthread_cond_t      still_cond;
+    int                 still_wanted;
+    int                 still_done;     /* still_jpeg is the answer, maybe NULL */
+    int                 still_quit;
+    struct snapshot_jpeg *still_jpeg;
+
+    /* server thread only */
+    struct mjpeg_encoder *encoder;
+    struct part         parts[MAX_PARTS];
+    struct part        *newest;
+    unsigned long       serial;
+    struct client       clients[MAX_CLIENTS];
+    int                 streaming;   /* clients wanting frames */
+    unsigned long       made;        /* parts made */
+    unsigned long       served;      /* clients that asked for a stream */
+    unsigned long       stills;      /* snapshots sent */
+    unsigned long       scrapes;     /* /metrics answered */
+};
+
+static void
+wake ( struct httpd *h ) {
+    uint64_t one = 1;
+
+    if ( write( h->wake_fd, &one, sizeof(one) ) < 0 && errno != EAGAIN ) {
+        perror("eventfd");
+    }
+}
+
+static void *
+make_stills ( void *arg ) {
+    struct httpd *h = arg;
+
+    pthread_mutex_lock(&h->still_lock);
+    for (;;) {
+        while ( h->still_wanted == 0 && h->still_quit == 0 ) {
+            pthread_cond_wait( &h->still_cond, &h->still_lock );
+        }
+        if ( h->still_quit ) { break; }
+        h->still_wanted = 0;
+        pthread_mutex_unlock(&h->still_lock);
+
+        /* made at most once per frame, however many ask at once */
+        struct snapshot_jpeg *jpeg = snapshot_get(h->snap);
+
+        pthread_mutex_lock(&h->still_lock);
+        snapshot_put(h->still_jpeg);
+        h->still_jpeg = jpeg;
+        h->still_done = 1;
+        pthread_mutex_unlock(&h->still_lock);
+
+        wake(h);
+        pthread_mutex_lock(&h->still_lock);
+    }
+    pthread_mutex_unlock(&h->still_lock);
+
+    return NULL;
+}
+
+static void
+want_still ( struct httpd *h ) {
+    pthread_mutex_lock(&h->still_lock);
+    h->still_wanted = 1;
+    pthread_cond_signal(&h->still_cond);
+    pthread_mutex_unlock(&h->still_lock);
+}
+
+static void
+push ( struct sink *sink, const struct frame *f ) {
+    struct httpd *h = (struct httpd *) sink;
+
+    frame_ref(f);
+    h->incoming[f->index] = *f;
+
+    /* a frame the server thread hasn't got to yet is replaced */
+    int old = atomic_exchange( &h->pending, f->index );
+    if ( old >= 0 ) {
+        frame_unref(&h->incoming[old]);
+    } else {
+        wake(h);
+    }
+}
+
+static void
+put_part ( struct part *p ) {
+    if ( p ) { p->refs--; }
+}
+
+static void
+set_events ( struct httpd *h, struct client *c, int writing ) {
+    struct epoll_event ev;
+
+    if ( c->writing == writing ) { return; }
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0);
+    ev.data.u32 = c - h->clients;
+    if ( epoll_ctl( h->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev ) < 0 ) {
+        perror("epoll_ctl");
+    }
+    c->writing = writing;
+}
+
+static void
+drop_client ( struct httpd *h, struct client *c ) {
+    epoll_ctl( h->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL );
+    close(c->fd);
+
+    if ( c->state == CLIENT_STREAMING ) { h->streaming--; }
+    put_part(c->part);
+    snapshot_put(c->still);
+    free(c->text);
+
+    memset( c, 0, sizeof(struct client) );
+    c->fd = -1;
+}
+
+/* Send as much as the socket takes: the reply, then parts for as long */
+/* as there are new ones. 0 if the client is finished with or gone. */
+static int
+flush_client ( struct httpd *h, struct client *c ) {
+    struct msghdr mh;
+    struct iovec iov[3];
+
+    for (;;) {
+        if ( c->reply_sent < c->reply_len ) {
+            ssize_t n = send( c->fd, c->reply + c->reply_sent,
+                c->reply_len - c->reply_sent, MSG_DONTWAIT | MSG_NOSIGNAL );
+            if ( n < 0 ) {
+                if ( errno == EAGAIN ) { break; }
+                if ( errno == EINTR ) { continue; }
+                return 0;
+            }
+            c->reply_sent += n;
+            continue;
+        }
+
+        if ( c->state == CLIENT_WAITING ) {
+            set_events(h, c, 0);
+            return 1;
+        }
+
+        if ( c->state == CLIENT_SNAPSHOT ) {
+            if ( c->sent == c->still->size ) { return 0; }
+
+            ssize_t n = send( c->fd, c->still->data + c->sent, c->still->size - c->sent,
+                MSG_DONTWAIT | MSG_NOSIGNAL );
+            if ( n < 0 ) {
+                if ( errno == EAGAIN ) { break; }
+                if ( errno == EINTR ) { continue; }
+                return 0;
+            }
+            c->sent += n;
+            continue;
+        }
+
+        if ( c->state != CLIENT_STREAMING ) { return c->state != CLIENT_CLOSING; }
+
+        if ( c->part == NULL ) {
+            if ( h->newest == NULL || h->newest->serial == c->last ) {
+                set_events(h, c, 0);
+                return 1;
+            }
+            c->part = h->newest;
+            c->part->refs++;
+            c->sent = 0;
+        }
+
+        /* header, jpeg and trailer, less whatever already went */
+        struct part *p = c->part;
+        size_t lens[3] = { p->header_len, p->size, sizeof(part_trailer) - 1 };
+        const void *bases[3] = { p->header, p->jpeg, part_trailer };
+        size_t skip = c->sent;
+        int niov = 0;
+
+        for ( int i=0; i<3; i++ ) {
+            if ( skip >= lens[i] ) {
+                skip -= lens[i];
+                continue;
+            }
+            iov[niov].iov_base = (char *) bases[i] + skip;
+            iov[niov].iov_len = lens[i] - skip;
+            niov++;
+            skip = 0;
+        }
+
+        memset( &mh, 0, sizeof(struct msghdr) );
+        mh.msg_iov = iov;
+        mh.msg_iovlen = niov;
+
+        ssize_t n = sendmsg( c->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL );
+        if ( n < 0 ) {
+            if ( errno == EAGAIN ) { break; }
+            if ( errno == EINTR ) { continue; }
+            return 0;
+        }
+
+        c->sent += n;
+        if ( c->sent == lens[0] + lens[1] + lens[2] ) {
+            c->last = p->serial;
+            put_part(p);
+            c->part = NULL;
+        }
+    }
+
+    /* socket is full - carry on when it drains */
+    set_events(h, c, 1);
+    return 1;
+}
+
+static void
+respond ( struct httpd *h, struct client *c, const char *reply, size_t len,
+    int state ) {
+    c->reply = reply;
+    c->reply_len = len;
+    c->reply_sent = 0;
+    c->state = state;
+
+    if ( state == CLIENT_STREAMING ) {
+        h->streaming++;
+        h->served++;
+    }
+}
+
+/* Counters as they are now, headers and all in one buffer. Returns its */
+/* length, 0 if it couldn't be made. */
+static size_t
+format_metrics ( struct httpd *h, char **text ) {
+    char head[160];
+    size_t size = 4096;
+
+    for (;;) {
+        char *buf = malloc(size);
+        if ( buf == NULL ) { return 0; }
+
+        size_t body = metrics_format( h->metrics, buf, size );
+        int n = snprintf( head, sizeof(head),
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n"
+            "\r\n", body );
+
+        /* again with room for the headers in front */
+        if ( n + body < size ) {
+            memmove( buf + n, buf, body );
+            memcpy( buf, head, n );
+            *text = buf;
+            return n + body;
+        }
+
+        free(buf);
+        size = n + body + 1;
+    }
+}
+
+/* we only care about the request line, GET and the path */
+static void
+handle_request ( struct httpd *h, struct client *c ) {
+    char path[256];
+
+    if ( sscanf( c->request, "GET %255s HTTP/", path ) != 1 ) {
+        respond( h, c, bad_request_reply, sizeof(bad_request_reply) - 1, CLIENT_CLOSING );
+        return;
+    }
+
+    /* query strings are for getting past browser caches */
+    char *query = strchr(path, '?');
+    if ( query ) { *query = '\0'; }
+
+    if ( strcmp( path, "/" ) == 0 || strcmp( path, "/stream.mjpg" ) == 0 ) {
+        respond( h, c, stream_reply, sizeof(stream_reply) - 1, CLIENT_STREAMING );
+    } else if ( strcmp( path, "/snapshot.jpg" ) == 0 ) {
+        /* answered by send_still once the JPEG is ready */
+        respond( h, c, NULL, 0, CLIENT_WAITING );
+        want_still(h);
+    } else if ( strcmp( path, "/metrics" ) == 0 && h->metrics ) {
+        size_t n = format_metrics( h, &c->text );
+        if ( n == 0 ) {
+            respond( h, c, error_reply, sizeof(error_reply) - 1, CLIENT_CLOSING );
+            return;
+        }
+        respond( h, c, c->text, n, CLIENT_CLOSING );
+        h->scrapes++;
+    } else {
+        respond( h, c, not_found_reply, sizeof(not_found_reply) - 1, CLIENT_CLOSING );
+    }
+}
+
+/* read the request, or after it anything the client sends, 0 if it has */
+/* gone away or is done */
+static int
+read_client ( struct httpd *h, struct client *c ) {
+    for (;;) {
+        char discard[256];
+        char *buf = discard;
+        size_t room = sizeof(discard);
+
+        if ( c->state == CLIENT_READING ) {
+            buf = c->request + c->got;
+            room = REQUEST_MAX - 1 - c->got;
+            if ( room == 0 ) {
+                respond( h, c, bad_request_reply, sizeof(bad_request_reply) - 1, CLIENT_CLOSING );
+                return flush_client(h, c);
+            }
+        }
+
+        ssize_t n = recv( c->fd, buf, room, MSG_DONTWAIT );
+        if ( n < 0 ) { return errno == EAGAIN || errno == EINTR; }
+        if ( n == 0 ) { return 0; }
+
+        if ( c->state == CLIENT_READING ) {
+            c->got += n;
+            c->request[c->got] = '\0';
+            if ( strstr( c->request, "\r\n\r\n" ) || strstr( c->request, "\n\n" ) ) {
+                handle_request(h, c);
+                if ( flush_client(h, c) == 0 ) { return 0; }
+            }
+        }
+    }
+}
+
+static void
+accept_client ( struct httpd *h ) {
+    struct epoll_event ev;
+    struct client *c = NULL;
+
+    int fd = accept4( h->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if ( fd < 0 ) { return; }
+
+    for ( int i=0; i<MAX_CLIENTS && c == NULL; i++ ) {
+        if ( h->clients[i].fd < 0 ) { c = &h->clients[i]; }
+    }
+
+    if ( c == NULL ) {
+        fprintf( stderr, "%s: too many HTTP clients\n", h->addr );
+        close(fd);
+        return;
+    }
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u32 = c - h->clients;
+    if ( epoll_ctl( h->epoll_fd, EPOLL_CTL_ADD, fd, &ev ) < 0 ) {
+        perror("epoll_ctl");
+        close(fd);
+        return;
+    }
+
+    memset( c, 0, sizeof(struct client) );
+    c->fd = fd;
+    c->state = CLIENT_READING;
+}
+
+/* turn a frame into the newest part, 0 if it couldn't be */
+static int
+make_part ( struct httpd *h, const struct frame *f ) {
+    const struct frame_format *fmt = &h->format;
+    struct part *p = NULL;
+
+    for ( int i=0; i<MAX_PARTS && p == NULL; i++ ) {
+        if ( h->parts[i].refs == 0 ) { p = &h->parts[i]; }
+    }
+    if ( p == NULL ) { return 0; }
+
+    if ( fmt->pixelformat == V4L2_PIX_FMT_MJPEG ) {
+        if ( p->cap < f->bytesused ) {
+            unsigned char *jpeg = realloc( p->jpeg, f->bytesused );
+            if ( jpeg == NULL ) { return 0; }
+            p->jpeg = jpeg;
+            p->cap = f->bytesused;
+        }
+        memcpy( p->jpeg, f->data, f->bytesused );
+        p->size = f->bytesused;
+    } else {
+        p->size = mjpeg_encode( h->encoder, fmt->pixelformat, f->data, fmt->stride,
+            fmt->width, fmt->height, &p->jpeg, &p->cap );
+        if ( p->size == 0 ) { return 0; }
+    }
+
+    p->header_len = snprintf( p->header, sizeof(p->header),
+        "--" BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n",
+        p->size );
+    p->serial = ++h->serial;
+    p->refs = 1;
+
+    put_part(h->newest);
+    h->newest = p;
+    h->made++;
+
+    return 1;
+}
+
+/* a JPEG from the still thread, to everyone waiting for one */
+static void
+send_still ( struct httpd *h ) {
+    pthread_mutex_lock(&h->still_lock);
+    int done = h->still_done;
+    struct snapshot_jpeg *jpeg = h->still_jpeg;
+    h->still_done = 0;
+    h->still_jpeg = NULL;
+    pthread_mutex_unlock(&h->still_lock);
+
+    if ( done == 0 ) { return; }
+
+    for ( int i=0; i<MAX_CLIENTS; i++ ) {
+        struct client *c = &h->clients[i];
+        if ( c->fd < 0 || c->state != CLIENT_WAITING ) { continue; }
+
+        if ( jpeg == NULL ) {
+            respond( h, c, unavailable_reply, sizeof(unavailable_reply) - 1, CLIENT_CLOSING );
+        } else {
+            atomic_fetch_add( &jpeg->refs, 1 );
+            c->still = jpeg;
+
+            int n = snprintf( c->head, sizeof(c->head),
+                "HTTP/1.0 200 OK\r\n"
+                "Content-Type: image/jpeg\r\n"
+                "Content-Length: %zu\r\n"
+                "Cache-Control: no-cache, no-store\r\n"
+                "Connection: close\r\n"
+                "\r\n", jpeg->size );
+            c->sent = 0;
+            respond( h, c, c->head, n, CLIENT_SNAPSHOT );
+            h->stills++;
+        }
+
+        if ( flush_client(h, c) == 0 ) { drop_client(h, c); }
+    }
+
+    snapshot_put(jpeg);
+}
+
+static void
+new_frame ( struct httpd *h, int index ) {
+    const struct frame *f = &h->incoming[index];
+
+    /* nobody watching, nothing to make */
+    int made = h->streaming > 0 && make_part(h, f);
+    frame_unref(f);
+    if ( made == 0 ) { return; }
+
+    /* clients between parts start on this one */
+    for ( int i=0; i<MAX_CLIENTS; i++ ) {
+        struct client *c = &h->clients[i];
+        if ( c->fd >= 0 && c->state == CLIENT_STREAMING && c->part == NULL &&
+            flush_client(h, c) == 0 ) {
+            drop_client(h, c);
+        }
+    }
+}
+
+static void *
+serve ( void *arg ) {
+    struct httpd *h = arg;
+    struct epoll_event events[MAX_CLIENTS + 2];
+
+    while ( atomic_load(&h->quit) == 0 ) {
+        int n = epoll_wait( h->epoll_fd, events, MAX_CLIENTS + 2, -1 );
+        if ( n < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            perror("epoll_wait");
+            break;
+        }
+
+        for ( int i=0; i<n; i++ ) {
+            uint32_t tag = events[i].data.u32;
+            uint32_t what = events[i].events;
+
+            if ( tag == TAG_LISTEN ) {
+                accept_client(h);
+            } else if ( tag == TAG_WAKE ) {
+                uint64_t count;
+                if ( read( h->wake_fd, &count, sizeof(count) ) < 0 ) {
+                    perror("eventfd");
+                }
+
+                int index = atomic_exchange( &h->pending, -1 );
+                if ( index >= 0 ) { new_frame(h, index); }
+                send_still(h);
+            } else {
+                struct client *c = &h->clients[tag];
+                if ( c->fd < 0 ) { continue; }
+
+                int ok = (what & (EPOLLHUP | EPOLLERR)) == 0;
+                if ( ok && (what & (EPOLLIN | EPOLLRDHUP)) ) { ok = read_client(h, c); }
+                if ( ok && (what & EPOLLOUT) ) { ok = flush_client(h, c); }
+                if ( ok == 0 ) { drop_client(h, c); }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void
+destroy ( struct sink *sink ) {
+    struct httpd *h = (struct httpd *) sink;
+
+    if ( h->running ) {
+        atomic_store(&h->quit, 1);
+        wake(h);
+        pthread_join(h->thread, NULL);
+
+        fprintf( stderr, "Made %lu JPEG frames for %lu HTTP streams on %s, sent %lu snapshots, %lu metrics\n",
+            h->made, h->served, h->addr, h->stills, h->scrapes
+        );
+    }
+
+    if ( h->still_running ) {
+        pthread_mutex_lock(&h->still_lock);
+        h->still_quit = 1;
+        pthread_cond_signal(&h->still_cond);
+        pthread_mutex_unlock(&h->still_lock);
+        pthread_join(h->still_thread, NULL);
+    }
+    snapshot_put(h->still_jpeg);
+
+    for ( int i=0; i<MAX_CLIENTS; i++ ) {
+        if ( h->clients[i].fd >= 0 ) { drop_client(h, &h->clients[i]); }
+    }
+
+    int index = atomic_exchange( &h->pending, -1 );
+    if ( index >= 0 ) { frame_unref(&h->incoming[index]); }
+
+    for ( int i=0; i<MAX_PARTS; i++ ) { free(h->parts[i].jpeg); }
+    mjpeg_encoder_destroy(h->encoder);
+    pthread_cond_destroy(&h->still_cond);
+    pthread_mutex_destroy(&h->still_lock);
+
+    if ( h->listen_fd >= 0 ) { close(h->listen_fd); }
+    if ( h->epoll_fd >= 0 ) { close(h->epoll_fd); }
+    if ( h->wake_fd >= 0 )  { close(h->wake_fd); }
+
+    free(h->addr);
+    free(h);
+}
+
+static int
+watch ( struct httpd *h, int fd, uint32_t tag ) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = EPOLLIN;
+    ev.data.u32 = tag;
+    if ( epoll_ctl( h->epoll_fd, EPOLL_CTL_ADD, fd, &ev ) < 0 ) {
+        perror("epoll_ctl");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* [host:]port to a listening socket, -1 on failure */
+static int
+listen_on ( const char *addr ) {
+    struct sockaddr_in sin;
+    char host[64] = "127.0.0.1";
+    const char *port = addr;
+    const char *colon = strrchr(addr, ':');
+    int one = 1;
+
+    if ( colon ) {
+        if ( (size_t) (colon - addr) >= sizeof(host) ) {
+            fprintf( stderr, "%s: bad address\n", addr );
+            return -1;
+        }
+        memcpy( host, addr, colon - addr );
+        host[colon - addr] = '\0';
+        port = colon + 1;
+    }
+
+    memset( &sin, 0, sizeof(struct sockaddr_in) );
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons( atoi(port) );
+    if ( inet_pton( AF_INET, host, &sin.sin_addr ) != 1 || sin.sin_port == 0 ) {
+        fprintf( stderr, "%s: bad address\n", addr );
+        return -1;
+    }
+
+    int fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( fd < 0 ) {
+        perror("socket");
+        return -1;
+    }
+
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+    if ( bind( fd, (struct sockaddr *) &sin, sizeof(sin) ) < 0 ||
+        listen( fd, MAX_CLIENTS ) < 0 ) {
+        perror(addr);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+struct sink *
+httpd_create ( const char *addr, const struct frame_format *fmt,
+    struct snapshot *snap, struct metrics *metrics ) {
+    struct httpd *h;
+
+    if ( fmt->pixelformat != V4L2_PIX_FMT_MJPEG && fmt->pixelformat != V4L2_PIX_FMT_YUYV &&
+        fmt->pixelformat != V4L2_PIX_FMT_NV12 && fmt->pixelformat != V4L2_PIX_FMT_GREY ) {
+        fprintf( stderr, "HTTP streaming can't handle the capture format\n" );
+        return NULL;
+    }
+
+    h = calloc(1, sizeof(struct httpd));
+    if ( h == NULL ) { return NULL; }
+
+    h->sink.name = "HTTP server";
+    h->sink.push = push;
+    h->sink.destroy = destroy;
+    h->format = *fmt;
+    h->addr = strdup(addr);
+    h->snap = snap;
+    h->metrics = metrics;
+    h->listen_fd = -1;
+    h->epoll_fd = -1;
+    h->wake_fd = -1;
+    atomic_init(&h->quit, 0);
+    atomic_init(&h->pending, -1);
+    pthread_mutex_init(&h->still_lock, NULL);
+    pthread_cond_init(&h->still_cond, NULL);
+    for ( int i=0; i<MAX_CLIENTS; i++ ) { h->clients[i].fd = -1; }
+
+    if ( fmt->pixelformat != V4L2_PIX_FMT_MJPEG ) {
+        h->encoder = mjpeg_encoder_create(JPEG_QUALITY);
+        if ( h->encoder == NULL ) {
+            destroy(&h->sink);
+            return NULL;
+        }
+    }
+
+    h->wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( h->wake_fd < 0 ) {
+        perror("eventfd");
+        destroy(&h->sink);
+        return NULL;
+    }
+
+    h->listen_fd = listen_on(addr);
+    if ( h->listen_fd < 0 ) {
+        destroy(&h->sink);
+        return NULL;
+    }
+
+    h->epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+    if ( h->epoll_fd < 0 ) {
+        perror("epoll_create1");
+        destroy(&h->sink);
+        return NULL;
+    }
+
+    if ( watch(h, h->listen_fd, TAG_LISTEN) == 0 ||
+        watch(h, h->wake_fd, TAG_WAKE) == 0 ) {
+        destroy(&h->sink);
+        return NULL;
+    }
+
+    if ( pthread_create( &h->still_thread, NULL, make_stills, h ) != 0 ) {
+        fprintf( stderr, "Unable to start HTTP snapshot thread\n" );
+        destroy(&h->sink);
+        return NULL;
+    }
+    h->still_running = 1;
+
+    if ( pthread_create( &h->thread, NULL, serve, h ) != 0 ) {
+        fprintf( stderr, "Unable to start HTTP server thread\n" );
+        destroy(&h->sink);
+        return NULL;
+    }
+    h->running = 1;
+
+    return &h->sink;
+}
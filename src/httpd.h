@@ -0,0 +1,23 @@
+#ifndef HTTPD_H
+#define HTTPD_H
+
+#include "frame.h"
+#include "metrics.h"
+#include "snapshot.h"
+
+/* MJPEG over HTTP for browsers. GET / (or /stream.mjpg) answers with a */
+/* multipart/x-mixed-replace stream of JPEGs, one part per frame, */
+/* GET /snapshot.jpg with the newest frame from snap, and GET /metrics */
+/* with the counters in metrics for Prometheus, if it isn't NULL. */
+/*                                                                    */
+/* Each frame is made into a part once - copied when the camera sends */
+/* MJPEG, encoded otherwise, and only while someone is watching - and */
+/* that one part is written to every client with writev. A client that */
+/* can't keep up skips to the newest part when it finishes the one it */
+/* is on, so it gets a lower frame rate rather than a growing backlog. */
+/*                                                                    */
+/* addr is [host:]port, host defaulting to 127.0.0.1. */
+struct sink *httpd_create ( const char *addr, const struct frame_format *fmt,
+    struct snapshot *snap, struct metrics *metrics );
+
+#endif
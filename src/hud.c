@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <memory.h>  /* memset */
+
+#include "hud.h"
+
+#define FIRST_GLYPH ' '
+#define LAST_GLYPH  '~'
+#define NUM_GLYPHS  (LAST_GLYPH - FIRST_GLYPH + 1)
+
+/* glyphs are 5x7 in 6x8 cells, laid out 16 to a row in the atlas */
+#define GLYPH_W      5
+#define GLYPH_H      7
+#define CELL_W       6
+#define CELL_H       8
+#define ATLAS_COLS   16
+#define ATLAS_ROWS   ((NUM_GLYPHS + ATLAS_COLS - 1) / ATLAS_COLS)
+#define ATLAS_W      (ATLAS_COLS * CELL_W)
+#define ATLAS_H      (ATLAS_ROWS * CELL_H)
+
+#define MAX_CHARS    1024
+#define MARGIN       4    /* in font pixels, around and between the lines */
+
+/* One byte per column, least significant bit at the top. */
+static const Uint8 font[NUM_GLYPHS][GLYPH_W] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00 }, /* space */
+    { 0x00, 0x00, 0x5f, 0x00, 0x00 }, /* ! */
+    { 0x00, 0x07, 0x00, 0x07, 0x00 }, /* " */
+    { 0x14, 0x7f, 0x14, 0x7f, 0x14 }, /* # */
+    { 0x24, 0x2a, 0x7f, 0x2a, 0x12 }, /* $ */
+    { 0x23, 0x13, 0x08, 0x64, 0x62 }, /* % */
+    { 0x36, 0x49, 0x55, 0x22, 0x50 }, /* & */
+    { 0x00, 0x05, 0x03, 0x00, 0x00 }, /* ' */
+    { 0x00, 0x1c, 0x22, 0x41, 0x00 }, /* ( */
+    { 0x00, 0x41, 0x22, 0x1c, 0x00 }, /* ) */
+    { 0x08, 0x2a, 0x1c, 0x2a, 0x08 }, /* * */
+    { 0x08, 0x08, 0x3e, 0x08, 0x08 }, /* + */
+    { 0x00, 0x50, 0x30, 0x00, 0x00 }, /* , */
+    { 0x08, 0x08, 0x08, 0x08, 0x08 }, /* - */
+    { 0x00, 0x60, 0x60, 0x00, 0x00 }, /* . */
+    { 0x20, 0x10, 0x08, 0x04, 0x02 }, /* / */
+    { 0x3e, 0x51, 0x49, 0x45, 0x3e }, /* 0 */
+    { 0x00, 0x42, 0x7f, 0x40, 0x00 }, /* 1 */
+    { 0x42, 0x61, 0x51, 0x49, 0x46 }, /* 2 */
+    { 0x21, 0x41, 0x45, 0x4b, 0x31 }, /* 3 */
+    { 0x18, 0x14, 0x12, 0x7f, 0x10 }, /* 4 */
+    { 0x27, 0x45, 0x45, 0x45, 0x39 }, /* 5 */
+    { 0x3c, 0x4a, 0x49, 0x49, 0x30 }, /* 6 */
+    { 0x01, 0x71, 0x09, 0x05, 0x03 }, /* 7 */
+    { 0x36, 0x49, 0x49, 0x49, 0x36 }, /* 8 */
+    { 0x06, 0x49, 0x49, 0x29, 0x1e }, /* 9 */
+    { 0x00, 0x36, 0x36, 0x00, 0x00 }, /* : */
+    { 0x00, 0x56, 0x36, 0x00, 0x00 }, /* ; */
+    { 0x08, 0x14, 0x22, 0x41, 0x00 }, /* < */
+    { 0x14, 0x14, 0x14, 0x14, 0x14 }, /* = */
+    { 0x00, 0x41, 0x22, 0x14, 0x08 }, /* > */
+    { 0x02, 0x01, 0x51, 0x09, 0x06 }, /* ? */
+    { 0x32, 0x49, 0x79, 0x41, 0x3e }, /* @ */
+    { 0x7e, 0x11, 0x11, 0x11, 0x7e }, /* A */
+    { 0x7f, 0x49, 0x49, 0x49, 0x36 }, /* B */
+    { 0x3e, 0x41, 0x41, 0x41, 0x22 }, /* C */
+    { 0x7f, 0x41, 0x41, 0x22, 0x1c }, /* D */
+    { 0x7f, 0x49, 0x49, 0x49, 0x41 }, /* E */
+    { 0x7f, 0x09, 0x09, 0x09, 0x01 }, /* F */
+    { 0x3e, 0x41, 0x49, 0x49, 0x7a }, /* G */
+    { 0x7f, 0x08, 0x08, 0x08, 0x7f }, /* H */
+    { 0x00, 0x41, 0x7f, 0x41, 0x00 }, /* I */
+    { 0x20, 0x40, 0x41, 0x3f, 0x01 }, /* J */
+    { 0x7f, 0x08, 0x14, 0x22, 0x41 }, /* K */
+    { 0x7f, 0x40, 0x40, 0x40, 0x40 }, /* L */
+    { 0x7f, 0x02, 0x0c, 0x02, 0x7f }, /* M */
+    { 0x7f, 0x04, 0x08, 0x10, 0x7f }, /* N */
+    { 0x3e, 0x41, 0x41, 0x41, 0x3e }, /* O */
+    { 0x7f, 0x09, 0x09, 0x09, 0x06 }, /* P */
+    { 0x3e, 0x41, 0x51, 0x21, 0x5e }, /* Q */
+    { 0x7f, 0x09, 0x19, 0x29, 0x46 }, /* R */
+    { 0x46, 0x49, 0x49, 0x49, 0x31 }, /* S */
+    { 0x01, 0x01, 0x7f, 0x01, 0x01 }, /* T */
+    { 0x3f, 0x40, 0x40, 0x40, 0x3f }, /* U */
+    { 0x1f, 0x20, 0x40, 0x20, 0x1f }, /* V */
+    { 0x3f, 0x40, 0x38, 0x40, 0x3f }, /* W */
+    { 0x63, 0x14, 0x08, 0x14, 0x63 }, /* X */
+    { 0x07, 0x08, 0x70, 0x08, 0x07 }, /* Y */
+    { 0x61, 0x51, 0x49, 0x45, 0x43 }, /* Z */
+    { 0x00, 0x7f, 0x41, 0x41, 0x00 }, /* [ */
+    { 0x02, 0x04, 0x08, 0x10, 0x20 }, /* \ */
+    { 0x00, 0x41, 0x41, 0x7f, 0x00 }, /* ] */
+    { 0x04, 0x02, 0x01, 0x02, 0x04 }, /* ^ */
+    { 0x40, 0x40, 0x40, 0x40, 0x40 }, /* _ */
+    { 0x00, 0x01, 0x02, 0x04, 0x00 }, /* ` */
+    { 0x20, 0x54, 0x54, 0x54, 0x78 }, /* a */
+    { 0x7f, 0x48, 0x44, 0x44, 0x38 }, /* b */
+    { 0x38, 0x44, 0x44, 0x44, 0x20 }, /* c */
+    { 0x38, 0x44, 0x44, 0x48, 0x7f }, /* d */
+    { 0x38, 0x54, 0x54, 0x54, 0x18 }, /* e */
+    { 0x08, 0x7e, 0x09, 0x01, 0x02 }, /* f */
+    { 0x0c, 0x52, 0x52, 0x52, 0x3e }, /* g */
+    { 0x7f, 0x08, 0x04, 0x04, 0x78 }, /* h */
+    { 0x00, 0x44, 0x7d, 0x40, 0x00 }, /* i */
+    { 0x20, 0x40, 0x44, 0x3d, 0x00 }, /* j */
+    { 0x7f, 0x10, 0x28, 0x44, 0x00 }, /* k */
+    { 0x00, 0x41, 0x7f, 0x40, 0x00 }, /* l */
+    { 0x7c, 0x04, 0x18, 0x04, 0x78 }, /* m */
+    { 0x7c, 0x08, 0x04, 0x04, 0x78 }, /* n */
+    { 0x38, 0x44, 0x44, 0x44, 0x38 }, /* o */
+    { 0x7c, 0x14, 0x14, 0x14, 0x08 }, /* p */
+    { 0x08, 0x14, 0x14, 0x18, 0x7c }, /* q */
+    { 0x7c, 0x08, 0x04, 0x04, 0x08 }, /* r */
+    { 0x48, 0x54, 0x54, 0x54, 0x20 }, /* s */
+    { 0x04, 0x3f, 0x44, 0x40, 0x20 }, /* t */
+    { 0x3c, 0x40, 0x40, 0x20, 0x7c }, /* u */
+    { 0x1c, 0x20, 0x40, 0x20, 0x1c }, /* v */
+    { 0x3c, 0x40, 0x30, 0x40, 0x3c }, /* w */
+    { 0x44, 0x28, 0x10, 0x28, 0x44 }, /* x */
+    { 0x0c, 0x50, 0x50, 0x50, 0x3c }, /* y */
+    { 0x44, 0x64, 0x54, 0x4c, 0x44 }, /* z */
+    { 0x00, 0x08, 0x36, 0x41, 0x00 }, /* { */
+    { 0x00, 0x00, 0x7f, 0x00, 0x00 }, /* | */
+    { 0x00, 0x41, 0x36, 0x08, 0x00 }, /* } */
+    { 0x08, 0x04, 0x08, 0x10, 0x08 }, /* ~ */
+};
+
+struct hud {
+    SDL_Renderer *renderer;
+    SDL_Texture  *atlas;
+    int           scale;     /* screen pixels per font pixel */
+
+    /* quads for the current text, four corners and six indices each */
+    SDL_Vertex    vertices[MAX_CHARS * 4];
+    int           indices[MAX_CHARS * 6];
+    int           nchars;
+    SDL_Rect      box;       /* background behind the text */
+};
+
+/* white glyphs, coverage in alpha, so vertex colour tints them */
+static SDL_Texture *
+make_atlas ( SDL_Renderer *renderer ) {
+    Uint8 pixels[ATLAS_H][ATLAS_W][4];
+
+    memset( pixels, 0, sizeof(pixels) );
+
+    for ( int g=0; g<NUM_GLYPHS; g++ ) {
+        int x0 = (g % ATLAS_COLS) * CELL_W;
+        int y0 = (g / ATLAS_COLS) * CELL_H;
+
+        for ( int x=0; x<GLYPH_W; x++ ) {
+            for ( int y=0; y<GLYPH_H; y++ ) {
+                Uint8 *p = pixels[y0 + y][x0 + x];
+                p[0] = p[1] = p[2] = 255;
+                p[3] = (font[g][x] >> y) & 1 ? 255 : 0;
+            }
+        }
+    }
+
+    SDL_Texture *atlas = SDL_CreateTexture(
+        renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC,
+        ATLAS_W, ATLAS_H
+    );
+    if ( atlas == NULL ) {
+        fprintf( stderr, "SDL_CreateTexture : %s\n", SDL_GetError() );
+        return NULL;
+    }
+
+    if ( SDL_UpdateTexture( atlas, NULL, pixels, ATLAS_W * 4 ) < 0 ) {
+        fprintf( stderr, "SDL_UpdateTexture : %s\n", SDL_GetError() );
+        SDL_DestroyTexture(atlas);
+        return NULL;
+    }
+
+    /* font pixels stay square whatever the renderer's scale quality */
+    SDL_SetTextureBlendMode( atlas, SDL_BLENDMODE_BLEND );
+    SDL_SetTextureScaleMode( atlas, SDL_ScaleModeNearest );
+
+    return atlas;
+}
+
+static void
+add_glyph ( struct hud *h, int c, float x, float y ) {
+    const SDL_Color colour = { 255, 255, 255, 255 };
+    int g = c - FIRST_GLYPH;
+    float u = (float) ((g % ATLAS_COLS) * CELL_W) / ATLAS_W;
+    float v = (float) ((g / ATLAS_COLS) * CELL_H) / ATLAS_H;
+    float du = (float) GLYPH_W / ATLAS_W, dv = (float) GLYPH_H / ATLAS_H;
+    float w = GLYPH_W * h->scale, ht = GLYPH_H * h->scale;
+
+    SDL_Vertex *q = &h->vertices[h->nchars * 4];
+    q[0] = (SDL_Vertex) { { x,     y      }, colour, { u,      v      } };
+    q[1] = (SDL_Vertex) { { x + w, y      }, colour, { u + du, v      } };
+    q[2] = (SDL_Vertex) { { x + w, y + ht }, colour, { u + du, v + dv } };
+    q[3] = (SDL_Vertex) { { x,     y + ht }, colour, { u,      v + dv } };
+
+    h->nchars++;
+}
+
+void
+hud_set_text ( struct hud *h, const char *text ) {
+    int margin = MARGIN * h->scale;
+    int col = 0, cols = 0, lines = 1;
+
+    h->nchars = 0;
+
+    for ( const char *c = text; *c; c++ ) {
+        if ( *c == '\n' ) {
+            col = 0;
+            lines++;
+            continue;
+        }
+
+        /* spaces take room but need no quad */
+        if ( *c != ' ' && h->nchars < MAX_CHARS ) {
+            int glyph = *c >= FIRST_GLYPH && *c <= LAST_GLYPH ? *c : '?';
+            add_glyph( h, glyph,
+                margin*2 + col * CELL_W * h->scale,
+                margin*2 + (lines - 1) * (CELL_H + 1) * h->scale );
+        }
+
+        if ( ++col > cols ) { cols = col; }
+    }
+
+    h->box.x = margin;
+    h->box.y = margin;
+    h->box.w = cols * CELL_W * h->scale + margin*2;
+    h->box.h = lines * (CELL_H + 1) * h->scale + margin*2;
+}
+
+void
+hud_draw ( struct hud *h ) {
+    Uint8 r, g, b, a;
+
+    if ( h->nchars == 0 ) { return; }
+
+    SDL_GetRenderDrawColor( h->renderer, &r, &g, &b, &a );
+    SDL_SetRenderDrawBlendMode( h->renderer, SDL_BLENDMODE_BLEND );
+    SDL_SetRenderDrawColor( h->renderer, 0, 0, 0, 160 );
+    SDL_RenderFillRect( h->renderer, &h->box );
+    SDL_SetRenderDrawColor( h->renderer, r, g, b, a );
+
+    SDL_RenderGeometry( h->renderer, h->atlas,
+        h->vertices, h->nchars * 4, h->indices, h->nchars * 6 );
+}
+
+void
+hud_destroy ( struct hud *h ) {
+    if ( h == NULL ) { return; }
+    if ( h->atlas ) { SDL_DestroyTexture(h->atlas); }
+    free(h);
+}
+
+struct hud *
+hud_create ( SDL_Renderer *renderer, int height ) {
+    struct hud *h = calloc(1, sizeof(struct hud));
+    if ( h == NULL ) { return NULL; }
+
+    h->renderer = renderer;
+
+    /* readable at about 3% of the frame height */
+    h->scale = height / 240;
+    if ( h->scale < 1 ) { h->scale = 1; }
+
+    h->atlas = make_atlas(renderer);
+    if ( h->atlas == NULL ) {
+        hud_destroy(h);
+        return NULL;
+    }
+
+    /* two triangles a quad, and the quads never move in the array */
+    for ( int i=0; i<MAX_CHARS; i++ ) {
+        int *t = &h->indices[i * 6];
+        t[0] = i*4;     t[1] = i*4 + 1; t[2] = i*4 + 2;
+        t[3] = i*4;     t[4] = i*4 + 2; t[5] = i*4 + 3;
+    }
+
+    return h;
+}
@@ -0,0 +1,22 @@
+#ifndef HUD_H
+#define HUD_H
+
+#include <SDL2/SDL.h>
+
+/* Text overlay in the top left corner of the window. Glyphs come from a */
+/* built in 5x7 font rasterized once into a small texture, and the text */
+/* is turned into one batch of quads whenever it changes, so drawing it */
+/* is a background rectangle and a single SDL_RenderGeometry. */
+struct hud;
+
+/* height is the renderer's logical height, which the glyphs scale with */
+struct hud *hud_create ( SDL_Renderer *renderer, int height );
+void hud_destroy ( struct hud *h );
+
+/* lines separated by '\n', printable ASCII only */
+void hud_set_text ( struct hud *h, const char *text );
+
+/* draw over whatever has been rendered so far */
+void hud_draw ( struct hud *h );
+
+#endif
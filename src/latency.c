@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <time.h>        /* clock_gettime */
+
+#include "latency.h"
+
+int64_t
+latency_now_us ( void ) {
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+bucket ( uint64_t v ) {
+    if ( v < LATENCY_SUB_BUCKETS ) { return v; }
+
+    /* the top LATENCY_SUB_BITS + 1 bits pick the bucket */
+    int shift = 63 - __builtin_clzll(v) - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + (int) (v >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+/* largest value that lands in bucket i */
+static int64_t
+bucket_top ( int i ) {
+    if ( i < LATENCY_SUB_BUCKETS ) { return i; }
+
+    int shift = i / LATENCY_SUB_BUCKETS - 1;
+    int64_t sub = i % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void
+latency_record ( struct latency *l, int64_t us ) {
+    /* clocks that stepped backwards count as no time at all */
+    if ( us < 0 ) { us = 0; }
+    if ( us >= (int64_t) 1 << LATENCY_MAX_BITS ) { us = ((int64_t) 1 << LATENCY_MAX_BITS) - 1; }
+
+    l->counts[bucket(us)]++;
+    l->total++;
+    if ( us > l->max ) { l->max = us; }
+}
+
+int64_t
+latency_percentile ( const struct latency *l, double pct ) {
+    uint64_t want = l->total * pct / 100.0 + 0.5;
+    uint64_t seen = 0;
+
+    if ( want == 0 ) { want = 1; }
+
+    for ( int i=0; i<LATENCY_BUCKETS; i++ ) {
+        seen += l->counts[i];
+        if ( seen >= want ) {
+            int64_t top = bucket_top(i);
+            return top < l->max ? top : l->max;
+        }
+    }
+
+    return l->max;
+}
+
+void
+latency_print ( const struct latency *l, const char *what ) {
+    if ( l->total == 0 ) { return; }
+
+    fprintf( stderr, "%-20s p50 %7.2f ms  p99 %7.2f ms  max %7.2f ms  (%llu frames)\n",
+        what,
+        latency_percentile(l, 50) / 1000.0,
+        latency_percentile(l, 99) / 1000.0,
+        l->max / 1000.0,
+        (unsigned long long) l->total
+    );
+}
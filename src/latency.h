@@ -0,0 +1,33 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+/* Latency histogram in the HdrHistogram style: buckets are linear within */
+/* each power of two and there are LATENCY_SUB_BUCKETS of them to a */
+/* power, so any value is known to within about 3% in fixed memory and */
+/* recording is a couple of shifts. Values are in microseconds. */
+
+#define LATENCY_SUB_BITS    5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS    40   /* 2^40 us is twelve days, plenty */
+#define LATENCY_BUCKETS     ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+struct latency {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    int64_t  max;
+};
+
+/* now on the clock V4L2 timestamps its buffers with */
+int64_t latency_now_us ( void );
+
+void latency_record ( struct latency *l, int64_t us );
+
+/* value at or below which pct percent of the recorded values fall */
+int64_t latency_percentile ( const struct latency *l, double pct );
+
+/* one line of p50/p99/max to stderr, nothing if nothing was recorded */
+void latency_print ( const struct latency *l, const char *what );
+
+#endif
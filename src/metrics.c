@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <memory.h>    /* memset */
+
+#include "metrics.h"
+
+struct metrics {
+    struct metrics_slot slots[METRICS_MAX_SLOTS];
+    atomic_int          nslots;
+};
+
+/* How each counter is exported. Times are counted in microseconds and */
+/* exported in seconds, as Prometheus expects. */
+static const struct {
+    const char *name;
+    const char *labels;
+    const char *help;
+    int         us;
+} exported[METRIC_COUNT] = {
+    [METRIC_FRAMES_CAPTURED]  = { "camera_frames_captured_total", NULL,
+        "Frames dequeued from the camera without error.", 0 },
+    [METRIC_DRIVER_DROPS]     = { "camera_frames_dropped_total", "by=\"driver\"",
+        "Frames lost, by the driver before we saw them or by us before they were shown.", 0 },
+    [METRIC_APP_DROPS]        = { "camera_frames_dropped_total", "by=\"app\"",
+        NULL, 0 },
+    [METRIC_FRAMES_PRESENTED] = { "camera_frames_presented_total", NULL,
+        "Frames put on screen.", 0 },
+    [METRIC_UPLOAD_BYTES]     = { "camera_upload_bytes_total", NULL,
+        "Bytes written into the display texture.", 0 },
+    [METRIC_DEQUEUE_WAIT_US]  = { "camera_dequeue_wait_seconds_total", NULL,
+        "Time the capture thread spent waiting for frames.", 1 },
+    [METRIC_RENDER_US]        = { "camera_render_seconds_total", NULL,
+        "Time the render thread spent getting frames on screen.", 1 },
+};
+
+struct metrics_slot *
+metrics_slot ( struct metrics *m ) {
+    int i = atomic_fetch_add( &m->nslots, 1 );
+    if ( i >= METRICS_MAX_SLOTS ) {
+        fprintf( stderr, "Out of metrics slots\n" );
+        return NULL;
+    }
+    return &m->slots[i];
+}
+
+uint64_t
+metrics_get ( struct metrics *m, enum metric which ) {
+    uint64_t sum = 0;
+
+    for ( int i=0; i<METRICS_MAX_SLOTS; i++ ) {
+        sum += atomic_load_explicit( &m->slots[i].counts[which], memory_order_relaxed );
+    }
+
+    return sum;
+}
+
+size_t
+metrics_format ( struct metrics *m, char *buf, size_t size ) {
+    size_t len = 0;
+
+    for ( int i=0; i<METRIC_COUNT; i++ ) {
+        uint64_t v = metrics_get(m, i);
+        char *at = buf + (len < size ? len : size);
+        size_t room = len < size ? size - len : 0;
+        int n;
+
+        /* labelled counters share the HELP and TYPE of the first */
+        if ( exported[i].help ) {
+            n = snprintf( at, room, "# HELP %s %s\n# TYPE %s counter\n",
+                exported[i].name, exported[i].help, exported[i].name );
+            len += n;
+            at = buf + (len < size ? len : size);
+            room = len < size ? size - len : 0;
+        }
+
+        if ( exported[i].us ) {
+            n = snprintf( at, room, "%s %llu.%06llu\n", exported[i].name,
+                (unsigned long long) v / 1000000, (unsigned long long) v % 1000000 );
+        } else if ( exported[i].labels ) {
+            n = snprintf( at, room, "%s{%s} %llu\n", exported[i].name,
+                exported[i].labels, (unsigned long long) v );
+        } else {
+            n = snprintf( at, room, "%s %llu\n", exported[i].name,
+                (unsigned long long) v );
+        }
+        len += n;
+    }
+
+    return len;
+}
+
+void
+metrics_destroy ( struct metrics *m ) {
+    free(m);
+}
+
+struct metrics *
+metrics_create ( void ) {
+    /* calloc only promises alignment for the basic types */
+    struct metrics *m = aligned_alloc( METRICS_CACHE_LINE, sizeof(struct metrics) );
+    if ( m == NULL ) { return NULL; }
+
+    memset( m, 0, sizeof(struct metrics) );
+    atomic_init( &m->nslots, 0 );
+
+    return m;
+}
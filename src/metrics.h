@@ -0,0 +1,55 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pipeline counters, exported in the Prometheus text format. */
+/*                                                              */
+/* Each thread that counts claims a slot of its own and is the only one */
+/* to write to it. Slots are cache line aligned, so adding to a counter */
+/* is a plain load and store with no locked instruction and no line */
+/* bouncing between cores. Readers add the slots up. */
+
+enum metric {
+    METRIC_FRAMES_CAPTURED,  /* good frames dequeued */
+    METRIC_DRIVER_DROPS,     /* sequence gaps and error buffers */
+    METRIC_APP_DROPS,        /* dequeued but never shown */
+    METRIC_FRAMES_PRESENTED,
+    METRIC_UPLOAD_BYTES,     /* written into the display texture */
+    METRIC_DEQUEUE_WAIT_US,  /* capture thread waiting on the camera */
+    METRIC_RENDER_US,        /* render thread from frame to present */
+    METRIC_COUNT
+};
+
+#define METRICS_MAX_SLOTS  8
+#define METRICS_CACHE_LINE 64
+
+struct metrics_slot {
+    _Alignas(METRICS_CACHE_LINE) atomic_uint_least64_t counts[METRIC_COUNT];
+};
+
+struct metrics;
+
+struct metrics *metrics_create ( void );
+void metrics_destroy ( struct metrics *m );
+
+/* A slot for the calling thread to count in, NULL if all are taken. */
+struct metrics_slot *metrics_slot ( struct metrics *m );
+
+/* sum of which over every slot */
+uint64_t metrics_get ( struct metrics *m, enum metric which );
+
+/* Exposition text for every counter. Returns the length it needed, */
+/* like snprintf, so size can be grown and the call made again. */
+size_t metrics_format ( struct metrics *m, char *buf, size_t size );
+
+/* only ever called by the thread that owns the slot */
+static inline void
+metrics_add ( struct metrics_slot *slot, enum metric which, uint64_t n ) {
+    uint64_t v = atomic_load_explicit( &slot->counts[which], memory_order_relaxed );
+    atomic_store_explicit( &slot->counts[which], v + n, memory_order_relaxed );
+}
+
+#endif
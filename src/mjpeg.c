@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+#include <jpeglib.h>
+
+#include <linux/videodev2.h>
+
+#include "latency.h"
+#include "mjpeg.h"
+
+/* rows handed to libjpeg per jpeg_read_scanlines call */
+#define MAX_ROWS 16
+
+struct mjpeg_decoder {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    jmp_buf env;       /* where to go when libjpeg hits a bad frame */
+};
+
+/* libjpeg's default handler calls exit() - we want to drop the frame. */
+/* client_data is the jmp_buf to go back to. */
+static void
+error_exit ( j_common_ptr cinfo ) {
+    jmp_buf *env = cinfo->client_data;
+    longjmp(*env, 1);
+}
+
+/* warnings are common on webcam streams and not worth reporting */
+static void
+output_message ( j_common_ptr cinfo ) {
+    (void) cinfo;
+}
+
+struct mjpeg_decoder *
+mjpeg_create ( void ) {
+    struct mjpeg_decoder *d = calloc(1, sizeof(struct mjpeg_decoder));
+    if ( d == NULL ) { return NULL; }
+
+    d->cinfo.err = jpeg_std_error(&d->jerr);
+    d->jerr.error_exit = error_exit;
+    d->jerr.output_message = output_message;
+    d->cinfo.client_data = &d->env;
+    jpeg_create_decompress(&d->cinfo);
+
+    return d;
+}
+
+void
+mjpeg_destroy ( struct mjpeg_decoder *d ) {
+    if ( d == NULL ) { return; }
+    jpeg_destroy_decompress(&d->cinfo);
+    free(d);
+}
+
+int
+mjpeg_decode ( struct mjpeg_decoder *d, const void *jpeg, size_t size,
+    void *pixels, int pitch, int width, int height ) {
+    struct jpeg_decompress_struct *cinfo = &d->cinfo;
+    JSAMPROW rows[MAX_ROWS];
+
+    if ( setjmp(d->env) ) {
+        jpeg_abort_decompress(cinfo);
+        return 0;
+    }
+
+    /* UVC cameras usually leave out the Huffman tables, libjpeg-turbo */
+    /* falls back to the standard ones for us */
+    jpeg_mem_src( cinfo, (const unsigned char *) jpeg, size );
+    if ( jpeg_read_header( cinfo, TRUE ) != JPEG_HEADER_OK ) {
+        jpeg_abort_decompress(cinfo);
+        return 0;
+    }
+
+    /* speed over accuracy - this only ever goes to the screen */
+    cinfo->out_color_space = JCS_RGB;
+    cinfo->dct_method = JDCT_IFAST;
+    cinfo->do_fancy_upsampling = FALSE;
+
+    jpeg_start_decompress(cinfo);
+
+    if ( cinfo->output_width != (JDIMENSION) width ||
+        cinfo->output_height != (JDIMENSION) height ) {
+        jpeg_abort_decompress(cinfo);
+        return 0;
+    }
+
+    /* decode straight into the caller's rows */
+    while ( cinfo->output_scanline < cinfo->output_height ) {
+        int n = cinfo->output_height - cinfo->output_scanline;
+        if ( n > MAX_ROWS ) { n = MAX_ROWS; }
+
+        for ( int i=0; i<n; i++ ) {
+            rows[i] = (JSAMPROW) pixels + (cinfo->output_scanline + i) * pitch;
+        }
+
+        jpeg_read_scanlines( cinfo, rows, n );
+    }
+
+    jpeg_finish_decompress(cinfo);
+
+    return 1;
+}
+
+struct mjpeg_encoder {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    jmp_buf        env;
+    int            quality;
+    unsigned char *row;      /* MAX_ROWS lines of packed YCbCr */
+    int            row_width;
+};
+
+struct mjpeg_encoder *
+mjpeg_encoder_create ( int quality ) {
+    struct mjpeg_encoder *e = calloc(1, sizeof(struct mjpeg_encoder));
+    if ( e == NULL ) { return NULL; }
+
+    e->cinfo.err = jpeg_std_error(&e->jerr);
+    e->jerr.error_exit = error_exit;
+    e->jerr.output_message = output_message;
+    e->cinfo.client_data = &e->env;
+    e->quality = quality;
+    jpeg_create_compress(&e->cinfo);
+
+    return e;
+}
+
+void
+mjpeg_encoder_destroy ( struct mjpeg_encoder *e ) {
+    if ( e == NULL ) { return; }
+    jpeg_destroy_compress(&e->cinfo);
+    free(e->row);
+    free(e);
+}
+
+/* one line of the frame as the 4:4:4 YCbCr libjpeg takes */
+static void
+expand_row ( unsigned char *dst, uint32_t pixelformat, const unsigned char *src,
+    int stride, int width, int height, int y ) {
+    if ( pixelformat == V4L2_PIX_FMT_YUYV ) {
+        const unsigned char *p = src + (size_t) y * stride;
+        for ( int x=0; x<width; x+=2, p+=4, dst+=6 ) {
+            dst[0] = p[0]; dst[1] = p[1]; dst[2] = p[3];
+            dst[3] = p[2]; dst[4] = p[1]; dst[5] = p[3];
+        }
+    } else {
+        const unsigned char *luma = src + (size_t) y * stride;
+        const unsigned char *uv = src + (size_t) stride * height + (size_t) (y / 2) * stride;
+        for ( int x=0; x<width; x+=2, dst+=6 ) {
+            dst[0] = luma[x];     dst[1] = uv[x]; dst[2] = uv[x + 1];
+            dst[3] = luma[x + 1]; dst[4] = uv[x]; dst[5] = uv[x + 1];
+        }
+    }
+}
+
+size_t
+mjpeg_encode ( struct mjpeg_encoder *e, uint32_t pixelformat,
+    const void *data, int stride, int width, int height,
+    unsigned char **out, size_t *cap ) {
+    struct jpeg_compress_struct *cinfo = &e->cinfo;
+    const unsigned char *src = data;
+    unsigned char *buf = *out;
+    unsigned long size = *cap;
+    JSAMPROW rows[MAX_ROWS];
+    int grey = pixelformat == V4L2_PIX_FMT_GREY;
+
+    if ( pixelformat != V4L2_PIX_FMT_YUYV && pixelformat != V4L2_PIX_FMT_NV12 &&
+        grey == 0 ) {
+        return 0;
+    }
+
+    if ( grey == 0 && e->row_width != width ) {
+        free(e->row);
+        e->row = malloc( (size_t) MAX_ROWS * width * 3 );
+        e->row_width = e->row ? width : 0;
+        if ( e->row == NULL ) { return 0; }
+    }
+
+    if ( setjmp(e->env) ) {
+        jpeg_abort_compress(cinfo);
+        return 0;
+    }
+
+    /* libjpeg allocates a new buffer rather than grow ours */
+    jpeg_mem_dest( cinfo, &buf, &size );
+
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = grey ? 1 : 3;
+    cinfo->in_color_space = grey ? JCS_GRAYSCALE : JCS_YCbCr;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality( cinfo, e->quality, TRUE );
+    cinfo->dct_method = JDCT_IFAST;
+
+    jpeg_start_compress( cinfo, TRUE );
+
+    while ( cinfo->next_scanline < cinfo->image_height ) {
+        int n = cinfo->image_height - cinfo->next_scanline;
+        if ( n > MAX_ROWS ) { n = MAX_ROWS; }
+
+        for ( int i=0; i<n; i++ ) {
+            int y = cinfo->next_scanline + i;
+            if ( grey ) {
+                rows[i] = (JSAMPROW) src + (size_t) y * stride;
+            } else {
+                rows[i] = e->row + (size_t) i * width * 3;
+                expand_row( rows[i], pixelformat, src, stride, width, height, y );
+            }
+        }
+
+        jpeg_write_scanlines( cinfo, rows, n );
+    }
+
+    jpeg_finish_compress(cinfo);
+
+    if ( buf != *out ) {
+        free(*out);
+        *out = buf;
+        *cap = size;
+    }
+
+    return size;
+}
+
+/* job states */
+#define JOB_QUEUED   0
+#define JOB_DECODING 1
+#define JOB_DONE     2
+#define JOB_FAILED   3
+
+struct job {
+    int            index;      /* input buffer */
+    const void    *jpeg;
+    size_t         size;
+    uint32_t       sequence;
+    struct timeval timestamp;
+    int64_t        submitted_us;
+    int            target;     /* output target while decoding */
+    int            state;
+};
+
+struct target {
+    void *pixels;
+    int   pitch;
+};
+
+/* a decode thread and the decoder it keeps to itself */
+struct worker {
+    struct mjpeg_pool    *pool;
+    struct mjpeg_decoder *decoder;
+    pthread_t             thread;
+};
+
+/* Every submitted frame gets a ticket. Tickets between published and */
+/* submitted are in flight and live in jobs[ticket % workers], so frames */
+/* are published strictly in ticket order however the workers finish. */
+struct mjpeg_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    struct worker *threads;
+    int        workers;        /* decoders made, one per thread */
+    int        running;        /* threads successfully started */
+    int        stop;
+
+    int width, height;
+    const struct mjpeg_pool_ops *ops;
+    void *ctx;
+
+    struct job   *jobs;
+    unsigned long submitted, started, published;
+
+    struct target *targets;
+    int           *free;       /* stack of targets ready for output */
+    int            nfree;
+
+    struct mjpeg_frame latest; /* newest published frame */
+    int                has_latest;
+    unsigned int       skipped;    /* superseded or failed since the last take */
+};
+
+/* publish every finished job at the head of the ticket order, returns 1 */
+/* if the caller should be told about a new frame */
+static int
+publish ( struct mjpeg_pool *p ) {
+    int notify = 0;
+
+    while ( p->published != p->started ) {
+        struct job *j = &p->jobs[p->published % p->workers];
+
+        if ( j->state == JOB_DONE ) {
+            /* frame nobody took in time is superseded */
+            if ( p->has_latest ) {
+                p->free[p->nfree++] = p->latest.target;
+                p->skipped++;
+            }
+            /* only an empty slot filling needs telling about, but */
+            /* a later job in the same pass must not undo that */
+            if ( p->has_latest == 0 ) { notify = 1; }
+            p->latest.target = j->target;
+            p->latest.sequence = j->sequence;
+            p->latest.timestamp = j->timestamp;
+            p->latest.submitted_us = j->submitted_us;
+            p->has_latest = 1;
+        } else if ( j->state == JOB_FAILED ) {
+            p->free[p->nfree++] = j->target;
+            p->skipped++;
+        } else {
+            break;
+        }
+
+        p->published++;
+    }
+
+    return notify;
+}
+
+static void *
+worker ( void *arg ) {
+    struct worker *w = arg;
+    struct mjpeg_pool *p = w->pool;
+    struct mjpeg_decoder *d = w->decoder;
+
+    pthread_mutex_lock(&p->lock);
+
+    for (;;) {
+        /* wait for a frame to decode and somewhere to decode it to */
+        while ( p->stop == 0 && (p->started == p->submitted || p->nfree == 0) ) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if ( p->stop ) { break; }
+
+        struct job *j = &p->jobs[p->started++ % p->workers];
+        struct target *t;
+        j->target = p->free[--p->nfree];
+        j->state = JOB_DECODING;
+        t = &p->targets[j->target];
+
+        pthread_mutex_unlock(&p->lock);
+
+        int ok = mjpeg_decode(
+            d, j->jpeg, j->size, t->pixels, t->pitch, p->width, p->height
+        );
+        p->ops->release(p->ctx, j->index);
+
+        pthread_mutex_lock(&p->lock);
+        j->state = ok ? JOB_DONE : JOB_FAILED;
+        int notify = publish(p);
+        pthread_mutex_unlock(&p->lock);
+
+        if ( notify ) { p->ops->ready(p->ctx); }
+
+        pthread_mutex_lock(&p->lock);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+struct mjpeg_pool *
+mjpeg_pool_create ( int workers, int width, int height,
+    const struct mjpeg_pool_ops *ops, void *ctx ) {
+    struct mjpeg_pool *p = calloc(1, sizeof(struct mjpeg_pool));
+    if ( p == NULL ) { return NULL; }
+
+    p->width = width;
+    p->height = height;
+    p->ops = ops;
+    p->ctx = ctx;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    p->threads = calloc(workers, sizeof(struct worker));
+    p->targets = calloc(MJPEG_POOL_TARGETS(workers), sizeof(struct target));
+    p->free = calloc(MJPEG_POOL_TARGETS(workers), sizeof(int));
+    if ( !p->threads || !p->targets || !p->free ) {
+        mjpeg_pool_destroy(p);
+        return NULL;
+    }
+
+    /* decoders are made here rather than by the threads, so a pool that */
+    /* can't decode is never handed frames it would sit on */
+    for ( ; p->workers < workers; p->workers++ ) {
+        p->threads[p->workers].pool = p;
+        p->threads[p->workers].decoder = mjpeg_create();
+        if ( p->threads[p->workers].decoder == NULL ) { break; }
+    }
+    if ( p->workers == 0 ) {
+        fprintf( stderr, "Unable to create MJPEG decoder\n" );
+        mjpeg_pool_destroy(p);
+        return NULL;
+    }
+    if ( p->workers < workers ) {
+        fprintf( stderr, "Only made %d of %d MJPEG decoders\n", p->workers, workers );
+    }
+
+    p->jobs = calloc(p->workers, sizeof(struct job));
+    if ( p->jobs == NULL ) {
+        mjpeg_pool_destroy(p);
+        return NULL;
+    }
+
+    for ( ; p->running < p->workers; p->running++ ) {
+        struct worker *w = &p->threads[p->running];
+        if ( pthread_create( &w->thread, NULL, worker, w ) != 0 ) {
+            mjpeg_pool_destroy(p);
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+void
+mjpeg_pool_destroy ( struct mjpeg_pool *p ) {
+    if ( p == NULL ) { return; }
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for ( int i=0; i<p->running; i++ ) {
+        pthread_join(p->threads[i].thread, NULL);
+    }
+    for ( int i=0; i<p->workers; i++ ) {
+        mjpeg_destroy(p->threads[i].decoder);
+    }
+
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p->threads);
+    free(p->jobs);
+    free(p->targets);
+    free(p->free);
+    free(p);
+}
+
+void
+mjpeg_pool_give ( struct mjpeg_pool *p, int target, void *pixels, int pitch ) {
+    pthread_mutex_lock(&p->lock);
+    p->targets[target].pixels = pixels;
+    p->targets[target].pitch = pitch;
+    p->free[p->nfree++] = target;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+int
+mjpeg_pool_submit ( struct mjpeg_pool *p, int index, const void *jpeg,
+    size_t size, uint32_t sequence, struct timeval timestamp ) {
+    pthread_mutex_lock(&p->lock);
+
+    /* at most one frame in flight per worker */
+    if ( p->submitted - p->published >= (unsigned long) p->workers ) {
+        pthread_mutex_unlock(&p->lock);
+        return 0;
+    }
+
+    struct job *j = &p->jobs[p->submitted++ % p->workers];
+    j->index = index;
+    j->jpeg = jpeg;
+    j->size = size;
+    j->sequence = sequence;
+    j->timestamp = timestamp;
+    j->submitted_us = latency_now_us();
+    j->state = JOB_QUEUED;
+
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    return 1;
+}
+
+int
+mjpeg_pool_take ( struct mjpeg_pool *p, struct mjpeg_frame *f ) {
+    int taken;
+
+    pthread_mutex_lock(&p->lock);
+    taken = p->has_latest;
+    if ( taken ) {
+        *f = p->latest;
+        f->skipped = p->skipped;
+        p->has_latest = 0;
+        p->skipped = 0;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return taken;
+}
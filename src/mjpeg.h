@@ -0,0 +1,79 @@
+#ifndef MJPEG_H
+#define MJPEG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+/* Motion-JPEG frame decoder. Each decoder keeps its libjpeg state between */
+/* frames, so use one per thread. */
+struct mjpeg_decoder;
+
+struct mjpeg_decoder *mjpeg_create ( void );
+void mjpeg_destroy ( struct mjpeg_decoder *d );
+
+/* Decode one JPEG frame as packed RGB24 rows into pixels, which is width */
+/* by height with pitch bytes between rows. Returns 0 if the frame is */
+/* corrupt or does not match the requested size. */
+int mjpeg_decode ( struct mjpeg_decoder *d, const void *jpeg, size_t size,
+    void *pixels, int pitch, int width, int height );
+
+/* Pool of decoder threads working on consecutive frames in parallel. */
+/* Output goes straight into caller-supplied targets (e.g. locked texture */
+/* memory) and frames come back out in the order they were submitted. */
+struct mjpeg_pool;
+
+struct mjpeg_pool_ops {
+    /* a worker has finished reading input buffer index */
+    void (*release) ( void *ctx, int index );
+    /* a decoded frame is waiting in mjpeg_pool_take */
+    void (*ready) ( void *ctx );
+};
+
+struct mjpeg_frame {
+    int            target;      /* target the frame was decoded into */
+    uint32_t       sequence;
+    struct timeval timestamp;
+    int64_t        submitted_us; /* latency_now_us() when it was submitted */
+    unsigned int   skipped;     /* frames since the last take never shown */
+};
+
+/* Targets needed to keep every worker busy: one per worker, one waiting */
+/* to be taken and one held by the caller for display. */
+#define MJPEG_POOL_TARGETS(workers) ((workers) + 2)
+
+/* Up to workers threads, each with a decoder of its own. Runs short if */
+/* some decoders can't be made; NULL if none can. */
+struct mjpeg_pool *mjpeg_pool_create ( int workers, int width, int height,
+    const struct mjpeg_pool_ops *ops, void *ctx );
+void mjpeg_pool_destroy ( struct mjpeg_pool *p );
+
+/* Hand an output target (back) to the pool. */
+void mjpeg_pool_give ( struct mjpeg_pool *p, int target, void *pixels,
+    int pitch );
+
+/* Queue a frame for decoding. The jpeg data must stay valid until the */
+/* release op is called for index. Returns 0 without taking the frame if */
+/* every worker already has one. */
+int mjpeg_pool_submit ( struct mjpeg_pool *p, int index, const void *jpeg,
+    size_t size, uint32_t sequence, struct timeval timestamp );
+
+/* Take the newest frame decoded so far. Its target belongs to the caller */
+/* until given back. Returns 0 if nothing new has been decoded. */
+int mjpeg_pool_take ( struct mjpeg_pool *p, struct mjpeg_frame *f );
+
+/* JPEG encoder for frames the camera delivers uncompressed. Like the */
+/* decoder it keeps libjpeg state between frames, one per thread. */
+struct mjpeg_encoder;
+
+struct mjpeg_encoder *mjpeg_encoder_create ( int quality );
+void mjpeg_encoder_destroy ( struct mjpeg_encoder *e );
+
+/* Compress a YUYV, NV12 or GREY frame into *out, a malloc'd buffer of */
+/* *cap bytes (or NULL) that is replaced with a bigger one if needed. */
+/* Returns the JPEG's size, 0 if the format isn't one we can encode. */
+size_t mjpeg_encode ( struct mjpeg_encoder *e, uint32_t pixelformat,
+    const void *data, int stride, int width, int height,
+    unsigned char **out, size_t *cap );
+
+#endif
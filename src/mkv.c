@@ -0,0 +1,654 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>       /* errno */
+#include <fcntl.h>       /* open */
+#include <memory.h>      /* memcpy */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>      /* pwrite */
+#include <sys/eventfd.h>
+#include <sys/uio.h>     /* writev */
+
+#include <linux/videodev2.h>
+
+#include "mkv.h"
+#include "segments.h"
+
+/* EBML and Matroska element IDs */
+#define ID_EBML               0x1A45DFA3
+#define ID_EBMLVERSION        0x4286
+#define ID_EBMLREADVERSION    0x42F7
+#define ID_EBMLMAXIDLENGTH    0x42F2
+#define ID_EBMLMAXSIZELENGTH  0x42F3
+#define ID_DOCTYPE            0x4282
+#define ID_DOCTYPEVERSION     0x4287
+#define ID_DOCTYPEREADVERSION 0x4285
+#define ID_SEGMENT            0x18538067
+#define ID_SEEKHEAD           0x114D9B74
+#define ID_SEEK               0x4DBB
+#define ID_SEEKID             0x53AB
+#define ID_SEEKPOSITION       0x53AC
+#define ID_INFO               0x1549A966
+#define ID_TIMESTAMPSCALE     0x2AD7B1
+#define ID_DURATION           0x4489
+#define ID_MUXINGAPP          0x4D80
+#define ID_WRITINGAPP         0x5741
+#define ID_TRACKS             0x1654AE6B
+#define ID_TRACKENTRY         0xAE
+#define ID_TRACKNUMBER        0xD7
+#define ID_TRACKUID           0x73C5
+#define ID_TRACKTYPE          0x83
+#define ID_FLAGLACING         0x9C
+#define ID_CODECID            0x86
+#define ID_DEFAULTDURATION    0x23E383
+#define ID_VIDEO              0xE0
+#define ID_PIXELWIDTH         0xB0
+#define ID_PIXELHEIGHT        0xBA
+#define ID_CLUSTER            0x1F43B675
+#define ID_TIMESTAMP          0xE7
+#define ID_SIMPLEBLOCK        0xA3
+#define ID_CUES               0x1C53BB6B
+#define ID_CUEPOINT           0xBB
+#define ID_CUETIME            0xB3
+#define ID_CUETRACKPOSITIONS  0xB7
+#define ID_CUETRACK           0xF7
+#define ID_CUECLUSTERPOSITION 0xF1
+
+/* 8 byte size meaning "unknown" - left in place if the file can't be */
+/* patched, which players accept for live streams */
+#define UNKNOWN_SIZE 0x00FFFFFFFFFFFFFFull
+
+#define TIMESTAMP_SCALE 1000000   /* timestamps in ms */
+#define CLUSTER_MS      1000      /* block offsets are 16 bit, so well under 32s */
+
+/* frames waiting to be written - more than this and we drop */
+#define MKV_DEPTH 8
+
+/* growable byte buffer elements are built up in */
+struct buf {
+    uint8_t *data;
+    size_t   len, cap;
+    int      failed;
+};
+
+struct cue {
+    int64_t  ms;
+    uint64_t position;       /* of the cluster, from the segment data */
+};
+
+struct mkv {
+    int      fd;
+    uint64_t pos;            /* where the next write goes */
+    uint64_t segment_data;   /* file offset of the segment's contents */
+
+    /* file offsets of values filled in by mkv_finish - the header is */
+    /* written from offset 0, so these are also offsets into it */
+    uint64_t segment_size_at, duration_at, cues_seek_at;
+
+    uint64_t cluster_size_at;  /* 0 when no cluster is open */
+    int64_t  cluster_ms;
+    int64_t  first_us, last_ms;
+    int      started;
+    double   frame_ms;
+
+    struct cue *cues;
+    size_t      ncues, cues_cap;
+    struct buf  scratch;
+};
+
+static void
+put ( struct buf *b, const void *p, size_t n ) {
+    if ( b->len + n > b->cap ) {
+        size_t cap = b->cap ? b->cap * 2 : 256;
+        while ( cap < b->len + n ) { cap *= 2; }
+
+        uint8_t *data = realloc( b->data, cap );
+        if ( data == NULL ) {
+            b->failed = 1;
+            return;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+
+    memcpy( b->data + b->len, p, n );
+    b->len += n;
+}
+
+static void
+put_be ( struct buf *b, uint64_t v, int n ) {
+    uint8_t x[8];
+    for ( int i=0; i<n; i++ ) { x[i] = v >> (8 * (n - 1 - i)); }
+    put( b, x, n );
+}
+
+static void
+put_id ( struct buf *b, uint32_t id ) {
+    put_be( b, id, id > 0xffffff ? 4 : id > 0xffff ? 3 : id > 0xff ? 2 : 1 );
+}
+
+/* element size as an 8 byte vint, so it can be patched later */
+static void
+put_size8 ( struct buf *b, uint64_t size ) {
+    put_be( b, 0x0100000000000000ull | size, 8 );
+}
+
+static void
+put_uint ( struct buf *b, uint32_t id, uint64_t v ) {
+    int n = 1;
+    while ( n < 8 && (v >> (8 * n)) != 0 ) { n++; }
+
+    put_id( b, id );
+    put_be( b, 0x80 | n, 1 );
+    put_be( b, v, n );
+}
+
+/* 8 byte unsigned for values patched later, returns where it starts */
+static size_t
+put_uint8 ( struct buf *b, uint32_t id, uint64_t v ) {
+    put_id( b, id );
+    put_be( b, 0x88, 1 );
+    size_t at = b->len;
+    put_be( b, v, 8 );
+    return at;
+}
+
+static size_t
+put_float ( struct buf *b, uint32_t id, double v ) {
+    uint64_t bits;
+    memcpy( &bits, &v, sizeof(bits) );
+    return put_uint8( b, id, bits );
+}
+
+static void
+put_string ( struct buf *b, uint32_t id, const char *s ) {
+    size_t n = strlen(s);
+    put_id( b, id );
+    put_be( b, 0x80 | n, 1 );    /* only short strings are written */
+    put( b, s, n );
+}
+
+/* master element with its size filled in by end() */
+static size_t
+begin ( struct buf *b, uint32_t id ) {
+    put_id( b, id );
+    size_t at = b->len;
+    put_size8( b, 0 );
+    return at;
+}
+
+static void
+end ( struct buf *b, size_t at ) {
+    if ( b->failed ) { return; }
+
+    uint64_t size = b->len - at - 8;
+    for ( int i=1; i<8; i++ ) { b->data[at + i] = size >> (8 * (7 - i)); }
+}
+
+static int
+write_all ( int fd, struct iovec *iov, int n ) {
+    while ( n > 0 ) {
+        ssize_t done = writev( fd, iov, n );
+        if ( done < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            return 0;
+        }
+
+        while ( n > 0 && (size_t) done >= iov->iov_len ) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if ( n > 0 ) {
+            iov->iov_base = (char *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+
+    return 1;
+}
+
+/* write out the scratch buffer, and data after it if there is any */
+static int
+flush ( struct mkv *m, const void *data, size_t size ) {
+    struct iovec iov[2] = {
+        { m->scratch.data, m->scratch.len },
+        { (void *) data, size },
+    };
+
+    if ( m->scratch.failed ) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    if ( write_all( m->fd, iov, size ? 2 : 1 ) == 0 ) { return 0; }
+
+    m->pos += m->scratch.len + size;
+    m->scratch.len = 0;
+    return 1;
+}
+
+/* fill in an 8 byte value or size in a part of the file already written */
+static void
+patch ( struct mkv *m, uint64_t at, uint64_t v, int size ) {
+    struct buf b;
+    uint8_t x[8];
+
+    b.data = x;
+    b.len = 0;
+    b.cap = sizeof(x);
+    b.failed = 0;
+    if ( size ) {
+        put_size8( &b, v );
+    } else {
+        put_be( &b, v, 8 );
+    }
+
+    /* not fatal - a pipe can't be patched and stays a live stream */
+    if ( pwrite( m->fd, x, 8, at ) != 8 && errno != ESPIPE ) {
+        perror("mkv");
+    }
+}
+
+static void
+close_cluster ( struct mkv *m ) {
+    if ( m->cluster_size_at == 0 ) { return; }
+    patch( m, m->cluster_size_at, m->pos - m->cluster_size_at - 8, 1 );
+    m->cluster_size_at = 0;
+}
+
+struct mkv *
+mkv_start ( int fd, int width, int height, double fps ) {
+    struct mkv *m = calloc(1, sizeof(struct mkv));
+    struct buf *b;
+    if ( m == NULL ) { return NULL; }
+
+    m->fd = fd;
+    m->frame_ms = fps > 0 ? 1000.0 / fps : 0;
+    b = &m->scratch;
+
+    size_t at = begin( b, ID_EBML );
+    put_uint( b, ID_EBMLVERSION, 1 );
+    put_uint( b, ID_EBMLREADVERSION, 1 );
+    put_uint( b, ID_EBMLMAXIDLENGTH, 4 );
+    put_uint( b, ID_EBMLMAXSIZELENGTH, 8 );
+    put_string( b, ID_DOCTYPE, "matroska" );
+    put_uint( b, ID_DOCTYPEVERSION, 4 );
+    put_uint( b, ID_DOCTYPEREADVERSION, 2 );
+    end( b, at );
+
+    /* segment size is unknown until the end */
+    put_id( b, ID_SEGMENT );
+    m->segment_size_at = b->len;
+    put_size8( b, UNKNOWN_SIZE );
+    m->segment_data = b->len;
+
+    /* Info and Tracks follow the seek head directly, which is always the */
+    /* same size, so their positions are known before it is written */
+    uint64_t info_pos = 0, tracks_pos = 0;
+    size_t info_seek_at, tracks_seek_at, cues_seek_at;
+    at = begin( b, ID_SEEKHEAD );
+    uint32_t ids[3] = { ID_INFO, ID_TRACKS, ID_CUES };
+    size_t *seeks[3] = { &info_seek_at, &tracks_seek_at, &cues_seek_at };
+    for ( int i=0; i<3; i++ ) {
+        size_t seek = begin( b, ID_SEEK );
+        put_id( b, ID_SEEKID );
+        put_be( b, 0x84, 1 );
+        put_be( b, ids[i], 4 );
+        *seeks[i] = put_uint8( b, ID_SEEKPOSITION, 0 );
+        end( b, seek );
+    }
+    end( b, at );
+
+    info_pos = b->len - m->segment_data;
+    at = begin( b, ID_INFO );
+    put_uint( b, ID_TIMESTAMPSCALE, TIMESTAMP_SCALE );
+    m->duration_at = put_float( b, ID_DURATION, 0 );
+    put_string( b, ID_MUXINGAPP, "Camera" );
+    put_string( b, ID_WRITINGAPP, "Camera" );
+    end( b, at );
+
+    tracks_pos = b->len - m->segment_data;
+    at = begin( b, ID_TRACKS );
+    size_t track = begin( b, ID_TRACKENTRY );
+    put_uint( b, ID_TRACKNUMBER, 1 );
+    put_uint( b, ID_TRACKUID, 1 );
+    put_uint( b, ID_TRACKTYPE, 1 );        /* video */
+    put_uint( b, ID_FLAGLACING, 0 );
+    put_string( b, ID_CODECID, "V_MJPEG" );
+    if ( fps > 0 ) { put_uint( b, ID_DEFAULTDURATION, 1e9 / fps + 0.5 ); }
+    size_t video = begin( b, ID_VIDEO );
+    put_uint( b, ID_PIXELWIDTH, width );
+    put_uint( b, ID_PIXELHEIGHT, height );
+    end( b, video );
+    end( b, track );
+    end( b, at );
+
+    if ( b->failed == 0 ) {
+        for ( int i=0; i<8; i++ ) {
+            b->data[info_seek_at + i] = info_pos >> (8 * (7 - i));
+            b->data[tracks_seek_at + i] = tracks_pos >> (8 * (7 - i));
+        }
+    }
+    m->cues_seek_at = cues_seek_at;
+
+    if ( flush(m, NULL, 0) == 0 ) {
+        free(m->scratch.data);
+        free(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+int
+mkv_write_frame ( struct mkv *m, const void *jpeg, size_t size,
+    int64_t timestamp_us ) {
+    struct buf *b = &m->scratch;
+
+    if ( m->started == 0 ) {
+        m->first_us = timestamp_us;
+        m->started = 1;
+    }
+
+    /* never let time run backwards inside the file */
+    int64_t ms = (timestamp_us - m->first_us) / 1000;
+    if ( ms < m->last_ms ) { ms = m->last_ms; }
+    m->last_ms = ms;
+
+    if ( m->cluster_size_at == 0 || ms - m->cluster_ms >= CLUSTER_MS ) {
+        close_cluster(m);
+
+        if ( m->ncues == m->cues_cap ) {
+            size_t cap = m->cues_cap ? m->cues_cap * 2 : 64;
+            struct cue *cues = realloc( m->cues, cap * sizeof(struct cue) );
+            if ( cues == NULL ) {
+                errno = ENOMEM;
+                return 0;
+            }
+            m->cues = cues;
+            m->cues_cap = cap;
+        }
+        m->cues[m->ncues].ms = ms;
+        m->cues[m->ncues].position = m->pos - m->segment_data;
+        m->ncues++;
+
+        put_id( b, ID_CLUSTER );
+        m->cluster_size_at = m->pos + b->len;
+        put_size8( b, UNKNOWN_SIZE );
+        put_uint( b, ID_TIMESTAMP, ms );
+        m->cluster_ms = ms;
+    }
+
+    /* every JPEG is a keyframe */
+    put_id( b, ID_SIMPLEBLOCK );
+    put_size8( b, 4 + size );
+    put_be( b, 0x81, 1 );                    /* track 1 */
+    put_be( b, (uint16_t) (ms - m->cluster_ms), 2 );
+    put_be( b, 0x80, 1 );                    /* keyframe */
+
+    return flush(m, jpeg, size);
+}
+
+int
+mkv_finish ( struct mkv *m ) {
+    struct buf *b = &m->scratch;
+    int ok = 1;
+
+    close_cluster(m);
+
+    uint64_t cues_pos = m->pos - m->segment_data;
+    size_t at = begin( b, ID_CUES );
+    for ( size_t i=0; i<m->ncues; i++ ) {
+        size_t point = begin( b, ID_CUEPOINT );
+        put_uint( b, ID_CUETIME, m->cues[i].ms );
+        size_t positions = begin( b, ID_CUETRACKPOSITIONS );
+        put_uint( b, ID_CUETRACK, 1 );
+        put_uint( b, ID_CUECLUSTERPOSITION, m->cues[i].position );
+        end( b, positions );
+        end( b, point );
+    }
+    end( b, at );
+
+    if ( m->ncues && flush(m, NULL, 0) ) {
+        patch( m, m->cues_seek_at, cues_pos, 0 );
+    } else if ( m->ncues ) {
+        ok = 0;
+    }
+
+    double duration = m->started ? m->last_ms + m->frame_ms : 0;
+    uint64_t bits;
+    memcpy( &bits, &duration, sizeof(bits) );
+    patch( m, m->duration_at, bits, 0 );
+    patch( m, m->segment_size_at, m->pos - m->segment_data, 1 );
+
+    free(m->cues);
+    free(m->scratch.data);
+    free(m);
+
+    return ok;
+}
+
+/* --- sink ------------------------------------------------------------- */
+
+struct mkv_sink {
+    struct sink         sink;
+    struct frame_format format;
+    char               *path;
+    int                 fd;
+    struct mkv         *mkv;
+    struct segments    *segments;   /* NULL for a single file */
+    int64_t             segment_us;
+
+    pthread_t           thread;
+    int                 running;
+    atomic_int          quit;
+    int                 wake_fd;
+
+    /* capture thread adds at head, writer retires at tail */
+    struct frame        ring[MKV_DEPTH];
+    atomic_uint         head;
+    atomic_uint         tail;
+    atomic_ulong        dropped;
+
+    /* writer thread only */
+    unsigned long       frames;
+    int                 failed;
+    unsigned int        files;
+    unsigned int        segment_frames;
+    int64_t             segment_start;
+};
+
+static void
+push ( struct sink *sink, const struct frame *f ) {
+    struct mkv_sink *ms = (struct mkv_sink *) sink;
+    unsigned int head = atomic_load_explicit( &ms->head, memory_order_relaxed );
+    unsigned int tail = atomic_load_explicit( &ms->tail, memory_order_acquire );
+    uint64_t one = 1;
+
+    if ( head - tail >= MKV_DEPTH ) {
+        atomic_fetch_add( &ms->dropped, 1 );
+        return;
+    }
+
+    frame_ref(f);
+    ms->ring[head % MKV_DEPTH] = *f;
+    atomic_store_explicit( &ms->head, head + 1, memory_order_release );
+
+    if ( write( ms->wake_fd, &one, sizeof(one) ) < 0 ) { perror("eventfd"); }
+}
+
+/* Finish the current file and start the next, which the rotation thread */
+/* has ready opened. The old one is synced and closed over there too. */
+static int
+next_segment ( struct mkv_sink *ms ) {
+    struct segment seg;
+
+    if ( segments_next( ms->segments, &seg ) == 0 ) { return 0; }
+
+    if ( mkv_finish(ms->mkv) == 0 ) { perror(ms->path); }
+    segments_retire( ms->segments, ms->fd );
+
+    ms->fd = seg.fd;
+    ms->mkv = mkv_start( ms->fd, ms->format.width, ms->format.height, ms->format.fps );
+    ms->segment_frames = 0;
+    ms->files++;
+
+    return ms->mkv != NULL;
+}
+
+static void *
+writer ( void *arg ) {
+    struct mkv_sink *ms = arg;
+    uint64_t count;
+
+    for (;;) {
+        unsigned int tail = atomic_load_explicit( &ms->tail, memory_order_relaxed );
+        unsigned int head = atomic_load_explicit( &ms->head, memory_order_acquire );
+
+        if ( tail == head ) {
+            /* capture has stopped by the time quit is set, so head is final */
+            if ( atomic_load(&ms->quit) ) { break; }
+            if ( read( ms->wake_fd, &count, sizeof(count) ) < 0 && errno != EINTR ) {
+                perror("eventfd");
+                break;
+            }
+            continue;
+        }
+
+        const struct frame *f = &ms->ring[tail % MKV_DEPTH];
+        int64_t ts = frame_time_us(f);
+
+        if ( ms->segments && ms->failed == 0 ) {
+            if ( ms->segment_frames == 0 ) {
+                ms->segment_start = ts;
+            } else if ( ts - ms->segment_start >= ms->segment_us ) {
+                if ( next_segment(ms) == 0 ) {
+                    fprintf( stderr, "%s: %s, recording stopped\n", ms->path, strerror(errno) );
+                    ms->failed = 1;
+                }
+                ms->segment_start = ts;
+            }
+        }
+
+        if ( ms->failed == 0 ) {
+            if ( mkv_write_frame( ms->mkv, f->data, f->bytesused, ts ) ) {
+                ms->frames++;
+                ms->segment_frames++;
+            } else {
+                fprintf( stderr, "%s: %s, recording stopped\n", ms->path, strerror(errno) );
+                ms->failed = 1;
+            }
+        }
+
+        frame_unref(f);
+        atomic_store_explicit( &ms->tail, tail + 1, memory_order_release );
+    }
+
+    return NULL;
+}
+
+static void
+destroy ( struct sink *sink ) {
+    struct mkv_sink *ms = (struct mkv_sink *) sink;
+    uint64_t one = 1;
+
+    if ( ms->running ) {
+        atomic_store(&ms->quit, 1);
+        if ( write( ms->wake_fd, &one, sizeof(one) ) < 0 ) { perror("eventfd"); }
+        pthread_join(ms->thread, NULL);
+
+        if ( ms->segments ) {
+            fprintf( stderr, "Recorded %lu MJPEG frames to %u segments of %s, dropped %lu\n",
+                ms->frames, ms->files, ms->path, atomic_load(&ms->dropped)
+            );
+        } else {
+            fprintf( stderr, "Recorded %lu MJPEG frames to %s, dropped %lu\n",
+                ms->frames, ms->path, atomic_load(&ms->dropped)
+            );
+        }
+    }
+
+    if ( ms->mkv && mkv_finish(ms->mkv) == 0 ) { perror(ms->path); }
+    if ( ms->segments ) {
+        if ( ms->fd >= 0 ) { segments_retire( ms->segments, ms->fd ); }
+        segments_destroy(ms->segments);
+    } else if ( ms->fd >= 0 ) {
+        close(ms->fd);
+    }
+    if ( ms->wake_fd >= 0 ) { close(ms->wake_fd); }
+
+    free(ms->path);
+    free(ms);
+}
+
+struct sink *
+mkv_sink_create ( const char *path, const struct frame_format *fmt, int segment ) {
+    struct mkv_sink *ms;
+
+    if ( fmt->pixelformat != V4L2_PIX_FMT_MJPEG ) {
+        fprintf( stderr, "MJPEG recording needs the camera in MJPEG mode (-p MJPG)\n" );
+        return NULL;
+    }
+
+    ms = calloc(1, sizeof(struct mkv_sink));
+    if ( ms == NULL ) { return NULL; }
+
+    ms->sink.name = "MJPEG recorder";
+    ms->sink.push = push;
+    ms->sink.destroy = destroy;
+    ms->format = *fmt;
+    ms->path = strdup(path);
+    ms->fd = -1;
+    atomic_init(&ms->quit, 0);
+    atomic_init(&ms->head, 0);
+    atomic_init(&ms->tail, 0);
+    atomic_init(&ms->dropped, 0);
+
+    /* blocking - the writer sleeps in read */
+    ms->wake_fd = eventfd( 0, EFD_CLOEXEC );
+    if ( ms->wake_fd < 0 ) {
+        perror("eventfd");
+        destroy(&ms->sink);
+        return NULL;
+    }
+
+    if ( segment > 0 ) {
+        struct segment seg;
+        double fps = fmt->fps > 0 ? fmt->fps : 30;
+
+        ms->segment_us = (int64_t) segment * 1000000;
+        ms->segments = segments_create( path, NULL,
+            segment * fps * frame_typical_size(fmt) );
+        if ( ms->segments == NULL || segments_next( ms->segments, &seg ) == 0 ) {
+            destroy(&ms->sink);
+            return NULL;
+        }
+        ms->fd = seg.fd;
+        ms->files = 1;
+    } else {
+        ms->fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+        if ( ms->fd < 0 ) {
+            perror(path);
+            destroy(&ms->sink);
+            return NULL;
+        }
+    }
+
+    ms->mkv = mkv_start( ms->fd, fmt->width, fmt->height, fmt->fps );
+    if ( ms->mkv == NULL ) {
+        perror(path);
+        destroy(&ms->sink);
+        return NULL;
+    }
+
+    if ( pthread_create( &ms->thread, NULL, writer, ms ) != 0 ) {
+        fprintf( stderr, "Unable to start MJPEG recorder thread\n" );
+        destroy(&ms->sink);
+        return NULL;
+    }
+    ms->running = 1;
+
+    return &ms->sink;
+}
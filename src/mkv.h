@@ -0,0 +1,30 @@
+#ifndef MKV_H
+#define MKV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+/* Matroska muxer for MJPEG passthrough. Each JPEG from the camera goes */
+/* into the file untouched as a keyframe, timestamped from the capture */
+/* timestamps. Clusters are about a second long and indexed by cues, and */
+/* the header is patched with the duration when the file is finished. */
+struct mkv;
+
+/* start a file on fd, which must be seekable for mkv_finish to patch it */
+struct mkv *mkv_start ( int fd, int width, int height, double fps );
+
+/* 0 on a write error, with errno set */
+int mkv_write_frame ( struct mkv *m, const void *jpeg, size_t size,
+    int64_t timestamp_us );
+
+/* write the index and fix up the header; fd is left open for the caller */
+int mkv_finish ( struct mkv *m );
+
+/* Records the camera's MJPEG frames to path on a thread of its own, */
+/* split into files segment seconds long if that is above 0. */
+struct sink *mkv_sink_create ( const char *path, const struct frame_format *fmt,
+    int segment );
+
+#endif
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <memory.h>      /* memcpy */
+
+#include <linux/videodev2.h>
+
+#include "mjpeg.h"
+#include "pattern.h"
+
+#define JPEG_QUALITY  90
+#define SCROLL        4      /* pixels a frame */
+#define COUNTER_BITS  32
+
+/* white, yellow, cyan, green, magenta, red, blue, black in BT.601 */
+/* limited range, as Y, Cb, Cr */
+static const uint8_t bars[8][3] = {
+    { 235, 128, 128 }, { 210,  16, 146 }, { 170, 166,  16 }, { 145,  54,  34 },
+    { 106, 202, 222 }, {  81,  90, 240 }, {  41, 240, 110 }, {  16, 128, 128 },
+};
+
+struct pattern {
+    struct source_reader  reader;
+    uint64_t              frame;
+
+    /* MJPEG is a YUYV frame compressed */
+    struct mjpeg_encoder *encoder;
+    unsigned char        *yuyv;
+    unsigned char        *jpeg;
+    size_t                jpeg_cap;
+};
+
+/* the colour of pixel x, y in the current frame */
+static const uint8_t *
+pixel ( const struct pattern *p, int x, int y ) {
+    const struct frame_format *fmt = &p->reader.format;
+    int strip = fmt->height - fmt->height / 8;
+
+    if ( y >= strip ) {
+        int bit = x * COUNTER_BITS / fmt->width;
+        return (p->frame >> (COUNTER_BITS - 1 - bit)) & 1 ? bars[0] : bars[7];
+    }
+
+    int scrolled = (x + p->frame * SCROLL) % fmt->width;
+    return bars[scrolled * 8 / fmt->width];
+}
+
+/* chroma is taken from the top left pixel each sample covers */
+static void
+draw_yuyv ( const struct pattern *p, uint8_t *dst, int stride ) {
+    const struct frame_format *fmt = &p->reader.format;
+
+    for ( int y=0; y<fmt->height; y++ ) {
+        uint8_t *line = dst + (size_t) y * stride;
+        for ( int x=0; x<fmt->width; x+=2, line+=4 ) {
+            const uint8_t *a = pixel(p, x, y), *b = pixel(p, x + 1, y);
+            line[0] = a[0]; line[1] = a[1];
+            line[2] = b[0]; line[3] = a[2];
+        }
+    }
+}
+
+static void
+draw_planar ( const struct pattern *p, uint8_t *dst ) {
+    const struct frame_format *fmt = &p->reader.format;
+    uint8_t *uv = dst + (size_t) fmt->stride * fmt->height;
+
+    for ( int y=0; y<fmt->height; y++ ) {
+        uint8_t *line = dst + (size_t) y * fmt->stride;
+        uint8_t *chroma = uv + (size_t) (y / 2) * fmt->stride;
+        for ( int x=0; x<fmt->width; x++ ) {
+            const uint8_t *c = pixel(p, x, y);
+            line[x] = c[0];
+            if ( fmt->pixelformat == V4L2_PIX_FMT_NV12 && (x & 1) == 0 && (y & 1) == 0 ) {
+                chroma[x] = c[1];
+                chroma[x + 1] = c[2];
+            }
+        }
+    }
+}
+
+static int
+pattern_read ( struct source_reader *r, void *dst, size_t cap, size_t *size,
+    int64_t *timestamp_us ) {
+    struct pattern *p = (struct pattern *) r;
+    const struct frame_format *fmt = &r->format;
+
+    if ( fmt->pixelformat == V4L2_PIX_FMT_MJPEG ) {
+        draw_yuyv( p, p->yuyv, fmt->width * 2 );
+        *size = mjpeg_encode( p->encoder, V4L2_PIX_FMT_YUYV, p->yuyv, fmt->width * 2,
+            fmt->width, fmt->height, &p->jpeg, &p->jpeg_cap );
+        if ( *size == 0 || *size > cap ) {
+            fprintf( stderr, "Unable to make a test pattern JPEG\n" );
+            return -1;
+        }
+        memcpy( dst, p->jpeg, *size );
+    } else if ( fmt->pixelformat == V4L2_PIX_FMT_YUYV ) {
+        draw_yuyv( p, dst, fmt->stride );
+        *size = fmt->sizeimage;
+    } else {
+        draw_planar( p, dst );
+        *size = fmt->sizeimage;
+    }
+
+    *timestamp_us = (int64_t) (p->frame * 1000000 / fmt->fps);
+    p->frame++;
+
+    return 1;
+}
+
+static void
+pattern_close ( struct source_reader *r ) {
+    struct pattern *p = (struct pattern *) r;
+
+    mjpeg_encoder_destroy(p->encoder);
+    free(p->yuyv);
+    free(p->jpeg);
+    free(p);
+}
+
+struct source_reader *
+pattern_open ( const struct source_request *req ) {
+    struct frame_format fmt;
+
+    fmt.pixelformat = req->pixelformat ? req->pixelformat : V4L2_PIX_FMT_YUYV;
+    fmt.width = req->width > 0 ? req->width : 640;
+    fmt.height = req->height > 0 ? req->height : 480;
+    fmt.fps = req->fps > 0 ? req->fps : 30;
+
+    if ( fmt.width % 2 || fmt.height % 2 ) {
+        fprintf( stderr, "Test pattern needs an even frame size\n" );
+        return NULL;
+    }
+
+    switch ( fmt.pixelformat ) {
+        case V4L2_PIX_FMT_YUYV:
+            fmt.stride = fmt.width * 2;
+            fmt.sizeimage = (size_t) fmt.stride * fmt.height;
+            break;
+        case V4L2_PIX_FMT_NV12:
+            fmt.stride = fmt.width;
+            fmt.sizeimage = (size_t) fmt.stride * fmt.height * 3 / 2;
+            break;
+        case V4L2_PIX_FMT_GREY:
+            fmt.stride = fmt.width;
+            fmt.sizeimage = (size_t) fmt.stride * fmt.height;
+            break;
+        case V4L2_PIX_FMT_MJPEG:
+            /* as a camera would, room for any JPEG the frame could make */
+            fmt.stride = fmt.width;
+            fmt.sizeimage = (size_t) fmt.width * fmt.height * 2;
+            break;
+        default:
+            fprintf( stderr, "Test pattern can be YUYV, NV12, GREY or MJPG\n" );
+            return NULL;
+    }
+
+    struct pattern *p = calloc(1, sizeof(struct pattern));
+    if ( p == NULL ) { return NULL; }
+
+    p->reader.format = fmt;
+    p->reader.read = pattern_read;
+    p->reader.close = pattern_close;
+
+    if ( fmt.pixelformat == V4L2_PIX_FMT_MJPEG ) {
+        p->encoder = mjpeg_encoder_create(JPEG_QUALITY);
+        p->yuyv = malloc( (size_t) fmt.width * 2 * fmt.height );
+        if ( p->encoder == NULL || p->yuyv == NULL ) {
+            fprintf( stderr, "Out of memory\n" );
+            pattern_close(&p->reader);
+            return NULL;
+        }
+    }
+
+    return &p->reader;
+}
@@ -0,0 +1,13 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include "source.h"
+
+/* Colour bars that scroll a few pixels a frame, over a strip along the */
+/* bottom with the frame number in binary, most significant bit on the */
+/* left. Generated as YUYV, NV12 or GREY, or as MJPEG by compressing the */
+/* YUYV version. Timestamps tick at req->fps and the stream never ends. */
+/* Sizes and rates left at 0 are 640x480 at 30fps. */
+struct source_reader *pattern_open ( const struct source_request *req );
+
+#endif
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>       /* errno */
+#include <fcntl.h>       /* open */
+#include <limits.h>      /* PATH_MAX */
+#include <memory.h>      /* memcpy */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>        /* strftime */
+#include <unistd.h>      /* write */
+#include <sys/eventfd.h>
+#include <sys/mman.h>    /* mmap */
+
+#include <linux/videodev2.h>
+
+#include "mkv.h"
+#include "prebuffer.h"
+#include "recorder.h"
+
+/* a frame held in a ring */
+struct record {
+    size_t   offset;         /* into the ring's data */
+    uint32_t bytesused;
+    uint32_t sequence;
+    int64_t  timestamp_us;
+};
+
+/* Frames are stored back to back in data; one that won't fit before the */
+/* end goes at the start and the gap is wasted. Records are oldest first */
+/* from first, so the space a new frame needs is always freed by dropping */
+/* the oldest. */
+struct ring {
+    uint8_t       *data;
+    size_t         size;
+    size_t         pos;      /* where the next frame goes */
+    struct record *records;
+    unsigned int   first;
+    unsigned int   count;
+};
+
+struct prebuffer {
+    struct sink         sink;
+    struct frame_format format;
+    char               *prefix;
+    int                 seconds;
+    unsigned int        max_records;
+    struct ring         rings[2];
+
+    pthread_t           thread;
+    int                 running;
+    atomic_int          quit;
+    int                 wake_fd;
+
+    /* ring the writer thread owns, -1 while it is idle */
+    atomic_int          dumping;
+
+    /* capture thread only */
+    int                 filling;     /* ring frames are copied into */
+    unsigned long       oversized;   /* frames bigger than the whole ring */
+
+    /* writer thread only */
+    unsigned long       events;
+};
+
+static void
+drop_oldest ( struct prebuffer *pb, struct ring *r ) {
+    r->first = (r->first + 1) % pb->max_records;
+    r->count--;
+}
+
+static int
+overlaps ( const struct record *rec, size_t pos, size_t n ) {
+    return rec->offset < pos + n && rec->offset + rec->bytesused > pos;
+}
+
+static void
+push ( struct sink *sink, const struct frame *f ) {
+    struct prebuffer *pb = (struct prebuffer *) sink;
+    struct ring *r = &pb->rings[pb->filling];
+    size_t n = f->bytesused;
+
+    if ( n == 0 ) { return; }
+    if ( n > r->size ) {
+        pb->oversized++;
+        return;
+    }
+
+    if ( r->pos + n > r->size ) {
+        /* frames between here and the end are the oldest we have */
+        while ( r->count && r->records[r->first].offset >= r->pos ) { drop_oldest(pb, r); }
+        r->pos = 0;
+    }
+    while ( r->count && overlaps( &r->records[r->first], r->pos, n ) ) { drop_oldest(pb, r); }
+    if ( r->count == pb->max_records ) { drop_oldest(pb, r); }
+
+    memcpy( r->data + r->pos, f->data, n );
+
+    struct record *rec = &r->records[(r->first + r->count) % pb->max_records];
+    rec->offset = r->pos;
+    rec->bytesused = n;
+    rec->sequence = f->sequence;
+    rec->timestamp_us = frame_time_us(f);
+    r->count++;
+    r->pos += n;
+}
+
+static void
+trigger ( struct sink *sink ) {
+    struct prebuffer *pb = (struct prebuffer *) sink;
+    uint64_t one = 1;
+
+    if ( atomic_load(&pb->dumping) >= 0 ) {
+        fprintf( stderr, "Still writing the last event, trigger ignored\n" );
+        return;
+    }
+
+    if ( pb->rings[pb->filling].count == 0 ) { return; }
+
+    /* writer takes the full ring, capture starts over in the other */
+    atomic_store( &pb->dumping, pb->filling );
+    pb->filling ^= 1;
+
+    if ( write( pb->wake_fd, &one, sizeof(one) ) < 0 ) { perror("eventfd"); }
+}
+
+/* create prefix-YYYYMMDD-HHMMSS.ext, with a counter if that's taken */
+static int
+open_event ( struct prebuffer *pb, const char *ext, char *name, size_t size ) {
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    localtime_r(&now, &tm);
+    strftime( stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm );
+
+    for ( int i=1; i<100; i++ ) {
+        if ( i == 1 ) {
+            snprintf( name, size, "%s-%s.%s", pb->prefix, stamp, ext );
+        } else {
+            snprintf( name, size, "%s-%s-%d.%s", pb->prefix, stamp, i, ext );
+        }
+
+        int fd = open( name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644 );
+        if ( fd >= 0 || errno != EEXIST ) {
+            if ( fd < 0 ) { perror(name); }
+            return fd;
+        }
+    }
+
+    fprintf( stderr, "%s-%s: too many events this second\n", pb->prefix, stamp );
+    return -1;
+}
+
+static int
+write_all ( int fd, const uint8_t *data, size_t n ) {
+    while ( n > 0 ) {
+        ssize_t done = write( fd, data, n );
+        if ( done < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            return 0;
+        }
+        data += done;
+        n -= done;
+    }
+
+    return 1;
+}
+
+static int
+dump_mkv ( struct prebuffer *pb, struct ring *r, unsigned int from, int fd ) {
+    struct mkv *m = mkv_start( fd, pb->format.width, pb->format.height, pb->format.fps );
+    if ( m == NULL ) { return 0; }
+
+    int ok = 1;
+    for ( unsigned int i = from; i < r->count && ok; i++ ) {
+        const struct record *rec = &r->records[(r->first + i) % pb->max_records];
+        ok = mkv_write_frame( m, r->data + rec->offset, rec->bytesused, rec->timestamp_us );
+    }
+
+    return mkv_finish(m) && ok;
+}
+
+static int
+dump_raw ( struct prebuffer *pb, struct ring *r, unsigned int from, int fd,
+    const char *name ) {
+    struct recorder_index_header hdr;
+    struct recorder_index_entry ie;
+    char idx[PATH_MAX + sizeof(".idx")];
+    uint64_t offset = 0;
+    int ok = 1;
+
+    snprintf( idx, sizeof(idx), "%s.idx", name );
+    FILE *index = fopen( idx, "wb" );
+    if ( index == NULL ) {
+        perror(idx);
+        return 0;
+    }
+
+    memset( &hdr, 0, sizeof(struct recorder_index_header) );
+    hdr.magic = RECORDER_INDEX_MAGIC;
+    hdr.version = RECORDER_INDEX_VERSION;
+    hdr.pixelformat = pb->format.pixelformat;
+    hdr.width = pb->format.width;
+    hdr.height = pb->format.height;
+    hdr.stride = pb->format.stride;
+    hdr.sizeimage = pb->format.sizeimage;
+    hdr.fps_milli = pb->format.fps * 1000 + 0.5;
+    fwrite( &hdr, sizeof(struct recorder_index_header), 1, index );
+
+    for ( unsigned int i = from; i < r->count && ok; i++ ) {
+        const struct record *rec = &r->records[(r->first + i) % pb->max_records];
+
+        ok = write_all( fd, r->data + rec->offset, rec->bytesused );
+
+        ie.offset = offset;
+        ie.bytesused = rec->bytesused;
+        ie.sequence = rec->sequence;
+        ie.timestamp_us = rec->timestamp_us;
+        fwrite( &ie, sizeof(struct recorder_index_entry), 1, index );
+        offset += rec->bytesused;
+    }
+
+    if ( fflush(index) != 0 || fsync(fileno(index)) < 0 ) {
+        if ( ok ) { perror(idx); }
+    }
+    fclose(index);
+
+    return ok;
+}
+
+/* write out the last pb->seconds of the ring */
+static void
+dump ( struct prebuffer *pb, struct ring *r ) {
+    char name[PATH_MAX];
+    int mjpeg = pb->format.pixelformat == V4L2_PIX_FMT_MJPEG;
+
+    /* the ring is sized from an estimate, so it may hold more than asked */
+    int64_t newest = r->records[(r->first + r->count - 1) % pb->max_records].timestamp_us;
+    unsigned int from = 0;
+    while ( from < r->count - 1 &&
+        newest - r->records[(r->first + from) % pb->max_records].timestamp_us >
+        (int64_t) pb->seconds * 1000000 ) {
+        from++;
+    }
+
+    int fd = open_event( pb, mjpeg ? "mkv" : "raw", name, sizeof(name) );
+    if ( fd < 0 ) { return; }
+
+    int ok = mjpeg ? dump_mkv(pb, r, from, fd) : dump_raw(pb, r, from, fd, name);
+    if ( ok && fsync(fd) < 0 ) { ok = 0; }
+
+    if ( ok ) {
+        fprintf( stderr, "Wrote %u frames before the event to %s\n", r->count - from, name );
+        pb->events++;
+    } else {
+        fprintf( stderr, "%s: %s\n", name, strerror(errno) );
+    }
+    close(fd);
+}
+
+static void *
+writer ( void *arg ) {
+    struct prebuffer *pb = arg;
+    uint64_t count;
+
+    for (;;) {
+        int i = atomic_load(&pb->dumping);
+
+        if ( i >= 0 ) {
+            struct ring *r = &pb->rings[i];
+            dump(pb, r);
+
+            r->pos = 0;
+            r->first = 0;
+            r->count = 0;
+            atomic_store(&pb->dumping, -1);
+            continue;
+        }
+
+        /* capture has stopped by the time quit is set, so nothing more comes */
+        if ( atomic_load(&pb->quit) ) { break; }
+        if ( read( pb->wake_fd, &count, sizeof(count) ) < 0 && errno != EINTR ) {
+            perror("eventfd");
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+destroy ( struct sink *sink ) {
+    struct prebuffer *pb = (struct prebuffer *) sink;
+    uint64_t one = 1;
+
+    if ( pb->running ) {
+        atomic_store(&pb->quit, 1);
+        if ( write( pb->wake_fd, &one, sizeof(one) ) < 0 ) { perror("eventfd"); }
+        pthread_join(pb->thread, NULL);
+
+        fprintf( stderr, "Wrote %lu events to %s-*, %lu frames too big to hold\n",
+            pb->events, pb->prefix, pb->oversized
+        );
+    }
+
+    for ( int i=0; i<2; i++ ) {
+        if ( pb->rings[i].data ) { munmap( pb->rings[i].data, pb->rings[i].size ); }
+        free(pb->rings[i].records);
+    }
+    if ( pb->wake_fd >= 0 ) { close(pb->wake_fd); }
+
+    free(pb->prefix);
+    free(pb);
+}
+
+struct sink *
+prebuffer_create ( const char *prefix, const struct frame_format *fmt,
+    int seconds, int kbps ) {
+    struct prebuffer *pb;
+    double fps = fmt->fps > 0 ? fmt->fps : 30;
+    size_t size;
+
+    if ( seconds <= 0 ) {
+        fprintf( stderr, "Prebuffer needs at least a second\n" );
+        return NULL;
+    }
+
+    /* a rate given on the command line wins, otherwise guess from the format */
+    if ( kbps > 0 ) {
+        size = (size_t) seconds * kbps * 125;
+    } else {
+        size = seconds * fps * frame_typical_size(fmt);
+    }
+    /* room for the biggest frame to land wherever the last one ended */
+    size += fmt->sizeimage;
+
+    pb = calloc(1, sizeof(struct prebuffer));
+    if ( pb == NULL ) { return NULL; }
+
+    pb->sink.name = "event prebuffer";
+    pb->sink.push = push;
+    pb->sink.trigger = trigger;
+    pb->sink.destroy = destroy;
+    pb->format = *fmt;
+    pb->prefix = strdup(prefix);
+    pb->seconds = seconds;
+    pb->wake_fd = -1;
+    /* twice the nominal rate in case the camera runs fast */
+    pb->max_records = seconds * fps * 2 + 1;
+    atomic_init(&pb->quit, 0);
+    atomic_init(&pb->dumping, -1);
+
+    /* Populated now so that the first pass through the ring doesn't take */
+    /* its page faults on the capture thread. */
+    for ( int i=0; i<2; i++ ) {
+        struct ring *r = &pb->rings[i];
+
+        r->data = mmap( NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0 );
+        r->records = calloc( pb->max_records, sizeof(struct record) );
+        if ( r->data == MAP_FAILED ) { r->data = NULL; }
+        r->size = size;
+
+        if ( r->data == NULL || r->records == NULL ) {
+            fprintf( stderr, "Not enough memory to hold %d seconds of frames (2 x %zu MB)\n",
+                seconds, size >> 20 );
+            destroy(&pb->sink);
+            return NULL;
+        }
+    }
+
+    /* blocking - the writer sleeps in read */
+    pb->wake_fd = eventfd( 0, EFD_CLOEXEC );
+    if ( pb->wake_fd < 0 ) {
+        perror("eventfd");
+        destroy(&pb->sink);
+        return NULL;
+    }
+
+    if ( pthread_create( &pb->thread, NULL, writer, pb ) != 0 ) {
+        fprintf( stderr, "Unable to start prebuffer writer thread\n" );
+        destroy(&pb->sink);
+        return NULL;
+    }
+    pb->running = 1;
+
+    return &pb->sink;
+}
@@ -0,0 +1,20 @@
+#ifndef PREBUFFER_H
+#define PREBUFFER_H
+
+#include "frame.h"
+
+/* Incident capture. The last few seconds of frames are kept in memory, */
+/* and when the sink's trigger is pulled they are written to a new file */
+/* named prefix-YYYYMMDD-HHMMSS: Matroska for MJPEG, otherwise raw frames */
+/* with a .idx index in the recorder's format. */
+/*                                                                      */
+/* Frames are copied into a byte ring allocated up front, seconds long */
+/* at kbps (or, for uncompressed formats, at the size of a frame), so */
+/* push does one memcpy and never allocates. There are two rings: a */
+/* trigger hands the full one to a writer thread and capture carries on */
+/* in the other. A trigger while the last dump is still being written */
+/* is ignored. */
+struct sink *prebuffer_create ( const char *prefix, const struct frame_format *fmt,
+    int seconds, int kbps );
+
+#endif
@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>       /* errno */
+#include <fcntl.h>       /* open */
+#include <memory.h>      /* memset */
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>      /* pwrite */
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "recorder.h"
+#include "segments.h"
+#include "uring.h"
+
+/* frames waiting for or being written - more than this and we drop */
+#define RECORD_DEPTH 8
+
+/* io_uring completion for the wake_fd read rather than a frame */
+#define WAKE_TAG     ((uint64_t) -1)
+
+struct entry {
+    struct frame f;
+    int          fd;         /* file it goes in */
+    size_t       written;
+    uint64_t     offset;
+    int          done;
+};
+
+/* a segment that has been moved on from but may still have writes in flight */
+struct closing {
+    int          fd;
+    unsigned int after;      /* first entry that isn't in it */
+};
+
+struct recorder {
+    struct sink         sink;
+    struct frame_format format;
+    char               *path;
+    int                 fd;
+    FILE               *index;
+    struct segments    *segments;   /* NULL for a single file */
+    int64_t             segment_us;
+
+    pthread_t           thread;
+    int                 running;
+    atomic_int          quit;
+    int                 wake_fd;
+
+    /* capture thread adds at head, writer retires at tail */
+    struct entry        ring[RECORD_DEPTH];
+    atomic_uint         head;
+    atomic_uint         tail;
+    atomic_ulong        dropped;
+
+    /* writer thread only */
+    unsigned int        submitted;  /* next entry to start writing */
+    uint64_t            offset;     /* where the next frame goes */
+    unsigned long       frames;
+    int                 failed;     /* stop writing after an error */
+    int                 use_uring;
+    struct uring        uring;
+    uint64_t            wake_count;
+    unsigned int        files;
+    unsigned int        segment_frames;
+    int64_t             segment_start;
+    /* each holds at least one entry that hasn't retired, so no more */
+    /* of them than the ring has entries */
+    struct closing      closing[RECORD_DEPTH];
+    unsigned int        nclosing;
+};
+
+static void
+push ( struct sink *sink, const struct frame *f ) {
+    struct recorder *rec = (struct recorder *) sink;
+    unsigned int head = atomic_load_explicit( &rec->head, memory_order_relaxed );
+    unsigned int tail = atomic_load_explicit( &rec->tail, memory_order_acquire );
+    uint64_t one = 1;
+
+    /* disk is behind - lose this frame rather than hold on to buffers */
+    if ( head - tail >= RECORD_DEPTH ) {
+        atomic_fetch_add( &rec->dropped, 1 );
+        return;
+    }
+
+    frame_ref(f);
+    rec->ring[head % RECORD_DEPTH].f = *f;
+    atomic_store_explicit( &rec->head, head + 1, memory_order_release );
+
+    if ( write( rec->wake_fd, &one, sizeof(one) ) < 0 ) { perror("eventfd"); }
+}
+
+/* give entries back to the camera in order as their writes finish */
+static void
+retire ( struct recorder *rec ) {
+    unsigned int tail = atomic_load_explicit( &rec->tail, memory_order_relaxed );
+
+    while ( tail != rec->submitted && rec->ring[tail % RECORD_DEPTH].done ) {
+        struct entry *e = &rec->ring[tail % RECORD_DEPTH];
+        frame_unref(&e->f);
+        e->done = 0;
+        tail++;
+        atomic_store_explicit( &rec->tail, tail, memory_order_release );
+    }
+
+    /* old segments are done with once their last write is */
+    while ( rec->nclosing && (int) (tail - rec->closing[0].after) >= 0 ) {
+        segments_retire( rec->segments, rec->closing[0].fd );
+        rec->nclosing--;
+        memmove( rec->closing, rec->closing + 1, rec->nclosing * sizeof(struct closing) );
+    }
+}
+
+static void
+write_failed ( struct recorder *rec, int err ) {
+    if ( rec->failed == 0 ) {
+        fprintf( stderr, "%s: %s, recording stopped\n", rec->path, strerror(err) );
+    }
+    rec->failed = 1;
+}
+
+static void
+write_index_header ( struct recorder *rec ) {
+    struct recorder_index_header hdr;
+    const struct frame_format *fmt = &rec->format;
+
+    memset( &hdr, 0, sizeof(struct recorder_index_header) );
+    hdr.magic = RECORDER_INDEX_MAGIC;
+    hdr.version = RECORDER_INDEX_VERSION;
+    hdr.pixelformat = fmt->pixelformat;
+    hdr.width = fmt->width;
+    hdr.height = fmt->height;
+    hdr.stride = fmt->stride;
+    hdr.sizeimage = fmt->sizeimage;
+    hdr.fps_milli = fmt->fps * 1000 + 0.5;
+    fwrite( &hdr, sizeof(struct recorder_index_header), 1, rec->index );
+}
+
+/* Flush a segment's index and let the rotation thread sync and close */
+/* it. The FILE goes here, a duplicate of its descriptor goes there. */
+static void
+close_index ( struct recorder *rec ) {
+    if ( rec->index == NULL ) { return; }
+
+    fflush(rec->index);
+    int fd = dup( fileno(rec->index) );
+    fclose(rec->index);
+    rec->index = NULL;
+
+    if ( fd >= 0 ) { segments_retire( rec->segments, fd ); }
+}
+
+/* switch to the next segment's files, ready opened by the rotation thread */
+static void
+next_segment ( struct recorder *rec ) {
+    struct segment seg;
+
+    if ( segments_next( rec->segments, &seg ) == 0 ) {
+        write_failed(rec, errno);
+        return;
+    }
+
+    close_index(rec);
+    rec->index = fdopen( seg.companion_fd, "wb" );
+    if ( rec->index == NULL ) {
+        write_failed(rec, errno);
+        close(seg.companion_fd);
+    }
+
+    /* writes to the old file may not have finished yet */
+    rec->closing[rec->nclosing].fd = rec->fd;
+    rec->closing[rec->nclosing].after = rec->submitted;
+    rec->nclosing++;
+
+    rec->fd = seg.fd;
+    rec->offset = 0;
+    rec->segment_frames = 0;
+    rec->files++;
+    if ( rec->index ) { write_index_header(rec); }
+}
+
+/* pick a file position for the next frame and index it */
+static struct entry *
+start_entry ( struct recorder *rec ) {
+    struct entry *e = &rec->ring[rec->submitted % RECORD_DEPTH];
+    struct recorder_index_entry ie;
+    int64_t ts = frame_time_us(&e->f);
+
+    if ( rec->segments && rec->failed == 0 ) {
+        if ( rec->segment_frames == 0 ) {
+            rec->segment_start = ts;
+        } else if ( ts - rec->segment_start >= rec->segment_us ) {
+            next_segment(rec);
+            rec->segment_start = ts;
+        }
+    }
+
+    e->fd = rec->fd;
+    e->written = 0;
+    e->offset = rec->offset;
+    e->done = rec->failed;   /* nothing more gets written after an error */
+    rec->submitted++;
+
+    if ( rec->failed ) { return e; }
+
+    ie.offset = e->offset;
+    ie.bytesused = e->f.bytesused;
+    ie.sequence = e->f.sequence;
+    ie.timestamp_us = ts;
+    fwrite( &ie, sizeof(struct recorder_index_entry), 1, rec->index );
+
+    rec->offset += e->f.bytesused;
+    rec->frames++;
+    rec->segment_frames++;
+
+    return e;
+}
+
+/* queue (the rest of) an entry's write */
+static int
+queue_write ( struct recorder *rec, struct entry *e ) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&rec->uring);
+    if ( sqe == NULL ) { return 0; }
+
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = e->fd;
+    sqe->addr = (uintptr_t) e->f.data + e->written;
+    sqe->len = e->f.bytesused - e->written;
+    sqe->off = e->offset + e->written;
+    sqe->user_data = e - rec->ring;
+
+    return 1;
+}
+
+static int
+queue_wake ( struct recorder *rec ) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&rec->uring);
+    if ( sqe == NULL ) { return 0; }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = rec->wake_fd;
+    sqe->addr = (uintptr_t) &rec->wake_count;
+    sqe->len = sizeof(rec->wake_count);
+    sqe->user_data = WAKE_TAG;
+
+    return 1;
+}
+
+static void
+complete ( struct recorder *rec, struct io_uring_cqe *cqe ) {
+    if ( cqe->user_data == WAKE_TAG ) {
+        queue_wake(rec);
+        return;
+    }
+
+    struct entry *e = &rec->ring[cqe->user_data];
+
+    if ( cqe->res < 0 ) {
+        write_failed(rec, -cqe->res);
+        e->done = 1;
+    } else if ( cqe->res == 0 ) {
+        write_failed(rec, ENOSPC);
+        e->done = 1;
+    } else {
+        e->written += cqe->res;
+        if ( e->written == e->f.bytesused || queue_write(rec, e) == 0 ) { e->done = 1; }
+    }
+}
+
+/* Writer using io_uring. The only place it sleeps is io_uring_enter, */
+/* waiting on either a write finishing or a read of wake_fd that is kept */
+/* in flight so new frames wake it too. */
+static void
+write_uring ( struct recorder *rec ) {
+    queue_wake(rec);
+
+    for (;;) {
+        unsigned int head = atomic_load_explicit( &rec->head, memory_order_acquire );
+
+        while ( rec->submitted != head ) {
+            struct entry *e = start_entry(rec);
+            if ( e->done == 0 && queue_write(rec, e) == 0 ) {
+                write_failed(rec, EBUSY);
+                e->done = 1;
+            }
+        }
+
+        retire(rec);
+
+        /* capture has stopped by the time quit is set, so head is final */
+        if ( atomic_load(&rec->quit) &&
+            atomic_load(&rec->tail) == atomic_load(&rec->head) ) {
+            break;
+        }
+
+        if ( uring_submit(&rec->uring, 1) == 0 ) {
+            /* can't wait on the ring any more - finish off synchronously */
+            write_failed(rec, errno);
+            for ( unsigned int i = atomic_load(&rec->tail); i != rec->submitted; i++ ) {
+                rec->ring[i % RECORD_DEPTH].done = 1;
+            }
+            retire(rec);
+            return;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ( (cqe = uring_peek_cqe(&rec->uring)) != NULL ) {
+            complete(rec, cqe);
+            uring_cqe_seen(&rec->uring);
+        }
+    }
+}
+
+/* Writer for kernels without io_uring - the same thing with pwrite */
+static void
+write_sync ( struct recorder *rec ) {
+    struct pollfd pfd = { rec->wake_fd, POLLIN, 0 };
+    uint64_t count;
+
+    for (;;) {
+        unsigned int head = atomic_load_explicit( &rec->head, memory_order_acquire );
+
+        while ( rec->submitted != head ) {
+            struct entry *e = start_entry(rec);
+
+            while ( e->done == 0 ) {
+                ssize_t n = pwrite( e->fd, (const char *) e->f.data + e->written,
+                    e->f.bytesused - e->written, e->offset + e->written );
+                if ( n < 0 && errno == EINTR ) { continue; }
+                if ( n <= 0 ) {
+                    write_failed(rec, n < 0 ? errno : ENOSPC);
+                    break;
+                }
+                e->written += n;
+                if ( e->written == e->f.bytesused ) { break; }
+            }
+
+            e->done = 1;
+            retire(rec);
+        }
+
+        if ( atomic_load(&rec->quit) &&
+            atomic_load(&rec->tail) == atomic_load(&rec->head) ) {
+            break;
+        }
+
+        if ( poll( &pfd, 1, -1 ) > 0 &&
+            read( rec->wake_fd, &count, sizeof(count) ) < 0 ) {
+            perror("eventfd");
+        }
+    }
+}
+
+static void *
+writer ( void *arg ) {
+    struct recorder *rec = arg;
+
+    if ( rec->use_uring ) {
+        write_uring(rec);
+    } else {
+        write_sync(rec);
+    }
+
+    return NULL;
+}
+
+/* io_uring is there and can do plain reads and writes (5.6 onwards) */
+static int
+uring_usable ( struct recorder *rec ) {
+    char buf[sizeof(struct io_uring_probe) + 64 * sizeof(struct io_uring_probe_op)];
+    struct io_uring_probe *probe = (struct io_uring_probe *) buf;
+
+    if ( uring_init(&rec->uring, 2 * RECORD_DEPTH + 2) == 0 ) { return 0; }
+
+    memset( buf, 0, sizeof(buf) );
+    if ( syscall( __NR_io_uring_register, rec->uring.fd,
+            IORING_REGISTER_PROBE, probe, 64 ) < 0 ||
+        probe->last_op < IORING_OP_WRITE ||
+        (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) == 0 ||
+        (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) == 0 ) {
+        uring_exit(&rec->uring);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void
+destroy ( struct sink *sink ) {
+    struct recorder *rec = (struct recorder *) sink;
+    uint64_t one = 1;
+
+    if ( rec->running ) {
+        atomic_store(&rec->quit, 1);
+        if ( write( rec->wake_fd, &one, sizeof(one) ) < 0 ) { perror("eventfd"); }
+        pthread_join(rec->thread, NULL);
+
+        if ( rec->segments ) {
+            fprintf( stderr, "Recorded %lu frames to %u segments of %s, dropped %lu\n",
+                rec->frames, rec->files, rec->path, atomic_load(&rec->dropped)
+            );
+        } else {
+            fprintf( stderr, "Recorded %lu frames to %s, dropped %lu\n",
+                rec->frames, rec->path, atomic_load(&rec->dropped)
+            );
+        }
+    }
+
+    if ( rec->use_uring ) { uring_exit(&rec->uring); }
+
+    /* the last segment is synced and closed like the rest */
+    if ( rec->segments ) {
+        close_index(rec);
+        for ( unsigned int i=0; i<rec->nclosing; i++ ) {
+            segments_retire( rec->segments, rec->closing[i].fd );
+        }
+        if ( rec->fd >= 0 ) { segments_retire( rec->segments, rec->fd ); }
+        segments_destroy(rec->segments);
+    } else {
+        if ( rec->index ) { fclose(rec->index); }
+        if ( rec->fd >= 0 ) { close(rec->fd); }
+    }
+    if ( rec->wake_fd >= 0 ) { close(rec->wake_fd); }
+
+    free(rec->path);
+    free(rec);
+}
+
+struct sink *
+recorder_create ( const char *path, const struct frame_format *fmt, int segment ) {
+    struct recorder *rec = calloc(1, sizeof(struct recorder));
+    if ( rec == NULL ) { return NULL; }
+
+    rec->sink.name = "recorder";
+    rec->sink.push = push;
+    rec->sink.destroy = destroy;
+    rec->format = *fmt;
+    rec->path = strdup(path);
+    rec->fd = -1;
+    atomic_init(&rec->quit, 0);
+    atomic_init(&rec->head, 0);
+    atomic_init(&rec->tail, 0);
+    atomic_init(&rec->dropped, 0);
+
+    /* blocking, or io_uring would complete reads of it with EAGAIN */
+    rec->wake_fd = eventfd( 0, EFD_CLOEXEC );
+    if ( rec->wake_fd < 0 ) {
+        perror("eventfd");
+        destroy(&rec->sink);
+        return NULL;
+    }
+
+    if ( segment > 0 ) {
+        struct segment seg;
+        double fps = fmt->fps > 0 ? fmt->fps : 30;
+
+        rec->segment_us = (int64_t) segment * 1000000;
+        rec->segments = segments_create( path, ".idx",
+            segment * fps * frame_typical_size(fmt) );
+        if ( rec->segments == NULL || segments_next( rec->segments, &seg ) == 0 ) {
+            destroy(&rec->sink);
+            return NULL;
+        }
+
+        rec->fd = seg.fd;
+        rec->index = fdopen( seg.companion_fd, "wb" );
+        if ( rec->index == NULL ) { close(seg.companion_fd); }
+        rec->files = 1;
+    } else {
+        rec->fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+        if ( rec->fd < 0 ) {
+            perror(path);
+            destroy(&rec->sink);
+            return NULL;
+        }
+
+        char *name = malloc( strlen(path) + sizeof(".idx") );
+        if ( name == NULL ) {
+            destroy(&rec->sink);
+            return NULL;
+        }
+        sprintf( name, "%s.idx", path );
+        rec->index = fopen( name, "wb" );
+        if ( rec->index == NULL ) { perror(name); }
+        free(name);
+    }
+
+    if ( rec->index == NULL ) {
+        destroy(&rec->sink);
+        return NULL;
+    }
+    write_index_header(rec);
+
+    rec->use_uring = uring_usable(rec);
+    if ( rec->use_uring == 0 ) {
+        fprintf( stderr, "io_uring not available, recording with pwrite\n" );
+    }
+
+    if ( pthread_create( &rec->thread, NULL, writer, rec ) != 0 ) {
+        fprintf( stderr, "Unable to start recorder thread\n" );
+        destroy(&rec->sink);
+        return NULL;
+    }
+    rec->running = 1;
+
+    return &rec->sink;
+}
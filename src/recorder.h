@@ -0,0 +1,40 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+/* Raw recording. Every frame is written to path exactly as the driver */
+/* delivered it, one after another, and path.idx gets a header followed */
+/* by one fixed size entry per frame so any frame can be found without */
+/* reading the ones before it. Writes are queued on a thread of their own */
+/* (through io_uring where the kernel has it), straight out of the capture */
+/* buffer, so a slow disk costs dropped frames rather than a stalled camera. */
+
+#define RECORDER_INDEX_MAGIC   0x58444943u /* "CIDX" */
+#define RECORDER_INDEX_VERSION 1
+
+struct recorder_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pixelformat;    /* V4L2 fourcc */
+    uint32_t width, height;
+    uint32_t stride;
+    uint32_t sizeimage;
+    uint32_t fps_milli;      /* nominal frame rate * 1000 */
+};
+
+struct recorder_index_entry {
+    uint64_t offset;         /* of the frame in the data file */
+    uint32_t bytesused;
+    uint32_t sequence;       /* V4L2 sequence number */
+    int64_t  timestamp_us;   /* capture time */
+};
+
+/* With segment seconds above 0 the recording is split into files that */
+/* long (see segments.h), each with its own index starting from offset 0. */
+struct sink *recorder_create ( const char *path, const struct frame_format *fmt,
+    int segment );
+
+#endif
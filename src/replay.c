@@ -0,0 +1,599 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>       /* errno */
+#include <fcntl.h>       /* open */
+#include <memory.h>      /* memcpy */
+#include <string.h>      /* strerror */
+#include <unistd.h>      /* pread */
+#include <sys/stat.h>    /* fstat */
+
+#include <linux/videodev2.h>
+
+#include "recorder.h"
+#include "replay.h"
+
+/* the Matroska elements we look at, as mkv.c writes them */
+#define ID_SEGMENT            0x18538067
+#define ID_INFO               0x1549A966
+#define ID_TIMESTAMPSCALE     0x2AD7B1
+#define ID_TRACKS             0x1654AE6B
+#define ID_TRACKENTRY         0xAE
+#define ID_TRACKNUMBER        0xD7
+#define ID_CODECID            0x86
+#define ID_DEFAULTDURATION    0x23E383
+#define ID_VIDEO              0xE0
+#define ID_PIXELWIDTH         0xB0
+#define ID_PIXELHEIGHT        0xBA
+#define ID_CLUSTER            0x1F43B675
+#define ID_TIMESTAMP          0xE7
+#define ID_SIMPLEBLOCK        0xA3
+
+/* size of an element whose end is wherever its parent's is */
+#define UNKNOWN_SIZE          ((uint64_t) -1)
+
+struct replay {
+    struct source_reader reader;
+    char                *path;
+    FILE                *file;
+
+    /* raw - frames are read through the index */
+    int                  fd;
+    FILE                *index;
+
+    /* Y4M */
+    uint64_t             frame;
+    uint32_t             fps_num, fps_den;
+    int                  chroma;      /* 420 or 422, 0 for mono */
+    unsigned char       *planes;      /* U and V as they are in the file */
+
+    /* Matroska */
+    uint64_t             scale_ns;    /* per timestamp tick */
+    uint64_t             track;       /* the MJPEG track's number */
+    int64_t              cluster;     /* timestamp of the cluster we're in */
+};
+
+/* Read the whole of n bytes. 1 if they were, 0 at the end of the file, */
+/* -1 (reported) if it ended part of the way or couldn't be read. */
+static int
+read_exactly ( struct replay *rp, void *dst, size_t n ) {
+    size_t got = fread( dst, 1, n, rp->file );
+    if ( got == n ) { return 1; }
+
+    if ( ferror(rp->file) ) {
+        fprintf( stderr, "%s: %s\n", rp->path, strerror(errno) );
+        return -1;
+    }
+    if ( got > 0 ) {
+        fprintf( stderr, "%s: cut short\n", rp->path );
+        return -1;
+    }
+    return 0;
+}
+
+static int
+raw_read ( struct source_reader *r, void *dst, size_t cap, size_t *size,
+    int64_t *timestamp_us ) {
+    struct replay *rp = (struct replay *) r;
+    struct recorder_index_entry ie;
+
+    for ( ;; ) {
+        if ( fread( &ie, sizeof(struct recorder_index_entry), 1, rp->index ) != 1 ) {
+            return 0;
+        }
+
+        if ( ie.bytesused <= cap ) { break; }
+        fprintf( stderr, "%s: skipping frame %u, %u bytes is more than a buffer holds\n",
+            rp->path, ie.sequence, ie.bytesused );
+    }
+
+    ssize_t n = pread( rp->fd, dst, ie.bytesused, ie.offset );
+    if ( n < 0 ) {
+        perror(rp->path);
+        return -1;
+    }
+    if ( (size_t) n < ie.bytesused ) { return 0; }
+
+    *size = n;
+    *timestamp_us = ie.timestamp_us;
+    return 1;
+}
+
+/* frames back to back with nothing to say where they start, so spaced */
+/* by the requested frame rate */
+static int
+bare_read ( struct source_reader *r, void *dst, size_t cap, size_t *size,
+    int64_t *timestamp_us ) {
+    struct replay *rp = (struct replay *) r;
+    const struct frame_format *fmt = &rp->reader.format;
+
+    (void) cap;
+
+    int got = read_exactly( rp, dst, fmt->sizeimage );
+    if ( got <= 0 ) { return got; }
+
+    *size = fmt->sizeimage;
+    *timestamp_us = (int64_t) (rp->frame * 1000000 / fmt->fps);
+    rp->frame++;
+
+    return 1;
+}
+
+/* a raw file without an index, taken to be whatever was asked for */
+static int
+open_bare ( struct replay *rp, const struct source_request *req ) {
+    struct frame_format *fmt = &rp->reader.format;
+    struct stat st;
+
+    fmt->pixelformat = req->pixelformat ? req->pixelformat : V4L2_PIX_FMT_YUYV;
+    fmt->width = req->width;
+    fmt->height = req->height;
+    fmt->fps = req->fps > 0 ? req->fps : 30;
+
+    if ( fmt->width <= 0 || fmt->height <= 0 || fmt->width % 2 || fmt->height % 2 ) {
+        fprintf( stderr, "%s: a raw file needs an even frame size\n", rp->path );
+        return 0;
+    }
+
+    switch ( fmt->pixelformat ) {
+        case V4L2_PIX_FMT_YUYV:
+            fmt->stride = fmt->width * 2;
+            fmt->sizeimage = (size_t) fmt->stride * fmt->height;
+            break;
+        case V4L2_PIX_FMT_NV12:
+            fmt->stride = fmt->width;
+            fmt->sizeimage = (size_t) fmt->stride * fmt->height * 3 / 2;
+            break;
+        case V4L2_PIX_FMT_GREY:
+            fmt->stride = fmt->width;
+            fmt->sizeimage = (size_t) fmt->stride * fmt->height;
+            break;
+        default:
+            fprintf( stderr, "%s: a raw file without an index can be YUYV, NV12 or GREY\n",
+                rp->path );
+            return 0;
+    }
+
+    /* the size is all there is to go on that -W, -H and -p are right */
+    if ( fstat( fileno(rp->file), &st ) == 0 && st.st_size % fmt->sizeimage ) {
+        fprintf( stderr, "%s: not a whole number of %dx%d frames, check -W, -H and -p\n",
+            rp->path, fmt->width, fmt->height );
+    }
+
+    rewind(rp->file);
+    rp->reader.read = bare_read;
+    return 1;
+}
+
+static int
+open_raw ( struct replay *rp, const struct source_request *req ) {
+    struct recorder_index_header hdr;
+    char *name = malloc( strlen(rp->path) + sizeof(".idx") );
+
+    if ( name == NULL ) { return 0; }
+    sprintf( name, "%s.idx", rp->path );
+
+    rp->index = fopen( name, "rb" );
+    if ( rp->index == NULL && errno == ENOENT ) {
+        free(name);
+        return open_bare(rp, req);
+    }
+    if ( rp->index == NULL ) {
+        fprintf( stderr, "%s: %s\n", name, strerror(errno) );
+        free(name);
+        return 0;
+    }
+
+    if ( fread( &hdr, sizeof(struct recorder_index_header), 1, rp->index ) != 1 ||
+        hdr.magic != RECORDER_INDEX_MAGIC || hdr.version != RECORDER_INDEX_VERSION ) {
+        fprintf( stderr, "%s: not a recording index\n", name );
+        free(name);
+        return 0;
+    }
+    free(name);
+
+    rp->fd = open( rp->path, O_RDONLY | O_CLOEXEC );
+    if ( rp->fd < 0 ) {
+        perror(rp->path);
+        return 0;
+    }
+
+    struct frame_format *fmt = &rp->reader.format;
+    fmt->pixelformat = hdr.pixelformat;
+    fmt->width = hdr.width;
+    fmt->height = hdr.height;
+    fmt->stride = hdr.stride;
+    fmt->sizeimage = hdr.sizeimage;
+    fmt->fps = hdr.fps_milli / 1000.0;
+
+    rp->reader.read = raw_read;
+    return 1;
+}
+
+static int
+y4m_read ( struct source_reader *r, void *dst, size_t cap, size_t *size,
+    int64_t *timestamp_us ) {
+    struct replay *rp = (struct replay *) r;
+    const struct frame_format *fmt = &rp->reader.format;
+    size_t luma = (size_t) fmt->width * fmt->height;
+    size_t chroma = rp->chroma == 420 ? luma / 4 : rp->chroma == 422 ? luma / 2 : 0;
+    char line[256];
+    int got;
+
+    (void) cap;
+
+    /* FRAME and any parameters, which we have no use for */
+    if ( fgets( line, sizeof(line), rp->file ) == NULL ) { return 0; }
+    if ( strncmp( line, "FRAME", 5 ) != 0 ) {
+        fprintf( stderr, "%s: lost track of the frames\n", rp->path );
+        return -1;
+    }
+
+    /* NV12 and GREY keep luma as is, YUYV takes it a pixel at a time */
+    unsigned char *y = rp->chroma == 422 ? rp->planes + 2 * chroma : dst;
+    if ( (got = read_exactly( rp, y, luma )) <= 0 ) { return got ? got : -1; }
+    if ( chroma && (got = read_exactly( rp, rp->planes, 2 * chroma )) <= 0 ) {
+        return got ? got : -1;
+    }
+
+    const unsigned char *u = rp->planes, *v = rp->planes + chroma;
+    unsigned char *out = dst;
+    int half = fmt->width / 2;
+
+    if ( rp->chroma == 420 ) {
+        unsigned char *uv = out + luma;
+        for ( size_t i=0; i<chroma; i++ ) {
+            uv[2 * i] = u[i];
+            uv[2 * i + 1] = v[i];
+        }
+    } else if ( rp->chroma == 422 ) {
+        for ( int row=0; row<fmt->height; row++ ) {
+            for ( int x=0; x<half; x++, out+=4 ) {
+                out[0] = y[2 * x];
+                out[1] = u[x];
+                out[2] = y[2 * x + 1];
+                out[3] = v[x];
+            }
+            y += fmt->width;
+            u += half;
+            v += half;
+        }
+    }
+
+    *size = fmt->sizeimage;
+    *timestamp_us = (int64_t) (rp->frame * 1000000 * rp->fps_den / rp->fps_num);
+    rp->frame++;
+
+    return 1;
+}
+
+static int
+open_y4m ( struct replay *rp ) {
+    struct frame_format *fmt = &rp->reader.format;
+    char header[512];
+    char *save;
+
+    if ( fgets( header, sizeof(header), rp->file ) == NULL || strchr( header, '\n' ) == NULL ) {
+        fprintf( stderr, "%s: bad Y4M header\n", rp->path );
+        return 0;
+    }
+
+    rp->fps_num = 30;
+    rp->fps_den = 1;
+    rp->chroma = 420;
+
+    /* the tags we care about; anything else (interlacing, aspect) is taken */
+    /* as progressive and square */
+    strtok_r( header, " \n", &save );
+    for ( char *tag; (tag = strtok_r( NULL, " \n", &save )); ) {
+        switch ( tag[0] ) {
+            case 'W': fmt->width = atoi(tag + 1); break;
+            case 'H': fmt->height = atoi(tag + 1); break;
+            case 'F':
+                if ( sscanf( tag + 1, "%u:%u", &rp->fps_num, &rp->fps_den ) != 2 ||
+                    rp->fps_num == 0 || rp->fps_den == 0 ) {
+                    rp->fps_num = 30;
+                    rp->fps_den = 1;
+                }
+                break;
+            case 'C':
+                if ( strcmp( tag, "C420" ) == 0 || strcmp( tag, "C420jpeg" ) == 0 ||
+                    strcmp( tag, "C420mpeg2" ) == 0 || strcmp( tag, "C420paldv" ) == 0 ) {
+                    rp->chroma = 420;
+                } else if ( strcmp( tag, "C422" ) == 0 ) {
+                    rp->chroma = 422;
+                } else if ( strcmp( tag, "Cmono" ) == 0 ) {
+                    rp->chroma = 0;
+                } else {
+                    fprintf( stderr, "%s: can't play Y4M colourspace %s\n", rp->path, tag + 1 );
+                    return 0;
+                }
+                break;
+        }
+    }
+
+    if ( fmt->width <= 0 || fmt->height <= 0 || fmt->width % 2 || fmt->height % 2 ) {
+        fprintf( stderr, "%s: Y4M frames must be an even size\n", rp->path );
+        return 0;
+    }
+
+    size_t luma = (size_t) fmt->width * fmt->height;
+    fmt->fps = (double) rp->fps_num / rp->fps_den;
+
+    if ( rp->chroma == 420 ) {
+        fmt->pixelformat = V4L2_PIX_FMT_NV12;
+        fmt->stride = fmt->width;
+        fmt->sizeimage = luma * 3 / 2;
+        rp->planes = malloc( luma / 2 );
+    } else if ( rp->chroma == 422 ) {
+        fmt->pixelformat = V4L2_PIX_FMT_YUYV;
+        fmt->stride = fmt->width * 2;
+        fmt->sizeimage = luma * 2;
+        rp->planes = malloc( luma * 2 );
+    } else {
+        fmt->pixelformat = V4L2_PIX_FMT_GREY;
+        fmt->stride = fmt->width;
+        fmt->sizeimage = luma;
+    }
+
+    if ( rp->chroma && rp->planes == NULL ) {
+        fprintf( stderr, "Out of memory\n" );
+        return 0;
+    }
+
+    rp->reader.read = y4m_read;
+    return 1;
+}
+
+/* EBML variable length integer: IDs keep their length marker, sizes */
+/* lose it. 0 at the end of the file, -1 if it isn't one. */
+static int
+read_vint ( struct replay *rp, uint64_t *v, int id ) {
+    int c = fgetc(rp->file);
+    if ( c == EOF ) { return 0; }
+    if ( c == 0 ) { return -1; }
+
+    int len = 1;
+    while ( (c & (0x80 >> (len - 1))) == 0 ) { len++; }
+
+    uint64_t all_ones = (1ull << (7 * len)) - 1;
+    *v = id ? (uint64_t) c : (uint64_t) (c & (0xFF >> len));
+    for ( int i=1; i<len; i++ ) {
+        if ( (c = fgetc(rp->file)) == EOF ) { return -1; }
+        *v = (*v << 8) | c;
+    }
+
+    if ( id == 0 && *v == all_ones ) { *v = UNKNOWN_SIZE; }
+    return 1;
+}
+
+static int
+read_uint ( struct replay *rp, uint64_t size, uint64_t *v ) {
+    unsigned char b[8];
+
+    if ( size > 8 || read_exactly( rp, b, size ) <= 0 ) { return 0; }
+
+    *v = 0;
+    for ( uint64_t i=0; i<size; i++ ) { *v = (*v << 8) | b[i]; }
+    return 1;
+}
+
+static int
+skip ( struct replay *rp, uint64_t size ) {
+    if ( size == UNKNOWN_SIZE || fseeko( rp->file, size, SEEK_CUR ) != 0 ) {
+        fprintf( stderr, "%s: can't skip a Matroska element\n", rp->path );
+        return 0;
+    }
+    return 1;
+}
+
+/* One SimpleBlock of the MJPEG track into dst, 0 for a block of some */
+/* other track or one to skip. Lacing isn't used for video. */
+static int
+read_block ( struct replay *rp, uint64_t size, void *dst, size_t cap,
+    size_t *out, int64_t *timestamp_us ) {
+    unsigned char hdr[3];
+    uint64_t track;
+    off_t start = ftello(rp->file);
+
+    if ( read_vint( rp, &track, 0 ) <= 0 || read_exactly( rp, hdr, 3 ) <= 0 ) { return -1; }
+
+    uint64_t used = ftello(rp->file) - start;
+    uint64_t n = size - used;
+
+    if ( track != rp->track || (hdr[2] & 0x06) || n > cap ) {
+        if ( track == rp->track ) {
+            fprintf( stderr, "%s: skipping a laced or %llu byte frame\n", rp->path,
+                (unsigned long long) n );
+        }
+        return skip( rp, n ) ? 0 : -1;
+    }
+
+    if ( read_exactly( rp, dst, n ) <= 0 ) { return -1; }
+
+    int16_t offset = (int16_t) (hdr[0] << 8 | hdr[1]);
+    *out = n;
+    *timestamp_us = (rp->cluster + offset) * (int64_t) rp->scale_ns / 1000;
+    return 1;
+}
+
+/* Walks the file a flat element at a time: the masters leading to what */
+/* we want are stepped into rather than over, so their children just */
+/* come next. Everything else is skipped. */
+static int
+mkv_read ( struct source_reader *r, void *dst, size_t cap, size_t *size,
+    int64_t *timestamp_us ) {
+    struct replay *rp = (struct replay *) r;
+    uint64_t id, len, v;
+    int got;
+
+    for ( ;; ) {
+        if ( (got = read_vint( rp, &id, 1 )) <= 0 ) { return got; }
+        if ( read_vint( rp, &len, 0 ) <= 0 ) { return -1; }
+
+        switch ( id ) {
+            case ID_SEGMENT:
+            case ID_CLUSTER:
+                break;
+            case ID_TIMESTAMP:
+                if ( read_uint( rp, len, &v ) == 0 ) { return -1; }
+                rp->cluster = v;
+                break;
+            case ID_SIMPLEBLOCK:
+                if ( len == UNKNOWN_SIZE ) { return -1; }
+                if ( (got = read_block( rp, len, dst, cap, size, timestamp_us )) != 0 ) {
+                    return got;
+                }
+                break;
+            default:
+                if ( skip( rp, len ) == 0 ) { return -1; }
+                break;
+        }
+    }
+}
+
+/* A track's settings, kept until the next one starts. */
+struct track {
+    uint64_t number;
+    char     codec[16];
+    uint64_t width, height;
+    uint64_t duration_ns;
+};
+
+static void
+choose_track ( struct replay *rp, const struct track *t ) {
+    struct frame_format *fmt = &rp->reader.format;
+
+    if ( rp->track || strcmp( t->codec, "V_MJPEG" ) != 0 ) { return; }
+
+    rp->track = t->number;
+    fmt->width = t->width;
+    fmt->height = t->height;
+    fmt->fps = t->duration_ns ? 1e9 / t->duration_ns : 30;
+}
+
+/* everything up to the first cluster, which mkv_read takes from there */
+static int
+open_mkv ( struct replay *rp ) {
+    struct frame_format *fmt = &rp->reader.format;
+    struct track t;
+    uint64_t id, len;
+
+    memset( &t, 0, sizeof(struct track) );
+    rp->scale_ns = 1000000;
+
+    for ( ;; ) {
+        off_t at = ftello(rp->file);
+
+        if ( read_vint( rp, &id, 1 ) <= 0 || read_vint( rp, &len, 0 ) <= 0 ) {
+            fprintf( stderr, "%s: no frames in the Matroska file\n", rp->path );
+            return 0;
+        }
+
+        switch ( id ) {
+            case ID_SEGMENT:
+            case ID_INFO:
+            case ID_TRACKS:
+            case ID_VIDEO:
+                break;
+            case ID_TRACKENTRY:
+                choose_track( rp, &t );
+                memset( &t, 0, sizeof(struct track) );
+                break;
+            case ID_CODECID:
+                if ( len >= sizeof(t.codec) ) {
+                    if ( skip( rp, len ) == 0 ) { return 0; }
+                } else if ( read_exactly( rp, t.codec, len ) <= 0 ) {
+                    return 0;
+                }
+                break;
+            case ID_TIMESTAMPSCALE:
+                if ( read_uint( rp, len, &rp->scale_ns ) == 0 ) { return 0; }
+                break;
+            case ID_TRACKNUMBER:
+                if ( read_uint( rp, len, &t.number ) == 0 ) { return 0; }
+                break;
+            case ID_DEFAULTDURATION:
+                if ( read_uint( rp, len, &t.duration_ns ) == 0 ) { return 0; }
+                break;
+            case ID_PIXELWIDTH:
+                if ( read_uint( rp, len, &t.width ) == 0 ) { return 0; }
+                break;
+            case ID_PIXELHEIGHT:
+                if ( read_uint( rp, len, &t.height ) == 0 ) { return 0; }
+                break;
+            case ID_CLUSTER:
+                choose_track( rp, &t );
+                if ( rp->track == 0 || fmt->width <= 0 || fmt->height <= 0 ) {
+                    fprintf( stderr, "%s: no MJPEG track to play\n", rp->path );
+                    return 0;
+                }
+
+                /* back to the cluster for mkv_read to step into */
+                if ( fseeko( rp->file, at, SEEK_SET ) != 0 ) {
+                    perror(rp->path);
+                    return 0;
+                }
+
+                /* as a camera would, room for any JPEG the frame could make */
+                fmt->pixelformat = V4L2_PIX_FMT_MJPEG;
+                fmt->stride = fmt->width;
+                fmt->sizeimage = (size_t) fmt->width * fmt->height * 2;
+                rp->reader.read = mkv_read;
+                return 1;
+            default:
+                if ( skip( rp, len ) == 0 ) { return 0; }
+                break;
+        }
+    }
+}
+
+static void
+replay_close ( struct source_reader *r ) {
+    struct replay *rp = (struct replay *) r;
+
+    if ( rp->file ) { fclose(rp->file); }
+    if ( rp->index ) { fclose(rp->index); }
+    if ( rp->fd >= 0 ) { close(rp->fd); }
+    free(rp->planes);
+    free(rp->path);
+    free(rp);
+}
+
+struct source_reader *
+replay_open ( const char *path, const struct source_request *req ) {
+    unsigned char magic[4];
+
+    struct replay *rp = calloc(1, sizeof(struct replay));
+    if ( rp == NULL ) { return NULL; }
+
+    rp->fd = -1;
+    rp->reader.close = replay_close;
+    rp->path = strdup(path);
+    rp->file = fopen( path, "rb" );
+    if ( rp->path == NULL || rp->file == NULL ) {
+        perror(path);
+        replay_close(&rp->reader);
+        return NULL;
+    }
+
+    int ok;
+    if ( fread( magic, 1, sizeof(magic), rp->file ) != sizeof(magic) ) {
+        ok = open_raw(rp, req);
+    } else if ( memcmp( magic, "YUV4", 4 ) == 0 ) {
+        rewind(rp->file);
+        ok = open_y4m(rp);
+    } else if ( memcmp( magic, "\x1A\x45\xDF\xA3", 4 ) == 0 ) {
+        rewind(rp->file);
+        ok = open_mkv(rp);
+    } else {
+        ok = open_raw(rp, req);
+    }
+
+    if ( ok == 0 ) {
+        replay_close(&rp->reader);
+        return NULL;
+    }
+
+    return &rp->reader;
+}
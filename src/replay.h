@@ -0,0 +1,17 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "source.h"
+
+/* Recordings played back, told apart by their first few bytes: */
+/*   Y4M      - 4:2:0 as NV12, 4:2:2 as YUYV, mono as GREY */
+/*   Matroska - the MJPEG track, as the mkv sink writes it */
+/*   raw      - anything else, with a path.idx from the recorder sink, */
+/*              or without one frames back to back in the format req */
+/*              asks for (YUYV, NV12 or GREY) */
+/* Frames keep the timestamps they were recorded with; Y4M and bare raw */
+/* have none, so their frames are spaced by the frame rate. */
+struct source_reader *replay_open ( const char *path,
+    const struct source_request *req );
+
+#endif
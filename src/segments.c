@@ -0,0 +1,233 @@
+#define _GNU_SOURCE      /* fallocate */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>       /* errno */
+#include <fcntl.h>       /* open, fallocate */
+#include <memory.h>      /* strrchr */
+#include <pthread.h>
+#include <unistd.h>      /* fsync */
+#include <sys/stat.h>    /* fstat */
+
+#include "segments.h"
+
+/* finished files waiting to be closed - a writer blocks beyond this */
+#define RETIRE_MAX 16
+
+struct segments {
+    char           *base;        /* path up to the extension */
+    char           *ext;         /* extension with its dot, or "" */
+    char           *companion;
+    off_t           prealloc;
+
+    pthread_t       thread;
+    int             running;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    /* all under lock */
+    struct segment  spare;
+    int             spare_ready;
+    int             spare_errno; /* why the spare couldn't be opened, 0 if it could */
+    int             retiring[RETIRE_MAX];
+    int             nretiring;
+    int             quit;
+
+    /* rotation thread only */
+    unsigned int    number;
+    int             warned;
+};
+
+static int
+open_file ( const char *name ) {
+    int fd = open( name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( fd < 0 ) { perror(name); }
+    return fd;
+}
+
+/* open and reserve the next segment, errno if it fails */
+static int
+open_spare ( struct segments *sg, struct segment *seg ) {
+    char name[PATH_MAX + 16];
+
+    seg->number = sg->number++;
+    seg->companion_fd = -1;
+    if ( snprintf( seg->name, sizeof(seg->name), "%s-%04u%s",
+            sg->base, seg->number, sg->ext ) >= (int) sizeof(seg->name) ) {
+        return ENAMETOOLONG;
+    }
+
+    seg->fd = open_file(seg->name);
+    if ( seg->fd < 0 ) { return errno; }
+
+    /* keep the size so a crash leaves a file as long as what was written */
+    if ( sg->prealloc > 0 &&
+        fallocate( seg->fd, FALLOC_FL_KEEP_SIZE, 0, sg->prealloc ) < 0 &&
+        sg->warned == 0 ) {
+        if ( errno != EOPNOTSUPP ) { perror("fallocate"); }
+        sg->warned = 1;
+    }
+
+    if ( sg->companion ) {
+        snprintf( name, sizeof(name), "%s%s", seg->name, sg->companion );
+        seg->companion_fd = open_file(name);
+        if ( seg->companion_fd < 0 ) {
+            int err = errno;
+            close(seg->fd);
+            unlink(seg->name);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/* give back what was reserved and didn't get used, then sync and close */
+static void
+finish_file ( struct segments *sg, int fd ) {
+    struct stat st;
+
+    if ( sg->prealloc > 0 && fstat( fd, &st ) == 0 ) {
+        if ( ftruncate( fd, st.st_size ) < 0 ) { perror("ftruncate"); }
+    }
+    if ( fsync(fd) < 0 ) { perror("fsync"); }
+    close(fd);
+}
+
+static void *
+rotate ( void *arg ) {
+    struct segments *sg = arg;
+
+    pthread_mutex_lock(&sg->lock);
+    for (;;) {
+        /* a writer may be waiting on the spare so it comes first */
+        if ( sg->spare_ready == 0 && sg->spare_errno == 0 && sg->quit == 0 ) {
+            struct segment seg;
+            pthread_mutex_unlock(&sg->lock);
+            int err = open_spare(sg, &seg);
+            pthread_mutex_lock(&sg->lock);
+
+            sg->spare = seg;
+            sg->spare_ready = err == 0;
+            sg->spare_errno = err;
+            pthread_cond_broadcast(&sg->cond);
+            continue;
+        }
+
+        if ( sg->nretiring ) {
+            int fd = sg->retiring[0];
+            sg->nretiring--;
+            memmove( sg->retiring, sg->retiring + 1, sg->nretiring * sizeof(int) );
+            pthread_cond_broadcast(&sg->cond);
+
+            pthread_mutex_unlock(&sg->lock);
+            finish_file(sg, fd);
+            pthread_mutex_lock(&sg->lock);
+            continue;
+        }
+
+        if ( sg->quit ) { break; }
+        pthread_cond_wait(&sg->cond, &sg->lock);
+    }
+    pthread_mutex_unlock(&sg->lock);
+
+    return NULL;
+}
+
+int
+segments_next ( struct segments *sg, struct segment *seg ) {
+    int ok;
+
+    pthread_mutex_lock(&sg->lock);
+    while ( sg->spare_ready == 0 && sg->spare_errno == 0 ) {
+        pthread_cond_wait(&sg->cond, &sg->lock);
+    }
+
+    ok = sg->spare_ready;
+    if ( ok ) {
+        *seg = sg->spare;
+        sg->spare_ready = 0;
+        pthread_cond_broadcast(&sg->cond);
+    } else {
+        errno = sg->spare_errno;
+    }
+    pthread_mutex_unlock(&sg->lock);
+
+    return ok;
+}
+
+void
+segments_retire ( struct segments *sg, int fd ) {
+    pthread_mutex_lock(&sg->lock);
+    while ( sg->nretiring == RETIRE_MAX ) {
+        pthread_cond_wait(&sg->cond, &sg->lock);
+    }
+    sg->retiring[sg->nretiring++] = fd;
+    pthread_cond_broadcast(&sg->cond);
+    pthread_mutex_unlock(&sg->lock);
+}
+
+void
+segments_destroy ( struct segments *sg ) {
+    if ( sg == NULL ) { return; }
+
+    if ( sg->running ) {
+        pthread_mutex_lock(&sg->lock);
+        sg->quit = 1;
+        pthread_cond_broadcast(&sg->cond);
+        pthread_mutex_unlock(&sg->lock);
+        pthread_join(sg->thread, NULL);
+    }
+
+    /* the spare was never written to */
+    if ( sg->spare_ready ) {
+        close(sg->spare.fd);
+        unlink(sg->spare.name);
+        if ( sg->spare.companion_fd >= 0 ) {
+            char name[PATH_MAX + 16];
+            close(sg->spare.companion_fd);
+            snprintf( name, sizeof(name), "%s%s", sg->spare.name, sg->companion );
+            unlink(name);
+        }
+    }
+
+    pthread_mutex_destroy(&sg->lock);
+    pthread_cond_destroy(&sg->cond);
+    free(sg->base);
+    free(sg->ext);
+    free(sg->companion);
+    free(sg);
+}
+
+struct segments *
+segments_create ( const char *path, const char *companion, off_t prealloc ) {
+    struct segments *sg = calloc(1, sizeof(struct segments));
+    if ( sg == NULL ) { return NULL; }
+
+    /* the number goes before an extension in the last path component */
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    if ( dot == NULL || dot == path || (slash && dot < slash) ) { dot = path + strlen(path); }
+
+    sg->base = strndup( path, dot - path );
+    sg->ext = strdup(dot);
+    sg->companion = companion ? strdup(companion) : NULL;
+    sg->prealloc = prealloc;
+    pthread_mutex_init(&sg->lock, NULL);
+    pthread_cond_init(&sg->cond, NULL);
+
+    if ( sg->base == NULL || sg->ext == NULL || (companion && sg->companion == NULL) ) {
+        segments_destroy(sg);
+        return NULL;
+    }
+
+    if ( pthread_create( &sg->thread, NULL, rotate, sg ) != 0 ) {
+        fprintf( stderr, "Unable to start segment rotation thread\n" );
+        segments_destroy(sg);
+        return NULL;
+    }
+    sg->running = 1;
+
+    return sg;
+}
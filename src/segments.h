@@ -0,0 +1,36 @@
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+
+#include <limits.h>      /* PATH_MAX */
+#include <sys/types.h>   /* off_t */
+
+/* Rotation for recordings split into a file every so many seconds. */
+/* path "rec.mkv" becomes rec-0000.mkv, rec-0001.mkv and so on. A thread */
+/* of its own keeps the next file opened and preallocated before it is */
+/* needed, and trims, syncs and closes the finished ones, so a writer */
+/* switching files only ever swaps descriptors. */
+struct segments;
+
+struct segment {
+    int          fd;
+    int          companion_fd;   /* -1 without a companion suffix */
+    unsigned int number;
+    char         name[PATH_MAX];
+};
+
+/* companion, if not NULL, is a suffix for a second file opened alongside */
+/* each segment (e.g. ".idx"). prealloc bytes are reserved in each file. */
+struct segments *segments_create ( const char *path, const char *companion,
+    off_t prealloc );
+
+/* The next segment, normally ready and waiting. 0 if it couldn't be */
+/* opened, with errno set. */
+int segments_next ( struct segments *sg, struct segment *seg );
+
+/* hand over a finished file to be synced and closed */
+void segments_retire ( struct segments *sg, int fd );
+
+/* finish every retired file and remove the unused spare */
+void segments_destroy ( struct segments *sg );
+
+#endif
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>       /* errno */
+#include <fcntl.h>       /* O_* */
+#include <limits.h>      /* INT_MAX */
+#include <memory.h>      /* memcpy */
+#include <stdatomic.h>
+#include <time.h>        /* timespec */
+#include <unistd.h>      /* ftruncate */
+#include <sys/mman.h>    /* shm_open */
+#include <sys/stat.h>    /* fstat */
+#include <sys/syscall.h> /* SYS_futex */
+#include <linux/futex.h>
+
+#include "shmbus.h"
+
+#define SHMBUS_MAGIC   0x53554243u /* "CBUS" */
+#define SHMBUS_VERSION 2
+#define SHMBUS_SLOTS   8
+#define PAGE_SIZE_     4096
+
+/* first page of the shared object */
+struct header {
+    uint32_t           magic;       /* written last by the publisher */
+    uint32_t           version;
+    struct shmbus_info info;
+    uint64_t           data_offset; /* from the start of the object to slot 0 */
+    uint64_t           slot_stride; /* bytes between slot data areas */
+
+    _Alignas(64) _Atomic uint64_t head;  /* frames published so far */
+    _Alignas(64) _Atomic uint32_t futex; /* bumped on every publish */
+    _Atomic uint32_t   waiters;     /* readers asleep (or about to be) on futex */
+};
+
+/* Frame n lives in slot n % slots. lock is 2n+1 while frame n is being */
+/* written and 2n+2 once it is complete. */
+struct slot {
+    _Alignas(64) _Atomic uint64_t lock;
+    uint64_t frame;
+    uint32_t sequence;
+    uint32_t bytesused;
+    int64_t  timestamp_us;
+};
+
+struct shmbus {
+    struct header *hdr;
+    struct slot   *slots;
+    uint8_t       *data;
+    size_t         size;
+    int            publisher;
+    uint64_t       next;        /* next frame to publish or read */
+    struct header *ctl;         /* reader - the header mapped writable, for waiters */
+    char          *name;        /* for shm_unlink */
+};
+
+static size_t
+round_page ( size_t n ) {
+    return (n + PAGE_SIZE_ - 1) / PAGE_SIZE_ * PAGE_SIZE_;
+}
+
+static const uint8_t *
+slot_data ( const struct shmbus *bus, uint64_t n ) {
+    return bus->data + (n % bus->hdr->info.slots) * bus->hdr->slot_stride;
+}
+
+static int
+futex ( _Atomic uint32_t *addr, int op, uint32_t val, const struct timespec *timeout ) {
+    return syscall( SYS_futex, (uint32_t *) addr, op, val, timeout, NULL, 0 );
+}
+
+struct shmbus *
+shmbus_create ( const char *name, const struct shmbus_info *info ) {
+    struct shmbus *bus = calloc(1, sizeof(struct shmbus));
+    if ( bus == NULL ) { return NULL; }
+
+    struct shmbus_info layout = *info;
+    if ( layout.slots == 0 ) { layout.slots = SHMBUS_SLOTS; }
+
+    size_t meta = round_page( sizeof(struct header) +
+        layout.slots * sizeof(struct slot) );
+    size_t stride = round_page( layout.slot_size );
+    size_t size = meta + stride * layout.slots;
+    bus->name = strdup(name);
+    if ( bus->name == NULL ) {
+        fprintf( stderr, "Out of memory\n" );
+        shmbus_close(bus);
+        return NULL;
+    }
+
+    /* frames are the camera's, so for this user only */
+    int fd = shm_open( name, O_RDWR | O_CREAT, 0600 );
+    if ( fd < 0 ) {
+        perror(name);
+        shmbus_close(bus);
+        return NULL;
+    }
+
+    /* throw away whatever a previous run left behind */
+    if ( ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0 ) {
+        perror(name);
+        close(fd);
+        shmbus_close(bus);
+        return NULL;
+    }
+
+    void *map = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close(fd);
+    if ( map == MAP_FAILED ) {
+        perror(name);
+        shmbus_close(bus);
+        return NULL;
+    }
+
+    bus->size = size;
+    bus->hdr = map;
+    bus->slots = (struct slot *) (bus->hdr + 1);
+    bus->data = (uint8_t *) map + meta;
+    bus->publisher = 1;
+
+    bus->hdr->version = SHMBUS_VERSION;
+    bus->hdr->info = layout;
+    bus->hdr->data_offset = meta;
+    bus->hdr->slot_stride = stride;
+    atomic_store_explicit( (_Atomic uint32_t *) &bus->hdr->magic, SHMBUS_MAGIC,
+        memory_order_release );
+
+    return bus;
+}
+
+int
+shmbus_publish ( struct shmbus *bus, const void *data, size_t bytesused,
+    uint32_t sequence, int64_t timestamp_us ) {
+    /* half a frame is no use to anyone */
+    if ( bytesused > bus->hdr->info.slot_size ) { return 0; }
+
+    uint64_t n = bus->next++;
+    struct slot *s = &bus->slots[n % bus->hdr->info.slots];
+
+    /* readers that see an odd lock, or a different one afterwards, retry */
+    atomic_store_explicit( &s->lock, 2*n + 1, memory_order_relaxed );
+    atomic_thread_fence(memory_order_release);
+
+    s->frame = n;
+    s->sequence = sequence;
+    s->bytesused = bytesused;
+    s->timestamp_us = timestamp_us;
+    memcpy( (uint8_t *) slot_data(bus, n), data, bytesused );
+
+    atomic_store_explicit( &s->lock, 2*n + 2, memory_order_release );
+    atomic_store_explicit( &bus->hdr->head, n + 1, memory_order_release );
+
+    /* Readers count themselves in before they check head and sleep, and */
+    /* this bump comes before waiters is read, so either they see the new */
+    /* futex value and don't sleep or we see them and wake them. */
+    atomic_fetch_add( &bus->hdr->futex, 1 );
+    if ( atomic_load( &bus->hdr->waiters ) ) {
+        futex( &bus->hdr->futex, FUTEX_WAKE, INT_MAX, NULL );
+    }
+
+    return 1;
+}
+
+struct shmbus *
+shmbus_open ( const char *name ) {
+    struct stat st;
+    struct shmbus *bus = calloc(1, sizeof(struct shmbus));
+    if ( bus == NULL ) { return NULL; }
+
+    int fd = shm_open( name, O_RDWR, 0 );
+    if ( fd < 0 ) {
+        free(bus);
+        return NULL;
+    }
+
+    if ( fstat(fd, &st) < 0 || (size_t) st.st_size < PAGE_SIZE_ ) {
+        close(fd);
+        free(bus);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    /* frames read-only, and the header page again so we can say when */
+    /* we are waiting */
+    bus->size = st.st_size;
+    void *map = mmap( NULL, bus->size, PROT_READ, MAP_SHARED, fd, 0 );
+    void *ctl = mmap( NULL, PAGE_SIZE_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close(fd);
+    if ( map == MAP_FAILED || ctl == MAP_FAILED ) {
+        if ( map != MAP_FAILED ) { munmap(map, bus->size); }
+        if ( ctl != MAP_FAILED ) { munmap(ctl, PAGE_SIZE_); }
+        free(bus);
+        return NULL;
+    }
+    bus->ctl = ctl;
+
+    bus->hdr = map;
+
+    /* publisher may still be setting up */
+    uint32_t magic = atomic_load_explicit(
+        (_Atomic uint32_t *) &bus->hdr->magic, memory_order_acquire );
+    if ( magic != SHMBUS_MAGIC || bus->hdr->version != SHMBUS_VERSION ||
+        bus->hdr->data_offset + bus->hdr->slot_stride * bus->hdr->info.slots
+            > bus->size ) {
+        munmap(map, bus->size);
+        munmap(ctl, PAGE_SIZE_);
+        free(bus);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    bus->slots = (struct slot *) (bus->hdr + 1);
+    bus->data = (uint8_t *) map + bus->hdr->data_offset;
+    bus->next = atomic_load_explicit( &bus->hdr->head, memory_order_acquire );
+
+    return bus;
+}
+
+void
+shmbus_get_info ( const struct shmbus *bus, struct shmbus_info *info ) {
+    *info = bus->hdr->info;
+}
+
+/* read frame n's descriptor, 0 if it isn't (or is no longer) in its slot */
+static int
+read_slot ( const struct shmbus *bus, uint64_t n, struct shmbus_frame *f ) {
+    const struct slot *s = &bus->slots[n % bus->hdr->info.slots];
+    uint64_t lock = atomic_load_explicit( &s->lock, memory_order_acquire );
+
+    if ( lock != 2*n + 2 ) { return 0; }
+
+    f->frame = s->frame;
+    f->sequence = s->sequence;
+    f->bytesused = s->bytesused;
+    f->timestamp_us = s->timestamp_us;
+    f->data = slot_data(bus, n);
+    f->lock = lock;
+
+    return shmbus_valid(bus, f);
+}
+
+int
+shmbus_latest ( struct shmbus *bus, struct shmbus_frame *f ) {
+    for (;;) {
+        uint64_t head = atomic_load_explicit( &bus->hdr->head, memory_order_acquire );
+        if ( head == 0 ) { return 0; }
+
+        /* can only fail if the publisher lapped us, so just go again */
+        if ( read_slot(bus, head - 1, f) ) {
+            bus->next = head;
+            return 1;
+        }
+    }
+}
+
+int
+shmbus_next ( struct shmbus *bus, struct shmbus_frame *f, uint64_t *dropped ) {
+    for (;;) {
+        uint64_t head = atomic_load_explicit( &bus->hdr->head, memory_order_acquire );
+        if ( bus->next >= head ) { return 0; }
+
+        /* the oldest slot may already be in the middle of a rewrite */
+        if ( head - bus->next >= bus->hdr->info.slots ) {
+            if ( dropped ) { *dropped += head - 1 - bus->next; }
+            bus->next = head - 1;
+        }
+
+        if ( read_slot(bus, bus->next, f) ) {
+            bus->next++;
+            return 1;
+        }
+    }
+}
+
+int
+shmbus_valid ( const struct shmbus *bus, const struct shmbus_frame *f ) {
+    const struct slot *s = &bus->slots[f->frame % bus->hdr->info.slots];
+
+    /* everything read from the frame so far happens before this check */
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit( &s->lock, memory_order_relaxed ) == f->lock;
+}
+
+int
+shmbus_wait ( struct shmbus *bus, int timeout_ms ) {
+    struct timespec ts, *timeout = NULL;
+
+    if ( timeout_ms >= 0 ) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        timeout = &ts;
+    }
+
+    /* counted in before looking, see shmbus_publish */
+    atomic_fetch_add( &bus->ctl->waiters, 1 );
+
+    uint32_t seen = atomic_load( &bus->hdr->futex );
+    if ( atomic_load( &bus->hdr->head ) <= bus->next ) {
+        futex( &bus->hdr->futex, FUTEX_WAIT, seen, timeout );
+    }
+
+    atomic_fetch_sub( &bus->ctl->waiters, 1 );
+
+    return atomic_load( &bus->hdr->head ) > bus->next;
+}
+
+void
+shmbus_close ( struct shmbus *bus ) {
+    if ( bus == NULL ) { return; }
+
+    if ( bus->size ) { munmap(bus->hdr, bus->size); }
+    if ( bus->ctl ) { munmap(bus->ctl, PAGE_SIZE_); }
+    if ( bus->publisher && bus->name ) { shm_unlink(bus->name); }
+    free(bus->name);
+    free(bus);
+}
@@ -0,0 +1,71 @@
+#ifndef SHMBUS_H
+#define SHMBUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Shared memory frame bus. One publisher writes every frame into a ring */
+/* of slots in a POSIX shared memory object; any number of local readers */
+/* map the frames read-only and look at them in place. Each slot is      */
+/* guarded by a sequence lock, so readers never block the publisher and  */
+/* never make a system call unless they choose to sleep in shmbus_wait.  */
+/* The publisher only wakes the bus when a reader is asleep on it.       */
+/*                                                                       */
+/* The object is created mode 0600, so readers run as the same user.     */
+/*                                                                       */
+/* Reading is zero-copy: a frame's data points into the ring and can be  */
+/* overwritten once the publisher laps around, so check shmbus_valid     */
+/* after using it and throw away whatever was computed if it fails.      */
+/*                                                                       */
+/* This file is all a reader needs - build it into libshmbus.a with      */
+/* "make lib" and link against that.                                      */
+
+struct shmbus;
+
+struct shmbus_info {
+    uint32_t pixelformat;    /* V4L2 fourcc */
+    uint32_t width, height;
+    uint32_t stride;         /* bytes per line of the first plane */
+    uint32_t slot_size;      /* largest frame a slot holds */
+    uint32_t slots;
+};
+
+struct shmbus_frame {
+    const void *data;
+    size_t      bytesused;
+    uint64_t    frame;        /* position on the bus, counts from 0 */
+    uint32_t    sequence;     /* V4L2 sequence number */
+    int64_t     timestamp_us; /* capture time */
+
+    uint64_t    lock;         /* private - seqlock value when read */
+};
+
+/* publisher */
+struct shmbus *shmbus_create ( const char *name, const struct shmbus_info *info );
+/* 0 if the frame is bigger than slot_size - it is dropped, not cut short */
+int shmbus_publish ( struct shmbus *bus, const void *data, size_t bytesused,
+    uint32_t sequence, int64_t timestamp_us );
+
+/* reader */
+struct shmbus *shmbus_open ( const char *name );
+void shmbus_get_info ( const struct shmbus *bus, struct shmbus_info *info );
+
+/* newest complete frame, 0 if nothing has been published yet */
+int shmbus_latest ( struct shmbus *bus, struct shmbus_frame *f );
+
+/* frame after the last one returned to this reader, 0 if there isn't one */
+/* yet. A reader that falls a whole ring behind skips to the newest frame */
+/* and the frames it missed are added to *dropped if dropped is not NULL. */
+int shmbus_next ( struct shmbus *bus, struct shmbus_frame *f, uint64_t *dropped );
+
+/* 1 if f's data has not been overwritten since it was returned */
+int shmbus_valid ( const struct shmbus *bus, const struct shmbus_frame *f );
+
+/* sleep until a frame newer than the last one returned is published, or */
+/* timeout_ms passes (-1 waits forever). Returns 1 if there is a new frame. */
+int shmbus_wait ( struct shmbus *bus, int timeout_ms );
+
+/* both - the publisher also removes the shared memory object */
+void shmbus_close ( struct shmbus *bus );
+
+#endif
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>       /* errno */
+#include <fcntl.h>       /* open */
+#include <memory.h>      /* memcpy */
+#include <pthread.h>
+#include <time.h>        /* strftime */
+#include <unistd.h>      /* write */
+
+#include <linux/videodev2.h>
+
+#include "mjpeg.h"
+#include "snapshot.h"
+
+#define JPEG_QUALITY 90
+
+struct snapshot {
+    struct frame_format   format;
+
+    /* capture thread -> whoever asks, the newest frame, -1 for none */
+    struct frame          frames[FRAME_MAX_BUFFERS];
+    atomic_int            latest;
+
+    /* one JPEG made at a time, and the last one kept */
+    pthread_mutex_t       lock;
+    struct mjpeg_encoder *encoder;
+    struct snapshot_jpeg *cached;
+
+    /* saves asked for with snapshot_save_later, done on their own thread */
+    pthread_t             saver;
+    int                   saving;      /* saver thread is running */
+    pthread_mutex_t       save_lock;
+    pthread_cond_t        save_cond;
+    const char           *save_prefix;
+    int                   saves;       /* waiting to be done */
+    int                   quit;
+};
+
+void
+snapshot_update ( struct snapshot *snap, const struct frame *f ) {
+    frame_ref(f);
+    snap->frames[f->index] = *f;
+
+    int old = atomic_exchange( &snap->latest, f->index );
+    if ( old >= 0 ) { frame_unref(&snap->frames[old]); }
+}
+
+void
+snapshot_put ( struct snapshot_jpeg *jpeg ) {
+    if ( jpeg == NULL ) { return; }
+    if ( atomic_fetch_sub( &jpeg->refs, 1 ) == 1 ) {
+        free(jpeg->data);
+        free(jpeg);
+    }
+}
+
+static struct snapshot_jpeg *
+make_jpeg ( struct snapshot *snap, const struct frame *f ) {
+    const struct frame_format *fmt = &snap->format;
+    struct snapshot_jpeg *jpeg = calloc(1, sizeof(struct snapshot_jpeg));
+    if ( jpeg == NULL ) { return NULL; }
+
+    atomic_init(&jpeg->refs, 1);
+    jpeg->sequence = f->sequence;
+    jpeg->timestamp_us = frame_time_us(f);
+
+    /* the camera's JPEG goes out as it came */
+    if ( fmt->pixelformat == V4L2_PIX_FMT_MJPEG ) {
+        jpeg->data = malloc(f->bytesused);
+        if ( jpeg->data ) {
+            memcpy( jpeg->data, f->data, f->bytesused );
+            jpeg->size = f->bytesused;
+        }
+    } else {
+        size_t cap = 0;
+        jpeg->size = mjpeg_encode( snap->encoder, fmt->pixelformat, f->data,
+            fmt->stride, fmt->width, fmt->height, &jpeg->data, &cap );
+    }
+
+    if ( jpeg->size == 0 ) {
+        snapshot_put(jpeg);
+        return NULL;
+    }
+
+    return jpeg;
+}
+
+struct snapshot_jpeg *
+snapshot_get ( struct snapshot *snap ) {
+    struct snapshot_jpeg *jpeg;
+
+    pthread_mutex_lock(&snap->lock);
+
+    /* Take the newest frame over while it's looked at, so the capture */
+    /* thread can't let go of it underneath us. Anyone else asking waits */
+    /* on the lock, so -1 here means nothing new since the last time. */
+    int index = atomic_exchange( &snap->latest, -1 );
+    if ( index >= 0 ) {
+        const struct frame *f = &snap->frames[index];
+
+        if ( snap->cached == NULL || snap->cached->sequence != f->sequence ||
+            snap->cached->timestamp_us != frame_time_us(f) ) {
+            jpeg = make_jpeg(snap, f);
+            if ( jpeg ) {
+                snapshot_put(snap->cached);
+                snap->cached = jpeg;
+            }
+        }
+
+        /* give it back unless a newer one has turned up */
+        int none = -1;
+        if ( atomic_compare_exchange_strong( &snap->latest, &none, index ) == 0 ) {
+            frame_unref(f);
+        }
+    }
+
+    jpeg = snap->cached;
+    if ( jpeg ) { atomic_fetch_add( &jpeg->refs, 1 ); }
+
+    pthread_mutex_unlock(&snap->lock);
+
+    return jpeg;
+}
+
+int
+snapshot_save ( struct snapshot *snap, const char *prefix ) {
+    char name[256], stamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    int ok = 1;
+
+    struct snapshot_jpeg *jpeg = snapshot_get(snap);
+    if ( jpeg == NULL ) {
+        fprintf( stderr, "No frame to take a snapshot of\n" );
+        return 0;
+    }
+
+    localtime_r(&now, &tm);
+    strftime( stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm );
+    snprintf( name, sizeof(name), "%s-%s-%u.jpg", prefix, stamp, jpeg->sequence );
+
+    int fd = open( name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( fd < 0 ||
+        write( fd, jpeg->data, jpeg->size ) != (ssize_t) jpeg->size ) {
+        perror(name);
+        ok = 0;
+    } else {
+        fprintf( stderr, "Saved frame %u to %s\n", jpeg->sequence, name );
+    }
+    if ( fd >= 0 ) { close(fd); }
+
+    snapshot_put(jpeg);
+    return ok;
+}
+
+static void *
+saver ( void *arg ) {
+    struct snapshot *snap = arg;
+
+    pthread_mutex_lock(&snap->save_lock);
+    for (;;) {
+        while ( snap->saves == 0 && snap->quit == 0 ) {
+            pthread_cond_wait( &snap->save_cond, &snap->save_lock );
+        }
+        if ( snap->saves == 0 ) { break; }
+
+        const char *prefix = snap->save_prefix;
+        snap->saves--;
+
+        pthread_mutex_unlock(&snap->save_lock);
+        snapshot_save(snap, prefix);
+        pthread_mutex_lock(&snap->save_lock);
+    }
+    pthread_mutex_unlock(&snap->save_lock);
+
+    return NULL;
+}
+
+void
+snapshot_save_later ( struct snapshot *snap, const char *prefix ) {
+    pthread_mutex_lock(&snap->save_lock);
+    snap->save_prefix = prefix;
+    snap->saves++;
+    pthread_cond_signal(&snap->save_cond);
+    pthread_mutex_unlock(&snap->save_lock);
+}
+
+void
+snapshot_destroy ( struct snapshot *snap ) {
+    if ( snap == NULL ) { return; }
+
+    /* saves already asked for still happen */
+    if ( snap->saving ) {
+        pthread_mutex_lock(&snap->save_lock);
+        snap->quit = 1;
+        pthread_cond_signal(&snap->save_cond);
+        pthread_mutex_unlock(&snap->save_lock);
+        pthread_join(snap->saver, NULL);
+    }
+
+    int index = atomic_exchange( &snap->latest, -1 );
+    if ( index >= 0 ) { frame_unref(&snap->frames[index]); }
+
+    snapshot_put(snap->cached);
+    mjpeg_encoder_destroy(snap->encoder);
+    pthread_cond_destroy(&snap->save_cond);
+    pthread_mutex_destroy(&snap->save_lock);
+    pthread_mutex_destroy(&snap->lock);
+    free(snap);
+}
+
+struct snapshot *
+snapshot_create ( const struct frame_format *fmt ) {
+    struct snapshot *snap = calloc(1, sizeof(struct snapshot));
+    if ( snap == NULL ) { return NULL; }
+
+    snap->format = *fmt;
+    atomic_init(&snap->latest, -1);
+    pthread_mutex_init(&snap->lock, NULL);
+    pthread_mutex_init(&snap->save_lock, NULL);
+    pthread_cond_init(&snap->save_cond, NULL);
+
+    if ( fmt->pixelformat != V4L2_PIX_FMT_MJPEG ) {
+        snap->encoder = mjpeg_encoder_create(JPEG_QUALITY);
+        if ( snap->encoder == NULL ) {
+            snapshot_destroy(snap);
+            return NULL;
+        }
+    }
+
+    if ( pthread_create( &snap->saver, NULL, saver, snap ) != 0 ) {
+        fprintf( stderr, "Unable to start snapshot thread\n" );
+        snapshot_destroy(snap);
+        return NULL;
+    }
+    snap->saving = 1;
+
+    return snap;
+}
@@ -0,0 +1,43 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "frame.h"
+
+/* The newest frame as a JPEG, for stills. The capture thread hands over */
+/* every frame, which only swaps a reference. Asking for a JPEG makes */
+/* one from the newest frame - the camera's own bytes for MJPEG, an */
+/* encode for anything else - and keeps it, so however many ask for the */
+/* same frame it is only made once. */
+struct snapshot;
+
+struct snapshot_jpeg {
+    atomic_int     refs;
+    uint32_t       sequence;
+    int64_t        timestamp_us;
+    unsigned char *data;
+    size_t         size;
+};
+
+struct snapshot *snapshot_create ( const struct frame_format *fmt );
+void snapshot_destroy ( struct snapshot *snap );
+
+/* capture thread - never blocks */
+void snapshot_update ( struct snapshot *snap, const struct frame *f );
+
+/* any thread - the newest frame as a JPEG, NULL before the first frame */
+/* or if it couldn't be made. Give it back with snapshot_put. */
+struct snapshot_jpeg *snapshot_get ( struct snapshot *snap );
+void snapshot_put ( struct snapshot_jpeg *jpeg );
+
+/* write the newest frame to prefix-YYYYMMDD-HHMMSS-sequence.jpg */
+int snapshot_save ( struct snapshot *snap, const char *prefix );
+
+/* snapshot_save on the snapshot's own thread, for callers that mustn't */
+/* wait on an encode or the disk. prefix has to outlive the snapshot. */
+void snapshot_save_later ( struct snapshot *snap, const char *prefix );
+
+#endif
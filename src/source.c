@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>       /* errno */
+#include <memory.h>      /* memset */
+#include <string.h>      /* strcmp */
+#include <unistd.h>      /* close */
+#include <sys/eventfd.h>
+#include <sys/mman.h>    /* mmap */
+#include <sys/stat.h>    /* stat */
+#include <sys/timerfd.h>
+
+#include "latency.h"
+#include "pattern.h"
+#include "replay.h"
+#include "source.h"
+
+struct source {
+    struct source_reader *reader;
+    int       fast;
+    int       fd;            /* timerfd, or an eventfd kept readable when fast */
+
+    int       nbufs;
+    void     *mem[FRAME_MAX_BUFFERS];
+    size_t    len;
+
+    /* buffers queued, in the order they will be filled */
+    int       queue[FRAME_MAX_BUFFERS];
+    unsigned  head, tail;
+
+    /* the next frame, read into the buffer at the head of the queue */
+    int       loaded;
+    size_t    size;
+    int64_t   frame_us;
+
+    int64_t   base_us;       /* clock when the first frame went out, 0 before */
+    int64_t   first_us;      /* and that frame's own timestamp */
+    uint32_t  sequence;
+    int       ended;
+};
+
+int
+source_handles ( const char *path ) {
+    struct stat st;
+
+    if ( strcmp( path, "pattern" ) == 0 ) { return 1; }
+    return stat( path, &st ) == 0 && S_ISREG(st.st_mode);
+}
+
+const struct frame_format *
+source_format ( const struct source *src ) {
+    return &src->reader->format;
+}
+
+void *
+source_buffer ( const struct source *src, int index, size_t *len ) {
+    *len = src->len;
+    return src->mem[index];
+}
+
+int
+source_fd ( const struct source *src ) {
+    return src->fd;
+}
+
+/* make the descriptor readable at clock time us, 0 for straight away */
+static void
+wake_at ( struct source *src, int64_t us ) {
+    struct itimerspec its;
+
+    if ( src->fast ) { return; }
+
+    memset( &its, 0, sizeof(struct itimerspec) );
+    if ( us > 0 ) {
+        its.it_value.tv_sec = us / 1000000;
+        its.it_value.tv_nsec = (us % 1000000) * 1000;
+    } else {
+        its.it_value.tv_nsec = 1;
+    }
+
+    /* absolute on the clock latency_now_us reads */
+    if ( timerfd_settime( src->fd, us > 0 ? TFD_TIMER_ABSTIME : 0, &its, NULL ) < 0 ) {
+        perror("timerfd_settime");
+    }
+}
+
+int
+source_queue ( struct source *src, int index ) {
+    if ( index < 0 || index >= src->nbufs || src->tail - src->head >= (unsigned) src->nbufs ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* nothing was waiting on the timer, so nothing would wake the reader */
+    if ( src->head == src->tail ) { wake_at(src, 0); }
+
+    src->queue[src->tail++ % FRAME_MAX_BUFFERS] = index;
+    return 0;
+}
+
+int
+source_dequeue ( struct source *src, struct v4l2_buffer *buf ) {
+    uint64_t expirations;
+
+    if ( src->fast == 0 ) {
+        /* quiet the timer until it is needed again */
+        if ( read( src->fd, &expirations, sizeof(expirations) ) < 0 && errno != EAGAIN ) {
+            perror("timerfd");
+        }
+    }
+
+    if ( src->ended ) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    if ( src->head == src->tail ) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    int index = src->queue[src->head % FRAME_MAX_BUFFERS];
+
+    if ( src->loaded == 0 ) {
+        int got = src->reader->read( src->reader, src->mem[index], src->len,
+            &src->size, &src->frame_us );
+        if ( got <= 0 ) {
+            src->ended = 1;
+            errno = EPIPE;
+            return -1;
+        }
+        src->loaded = 1;
+    }
+
+    int64_t now = latency_now_us();
+
+    /* frames go out as far apart as they were recorded */
+    if ( src->base_us == 0 ) {
+        src->base_us = now;
+        src->first_us = src->frame_us;
+    } else if ( src->fast == 0 ) {
+        int64_t due = src->base_us + (src->frame_us - src->first_us);
+        if ( now < due ) {
+            wake_at(src, due);
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    src->head++;
+    src->loaded = 0;
+
+    memset( buf, 0, sizeof(struct v4l2_buffer) );
+    buf->index = index;
+    buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf->memory = V4L2_MEMORY_MMAP;
+    buf->bytesused = src->size;
+    buf->field = V4L2_FIELD_NONE;
+    buf->sequence = src->sequence++;
+    buf->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    buf->timestamp.tv_sec = now / 1000000;
+    buf->timestamp.tv_usec = now % 1000000;
+    buf->length = src->len;
+
+    return 0;
+}
+
+void
+source_destroy ( struct source *src ) {
+    if ( src == NULL ) { return; }
+
+    for ( int i=0; i<src->nbufs; i++ ) {
+        if ( src->mem[i] ) { munmap( src->mem[i], src->len ); }
+    }
+    if ( src->fd >= 0 ) { close(src->fd); }
+    if ( src->reader ) { src->reader->close(src->reader); }
+    free(src);
+}
+
+struct source *
+source_open ( const char *path, const struct source_request *req, int nbufs,
+    int fast ) {
+    struct source *src = calloc(1, sizeof(struct source));
+    if ( src == NULL ) { return NULL; }
+
+    src->fd = -1;
+    src->fast = fast;
+
+    if ( strcmp( path, "pattern" ) == 0 ) {
+        src->reader = pattern_open(req);
+    } else {
+        src->reader = replay_open(path, req);
+    }
+    if ( src->reader == NULL ) {
+        source_destroy(src);
+        return NULL;
+    }
+
+    /* fast never waits, so its descriptor is left readable for good */
+    if ( fast ) {
+        src->fd = eventfd( 1, EFD_NONBLOCK | EFD_CLOEXEC );
+    } else {
+        src->fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    }
+    if ( src->fd < 0 ) {
+        perror("source");
+        source_destroy(src);
+        return NULL;
+    }
+
+    /* page aligned and never swapped out from under a reader */
+    if ( nbufs > FRAME_MAX_BUFFERS ) { nbufs = FRAME_MAX_BUFFERS; }
+    src->len = src->reader->format.sizeimage;
+    for ( int i=0; i<nbufs; i++ ) {
+        src->mem[i] = mmap( NULL, src->len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0 );
+        if ( src->mem[i] == MAP_FAILED ) {
+            perror("mmap");
+            src->mem[i] = NULL;
+            source_destroy(src);
+            return NULL;
+        }
+        src->nbufs++;
+        source_queue( src, i );
+    }
+
+    return src;
+}
@@ -0,0 +1,59 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+
+/* Frames from somewhere other than a V4L2 device - a generated test */
+/* pattern, or a recording played back - dressed up as a capture device */
+/* so the rest of the pipeline can't tell the difference. A source owns */
+/* a set of buffers and hands them out through source_dequeue and */
+/* source_queue the way VIDIOC_DQBUF and VIDIOC_QBUF do, and has a */
+/* descriptor that polls readable when a frame may be ready. */
+/*                                                                  */
+/* Frames are paced by their own timestamps, or delivered as fast as */
+/* buffers come back when fast is set. Either way they are stamped with */
+/* CLOCK_MONOTONIC at delivery, like a camera's. */
+struct source;
+
+/* What to generate; recordings have a format of their own and ignore it, */
+/* but for a raw file without an index. */
+struct source_request {
+    uint32_t pixelformat;    /* V4L2 fourcc, 0 for YUYV */
+    int      width, height;
+    double   fps;
+};
+
+/* One backend - a format and the frames, one at a time, in order. */
+struct source_reader {
+    struct frame_format format;
+
+    /* Next frame into dst, which holds cap bytes. 1 with size and */
+    /* timestamp_us (from the start of the stream) set, 0 at the end, */
+    /* -1 on an error already reported. */
+    int  (*read) ( struct source_reader *r, void *dst, size_t cap,
+        size_t *size, int64_t *timestamp_us );
+    void (*close) ( struct source_reader *r );
+};
+
+/* 1 if path is for us rather than a V4L2 device: "pattern", or a file */
+int source_handles ( const char *path );
+
+struct source *source_open ( const char *path, const struct source_request *req,
+    int nbufs, int fast );
+void source_destroy ( struct source *src );
+
+const struct frame_format *source_format ( const struct source *src );
+void *source_buffer ( const struct source *src, int index, size_t *len );
+int source_fd ( const struct source *src );
+
+/* 0 with buf filled in, or -1 with errno EAGAIN when nothing is due yet */
+/* and EPIPE once the stream has ended. Every buffer starts out queued. */
+int source_dequeue ( struct source *src, struct v4l2_buffer *buf );
+int source_queue ( struct source *src, int index );
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <stdatomic.h>
+#include <string.h>      /* strdup */
+
+#include "trace.h"
+
+#define MAX_RINGS   8
+#define RING_SPANS  (1 << 16)   /* per thread, about 2MB */
+
+struct span {
+    const char *name;
+    int64_t     start_ns;
+    int64_t     end_ns;
+    uint32_t    frame;
+};
+
+struct trace_ring {
+    const char   *name;
+    unsigned long count;        /* spans ever recorded */
+    struct span  *spans;
+};
+
+struct trace {
+    char             *path;
+    int64_t           origin_ns;  /* trace time zero */
+    struct trace_ring rings[MAX_RINGS];
+    atomic_int        nrings;
+};
+
+void
+trace_record ( struct trace_ring *r, const char *name, int64_t start_ns,
+    int64_t end_ns, uint32_t frame ) {
+    struct span *sp = &r->spans[r->count++ % RING_SPANS];
+
+    sp->name = name;
+    sp->start_ns = start_ns;
+    sp->end_ns = end_ns;
+    sp->frame = frame;
+}
+
+struct trace_ring *
+trace_ring ( struct trace *t, const char *name ) {
+    if ( t == NULL ) { return NULL; }
+
+    int i = atomic_fetch_add( &t->nrings, 1 );
+    if ( i >= MAX_RINGS ) {
+        fprintf( stderr, "Out of trace rings, %s won't be traced\n", name );
+        return NULL;
+    }
+
+    struct trace_ring *r = &t->rings[i];
+    r->spans = calloc( RING_SPANS, sizeof(struct span) );
+    if ( r->spans == NULL ) {
+        fprintf( stderr, "Failed to allocate trace ring for %s\n", name );
+        return NULL;
+    }
+    r->name = name;
+
+    return r;
+}
+
+/* times in microseconds from the start of the trace, to the nanosecond */
+static void
+write_us ( FILE *f, const char *key, int64_t ns ) {
+    if ( ns < 0 ) {
+        fprintf( f, "\"%s\":-%lld.%03lld", key, (long long) -ns / 1000, (long long) -ns % 1000 );
+    } else {
+        fprintf( f, "\"%s\":%lld.%03lld", key, (long long) ns / 1000, (long long) ns % 1000 );
+    }
+}
+
+static int
+write_trace ( struct trace *t ) {
+    int nrings = atomic_load(&t->nrings);
+    unsigned long total = 0;
+    const char *sep = "";
+
+    if ( nrings > MAX_RINGS ) { nrings = MAX_RINGS; }
+
+    FILE *f = fopen( t->path, "w" );
+    if ( f == NULL ) {
+        perror(t->path);
+        return 0;
+    }
+
+    fprintf( f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+
+    for ( int i=0; i<nrings; i++ ) {
+        struct trace_ring *r = &t->rings[i];
+        if ( r->spans == NULL ) { continue; }
+
+        /* thread ids are just ring numbers, named for the viewer */
+        fprintf( f, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\","
+            "\"args\":{\"name\":\"%s\"}}", sep, i + 1, r->name );
+        sep = ",\n";
+
+        /* oldest first, which is where the next one would have gone */
+        unsigned long kept = r->count < RING_SPANS ? r->count : RING_SPANS;
+        for ( unsigned long n = r->count - kept; n < r->count; n++ ) {
+            const struct span *sp = &r->spans[n % RING_SPANS];
+
+            fprintf( f, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"name\":\"%s\",",
+                sep, i + 1, sp->name );
+            write_us( f, "ts", sp->start_ns - t->origin_ns );
+            fputc( ',', f );
+            write_us( f, "dur", sp->end_ns - sp->start_ns );
+            fprintf( f, ",\"args\":{\"frame\":%u}}", sp->frame );
+        }
+
+        if ( r->count > kept ) {
+            fprintf( stderr, "Trace of %s kept the last %lu of %lu spans\n",
+                r->name, kept, r->count );
+        }
+        total += kept;
+    }
+
+    fprintf( f, "\n]}\n" );
+
+    if ( fclose(f) != 0 ) {
+        perror(t->path);
+        return 0;
+    }
+
+    fprintf( stderr, "Wrote %lu trace spans to %s\n", total, t->path );
+    return 1;
+}
+
+int
+trace_destroy ( struct trace *t ) {
+    if ( t == NULL ) { return 1; }
+
+    int ok = write_trace(t);
+
+    for ( int i=0; i<MAX_RINGS; i++ ) { free(t->rings[i].spans); }
+    free(t->path);
+    free(t);
+
+    return ok;
+}
+
+struct trace *
+trace_create ( const char *path ) {
+    struct trace *t = calloc(1, sizeof(struct trace));
+    if ( t == NULL ) { return NULL; }
+
+    t->path = strdup(path);
+    if ( t->path == NULL ) {
+        free(t);
+        return NULL;
+    }
+    atomic_init( &t->nrings, 0 );
+    t->origin_ns = trace_clock();
+
+    return t;
+}
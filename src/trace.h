@@ -0,0 +1,55 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>        /* clock_gettime */
+
+/* Spans of time spent in each step of the frame pipeline, kept in memory */
+/* and written out as Chrome trace JSON (chrome://tracing, Perfetto) when */
+/* the trace is destroyed. */
+/*                                                                      */
+/* Every thread that traces gets a ring of its own and is the only one */
+/* to write to it, so recording a span is a few plain stores with no */
+/* locks or atomics. Rings keep the newest spans once they fill. The */
+/* trace must only be destroyed once every thread using it has stopped. */
+/*                                                                      */
+/* A NULL ring records nothing, so call sites needn't check whether */
+/* tracing is on. */
+struct trace;
+struct trace_ring;
+
+struct trace *trace_create ( const char *path );
+
+/* writes the trace to path and frees it, 1 if it was written */
+int trace_destroy ( struct trace *t );
+
+/* A ring for the calling thread, labelled name (a string that outlives */
+/* the trace) in the viewer. NULL if t is NULL or out of rings. */
+struct trace_ring *trace_ring ( struct trace *t, const char *name );
+
+/* name must outlive the trace too, frame is shown with the span */
+void trace_record ( struct trace_ring *r, const char *name, int64_t start_ns,
+    int64_t end_ns, uint32_t frame );
+
+static inline int64_t
+trace_clock ( void ) {
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* start of a span, or nothing much when r is NULL */
+static inline int64_t
+trace_now ( const struct trace_ring *r ) {
+    return r ? trace_clock() : 0;
+}
+
+/* a span from start, which came from trace_now, until now */
+static inline void
+trace_end ( struct trace_ring *r, const char *name, int64_t start, uint32_t frame ) {
+    if ( r == NULL ) { return; }
+    trace_record( r, name, start, trace_now(r), frame );
+}
+
+#endif
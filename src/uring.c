@@ -0,0 +1,133 @@
+#include <stdio.h>
+
+#include <errno.h>
+#include <memory.h>      /* memset */
+#include <stdatomic.h>
+#include <unistd.h>      /* syscall */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/* ring indices are shared with the kernel */
+#define load_acquire(p)     atomic_load_explicit( (_Atomic unsigned *) (p), memory_order_acquire )
+#define store_release(p, v) atomic_store_explicit( (_Atomic unsigned *) (p), (v), memory_order_release )
+
+static void *
+map_ring ( int fd, size_t size, off_t offset ) {
+    void *p = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset );
+    return p == MAP_FAILED ? NULL : p;
+}
+
+int
+uring_init ( struct uring *r, unsigned entries ) {
+    struct io_uring_params p;
+
+    memset( r, 0, sizeof(struct uring) );
+    memset( &p, 0, sizeof(struct io_uring_params) );
+
+    r->fd = syscall( __NR_io_uring_setup, entries, &p );
+    if ( r->fd < 0 ) { return 0; }
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* newer kernels put both rings in one mapping */
+    if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+        if ( r->cq_ring_size > r->sq_ring_size ) { r->sq_ring_size = r->cq_ring_size; }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = map_ring( r->fd, r->sq_ring_size, IORING_OFF_SQ_RING );
+    if ( r->sq_ring == NULL ) {
+        uring_exit(r);
+        return 0;
+    }
+
+    if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = map_ring( r->fd, r->cq_ring_size, IORING_OFF_CQ_RING );
+        if ( r->cq_ring == NULL ) {
+            uring_exit(r);
+            return 0;
+        }
+    }
+
+    r->sqes = map_ring( r->fd, r->sqes_size, IORING_OFF_SQES );
+    if ( r->sqes == NULL ) {
+        uring_exit(r);
+        return 0;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned *) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    return 1;
+}
+
+void
+uring_exit ( struct uring *r ) {
+    if ( r->sqes ) { munmap( r->sqes, r->sqes_size ); }
+    if ( r->cq_ring && r->cq_ring != r->sq_ring ) { munmap( r->cq_ring, r->cq_ring_size ); }
+    if ( r->sq_ring ) { munmap( r->sq_ring, r->sq_ring_size ); }
+    if ( r->fd >= 0 ) { close(r->fd); }
+    memset( r, 0, sizeof(struct uring) );
+    r->fd = -1;
+}
+
+struct io_uring_sqe *
+uring_get_sqe ( struct uring *r ) {
+    unsigned head = load_acquire(r->sq_head);
+    unsigned tail = *r->sq_tail + r->sq_pending;
+
+    if ( tail - head >= r->sq_entries ) { return NULL; }
+
+    unsigned i = tail & *r->sq_mask;
+    r->sq_array[i] = i;
+    r->sq_pending++;
+
+    memset( &r->sqes[i], 0, sizeof(struct io_uring_sqe) );
+    return &r->sqes[i];
+}
+
+int
+uring_submit ( struct uring *r, unsigned wait ) {
+    store_release( r->sq_tail, *r->sq_tail + r->sq_pending );
+    r->sq_pending = 0;
+
+    /* includes anything the kernel didn't take last time */
+    unsigned submit = *r->sq_tail - load_acquire(r->sq_head);
+
+    for (;;) {
+        int n = syscall( __NR_io_uring_enter, r->fd, submit, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+        if ( n >= 0 ) { return 1; }
+        if ( errno != EINTR ) {
+            perror("io_uring_enter");
+            return 0;
+        }
+    }
+}
+
+struct io_uring_cqe *
+uring_peek_cqe ( struct uring *r ) {
+    unsigned head = *r->cq_head;
+
+    if ( head == load_acquire(r->cq_tail) ) { return NULL; }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void
+uring_cqe_seen ( struct uring *r ) {
+    store_release( r->cq_head, *r->cq_head + 1 );
+}
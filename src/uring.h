@@ -0,0 +1,40 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+/* Just enough io_uring for one thread queueing writes, straight on the */
+/* system calls so there is no liburing to build against. Not thread safe. */
+struct uring {
+    int fd;
+
+    /* submission queue */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned  sq_entries;
+    unsigned  sq_pending;    /* sqes filled in but not yet submitted */
+
+    /* completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void   *sq_ring, *cq_ring;
+    size_t  sq_ring_size, cq_ring_size, sqes_size;
+};
+
+/* 0 if the kernel has no io_uring or won't let us use it */
+int uring_init ( struct uring *r, unsigned entries );
+void uring_exit ( struct uring *r );
+
+/* next free submission entry, zeroed, or NULL if the queue is full */
+struct io_uring_sqe *uring_get_sqe ( struct uring *r );
+
+/* submit everything queued and sleep until at least wait completions */
+/* are ready. Returns 0 on error. */
+int uring_submit ( struct uring *r, unsigned wait );
+
+/* oldest completion, or NULL. Hand it back with uring_cqe_seen. */
+struct io_uring_cqe *uring_peek_cqe ( struct uring *r );
+void uring_cqe_seen ( struct uring *r );
+
+#endif
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>       /* errno */
+#include <fcntl.h>       /* open */
+#include <memory.h>      /* memcpy */
+#include <pthread.h>
+#include <signal.h>      /* SIGPIPE */
+#include <stdatomic.h>
+#include <unistd.h>      /* write */
+#include <sys/eventfd.h>
+#include <sys/uio.h>     /* writev */
+
+#include <linux/videodev2.h>
+
+#include "convert.h"
+#include "y4m.h"
+
+/* frames waiting to be written - more than this and we drop */
+#define Y4M_DEPTH 4
+
+/* FRAME line, luma, and optionally both chroma planes per frame */
+#define IOV_PER_FRAME 4
+
+static const char frame_header[] = "FRAME\n";
+
+struct entry {
+    struct frame f;
+    uint8_t     *planes;     /* I420 copy of the frame where one is needed */
+};
+
+struct y4m {
+    struct sink         sink;
+    struct frame_format format;
+    char               *path;
+    int                 fd;
+    int                 chroma;      /* 0 for GREY */
+    size_t              luma_size, chroma_size;
+
+    pthread_t           thread;
+    int                 running;
+    atomic_int          quit;
+    int                 wake_fd;
+
+    /* capture thread adds at head, writer retires at tail */
+    struct entry        ring[Y4M_DEPTH];
+    atomic_uint         head;
+    atomic_uint         tail;
+    atomic_ulong        dropped;
+
+    /* writer thread only */
+    unsigned long       frames;
+    int                 failed;
+};
+
+static void
+push ( struct sink *sink, const struct frame *f ) {
+    struct y4m *y = (struct y4m *) sink;
+    unsigned int head = atomic_load_explicit( &y->head, memory_order_relaxed );
+    unsigned int tail = atomic_load_explicit( &y->tail, memory_order_acquire );
+    uint64_t one = 1;
+
+    if ( head - tail >= Y4M_DEPTH ) {
+        atomic_fetch_add( &y->dropped, 1 );
+        return;
+    }
+
+    frame_ref(f);
+    y->ring[head % Y4M_DEPTH].f = *f;
+    atomic_store_explicit( &y->head, head + 1, memory_order_release );
+
+    if ( write( y->wake_fd, &one, sizeof(one) ) < 0 ) { perror("eventfd"); }
+}
+
+/* Get a frame into I420 (or plain luma) and describe it in iov. The */
+/* luma plane is written straight out of the capture buffer when its */
+/* lines aren't padded. Returns the number of iovecs used. */
+static int
+prepare ( struct y4m *y, struct entry *e, struct iovec *iov ) {
+    const struct frame_format *fmt = &y->format;
+    const uint8_t *src = e->f.data;
+    uint8_t *u = e->planes + y->luma_size;
+    uint8_t *v = u + y->chroma_size;
+    int n = 0;
+
+    iov[n].iov_base = (void *) frame_header;
+    iov[n++].iov_len = sizeof(frame_header) - 1;
+
+    switch ( fmt->pixelformat ) {
+    case V4L2_PIX_FMT_YUYV:
+        convert_yuyv_i420( e->planes, fmt->width, u, v, fmt->width / 2,
+            src, fmt->stride, fmt->width, fmt->height );
+        iov[n].iov_base = e->planes;
+        break;
+    case V4L2_PIX_FMT_NV12:
+        convert_split_uv( u, v, fmt->width / 2, src + (size_t) fmt->stride * fmt->height,
+            fmt->stride, fmt->width / 2, fmt->height / 2 );
+        /* fall through - luma is the same as GREY */
+    case V4L2_PIX_FMT_GREY:
+        if ( fmt->stride == fmt->width ) {
+            iov[n].iov_base = (void *) src;
+        } else {
+            for ( int row=0; row<fmt->height; row++ ) {
+                memcpy( e->planes + (size_t) row * fmt->width,
+                    src + (size_t) row * fmt->stride, fmt->width );
+            }
+            iov[n].iov_base = e->planes;
+        }
+        break;
+    }
+    iov[n++].iov_len = y->luma_size;
+
+    if ( y->chroma ) {
+        iov[n].iov_base = u;
+        iov[n++].iov_len = y->chroma_size;
+        iov[n].iov_base = v;
+        iov[n++].iov_len = y->chroma_size;
+    }
+
+    return n;
+}
+
+/* writev the lot, picking up after short writes */
+static int
+write_all ( int fd, struct iovec *iov, int n ) {
+    while ( n > 0 ) {
+        ssize_t done = writev( fd, iov, n );
+        if ( done < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            return 0;
+        }
+
+        while ( n > 0 && (size_t) done >= iov->iov_len ) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if ( n > 0 ) {
+            iov->iov_base = (char *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+
+    return 1;
+}
+
+static unsigned int
+gcd ( unsigned int a, unsigned int b ) {
+    while ( b != 0 ) {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static int
+write_header ( struct y4m *y ) {
+    char header[128];
+    unsigned int num = y->format.fps * 1000 + 0.5, den = 1000;
+
+    /* smallest fraction for the frame rate, 30000:1000 as 30:1 */
+    if ( num == 0 ) { num = 30000; }
+    unsigned int g = gcd(num, den);
+    num /= g;
+    den /= g;
+
+    int n = snprintf( header, sizeof(header), "YUV4MPEG2 W%d H%d F%u:%u Ip A1:1 %s\n",
+        y->format.width, y->format.height, num, den,
+        y->chroma ? "C420mpeg2" : "Cmono"
+    );
+
+    struct iovec iov = { header, n };
+    return write_all( y->fd, &iov, 1 );
+}
+
+static void
+output_failed ( struct y4m *y ) {
+    if ( y->failed == 0 ) {
+        fprintf( stderr, "%s: %s, Y4M output stopped\n", y->path, strerror(errno) );
+    }
+    y->failed = 1;
+}
+
+static void *
+writer ( void *arg ) {
+    struct y4m *y = arg;
+    struct iovec iov[Y4M_DEPTH * IOV_PER_FRAME];
+    uint64_t count;
+
+    if ( write_header(y) == 0 ) { output_failed(y); }
+
+    for (;;) {
+        unsigned int tail = atomic_load_explicit( &y->tail, memory_order_relaxed );
+        unsigned int head = atomic_load_explicit( &y->head, memory_order_acquire );
+
+        if ( tail == head ) {
+            /* capture has stopped by the time quit is set, so head is final */
+            if ( atomic_load(&y->quit) ) { break; }
+            if ( read( y->wake_fd, &count, sizeof(count) ) < 0 && errno != EINTR ) {
+                perror("eventfd");
+                break;
+            }
+            continue;
+        }
+
+        /* everything that's waiting goes out in one writev */
+        int n = 0;
+        for ( unsigned int i = tail; i != head && y->failed == 0; i++ ) {
+            n += prepare( y, &y->ring[i % Y4M_DEPTH], iov + n );
+        }
+
+        if ( y->failed == 0 ) {
+            if ( write_all( y->fd, iov, n ) ) {
+                y->frames += head - tail;
+            } else {
+                output_failed(y);
+            }
+        }
+
+        for ( unsigned int i = tail; i != head; i++ ) {
+            frame_unref( &y->ring[i % Y4M_DEPTH].f );
+        }
+        atomic_store_explicit( &y->tail, head, memory_order_release );
+    }
+
+    return NULL;
+}
+
+static void
+destroy ( struct sink *sink ) {
+    struct y4m *y = (struct y4m *) sink;
+    uint64_t one = 1;
+
+    if ( y->running ) {
+        atomic_store(&y->quit, 1);
+        if ( write( y->wake_fd, &one, sizeof(one) ) < 0 ) { perror("eventfd"); }
+        pthread_join(y->thread, NULL);
+
+        fprintf( stderr, "Wrote %lu Y4M frames to %s, dropped %lu\n",
+            y->frames, y->path, atomic_load(&y->dropped)
+        );
+    }
+
+    for ( int i=0; i<Y4M_DEPTH; i++ ) { free(y->ring[i].planes); }
+    if ( y->fd > STDERR_FILENO ) { close(y->fd); }
+    if ( y->wake_fd >= 0 ) { close(y->wake_fd); }
+
+    free(y->path);
+    free(y);
+}
+
+struct sink *
+y4m_create ( const char *path, const struct frame_format *fmt ) {
+    struct y4m *y;
+
+    if ( fmt->pixelformat != V4L2_PIX_FMT_YUYV &&
+        fmt->pixelformat != V4L2_PIX_FMT_NV12 &&
+        fmt->pixelformat != V4L2_PIX_FMT_GREY ) {
+        fprintf( stderr, "Y4M output needs YUYV, NV12 or GREY capture\n" );
+        return NULL;
+    }
+
+    if ( fmt->width % 2 || fmt->height % 2 ) {
+        fprintf( stderr, "Y4M output needs an even frame size\n" );
+        return NULL;
+    }
+
+    y = calloc(1, sizeof(struct y4m));
+    if ( y == NULL ) { return NULL; }
+
+    y->sink.name = "Y4M output";
+    y->sink.push = push;
+    y->sink.destroy = destroy;
+    y->format = *fmt;
+    y->fd = -1;
+    y->wake_fd = -1;
+    y->chroma = fmt->pixelformat != V4L2_PIX_FMT_GREY;
+    y->luma_size = (size_t) fmt->width * fmt->height;
+    y->chroma_size = y->chroma ? y->luma_size / 4 : 0;
+    atomic_init(&y->quit, 0);
+    atomic_init(&y->head, 0);
+    atomic_init(&y->tail, 0);
+    atomic_init(&y->dropped, 0);
+
+    y->path = strdup(path);
+    if ( y->path == NULL ) {
+        fprintf( stderr, "Out of memory\n" );
+        destroy(&y->sink);
+        return NULL;
+    }
+
+    for ( int i=0; i<Y4M_DEPTH; i++ ) {
+        y->ring[i].planes = malloc( y->luma_size + 2 * y->chroma_size );
+        if ( y->ring[i].planes == NULL ) {
+            fprintf( stderr, "Out of memory\n" );
+            destroy(&y->sink);
+            return NULL;
+        }
+    }
+
+    /* blocking - the writer sleeps in read */
+    y->wake_fd = eventfd( 0, EFD_CLOEXEC );
+    if ( y->wake_fd < 0 ) {
+        perror("eventfd");
+        destroy(&y->sink);
+        return NULL;
+    }
+
+    if ( strcmp( path, "-" ) == 0 ) {
+        y->fd = STDOUT_FILENO;
+    } else {
+        y->fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+        if ( y->fd < 0 ) {
+            perror(path);
+            destroy(&y->sink);
+            return NULL;
+        }
+    }
+
+    /* an encoder going away should stop the output, not the program */
+    signal(SIGPIPE, SIG_IGN);
+
+    if ( pthread_create( &y->thread, NULL, writer, y ) != 0 ) {
+        fprintf( stderr, "Unable to start Y4M writer thread\n" );
+        destroy(&y->sink);
+        return NULL;
+    }
+    y->running = 1;
+
+    return &y->sink;
+}
@@ -0,0 +1,13 @@
+#ifndef Y4M_H
+#define Y4M_H
+
+#include "frame.h"
+
+/* YUV4MPEG2 output for piping the camera into an encoder. YUYV and NV12 */
+/* are repacked as I420, GREY goes out as mono. path "-" is stdout. */
+/* Frames are converted and written on a thread of their own, several to */
+/* a writev when the reader falls behind; if it falls too far behind */
+/* frames are dropped rather than held. */
+struct sink *y4m_create ( const char *path, const struct frame_format *fmt );
+
+#endif
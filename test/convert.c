@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#include "convert.h"
+#include "convert_check.h"
+
+/* Every conversion kernel this CPU can run against the scalar code, at */
+/* a full frame and at widths that leave a tail for the scalar code to */
+/* finish. Exits non-zero on any mismatch. Run by "make check". */
+
+static const struct {
+    int width, height;
+} sizes[] = {
+    { 1920, 1080 },
+    { 1000,    6 },
+    {   34,    4 },
+    {    2,    2 },
+};
+
+#define NUMSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+int
+main ( void ) {
+    struct convert_sample s;
+    int failed = 0, checked = 0;
+
+    for ( size_t i=0; i<NUMSIZES; i++ ) {
+        if ( convert_sample_alloc(&s, sizes[i].width, sizes[i].height) == 0 ) {
+            fprintf( stderr, "Out of memory\n" );
+            convert_sample_free(&s);
+            return EXIT_FAILURE;
+        }
+
+        for ( int isa=CONVERT_SCALAR + 1; isa<CONVERT_NUM_ISAS; isa++ ) {
+            if ( convert_use(isa) == 0 ) { continue; }
+
+            for ( int nv12=0; nv12<2; nv12++ ) {
+                for ( int out=0; out<CONVERT_NUM_OUTPUTS; out++ ) {
+                    checked++;
+                    if ( convert_matches_scalar(&s, isa, nv12, out) == 0 ) {
+                        fprintf( stderr, "%dx%d %s %s -> %s: MISMATCH\n",
+                            s.width, s.height, convert_isa_name(isa),
+                            nv12 ? "NV12" : "YUYV", convert_output_name(out) );
+                        failed++;
+                    }
+                }
+
+                /* and one row short, so the last row pairs with itself */
+                for ( int h=s.height; h>=s.height-1 && h>0; h-- ) {
+                    checked++;
+                    if ( convert_i420_matches_scalar(&s, isa, nv12, h) == 0 ) {
+                        fprintf( stderr, "%dx%d %s %s -> I420: MISMATCH\n",
+                            s.width, h, convert_isa_name(isa),
+                            nv12 ? "NV12" : "YUYV" );
+                        failed++;
+                    }
+                }
+            }
+        }
+
+        convert_sample_free(&s);
+    }
+
+    fprintf( stdout, "convert: %d of %d checks against scalar matched (best: %s)\n",
+        checked - failed, checked, convert_isa_name( convert_best() ) );
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+#!/bin/sh
+# Play the test pattern, and Y4M, raw and Matroska recordings made from
+# it, through the whole pipeline headless and check every frame comes out
+# the other end. Needs no camera or display. Run by "make check-pipeline",
+# or give it the camera binary to use.
+
+camera=${1:-./camera}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+# the number in a summary line such as "Wrote 30 Y4M frames to ..."
+count () {
+    sed -n "s/^$2 \([0-9]*\) .*/\1/p" "$dir/$1"
+}
+
+pass () {
+    echo "ok   $1"
+}
+
+failed () {
+    echo "FAIL $1"
+    fail=1
+}
+
+# same frame count, and more than none
+same_count () {
+    if [ -n "$2" ] && [ "$2" -gt 0 ] && [ "$2" = "$3" ]; then
+        pass "$1 ($3 frames)"
+    else
+        failed "$1: expected ${2:-no} frames, got ${3:-none}"
+    fi
+}
+
+same_file () {
+    if cmp -s "$dir/$2" "$dir/$3"; then
+        pass "$1"
+    else
+        failed "$1: $3 differs from $2"
+    fi
+}
+
+# a second of test pattern, stopped the way Ctrl-C would
+pattern () {
+    log=$1
+    shift
+    "$camera" -d pattern --headless -W 320 -H 240 "$@" 2>"$dir/$log" &
+    pid=$!
+    sleep 1
+    kill -INT $pid 2>/dev/null
+    wait $pid || failed "pattern $*: exited $?"
+}
+
+# a recording played through at its own pace, so no sink falls behind
+play () {
+    log=$1
+    shift
+    "$camera" --headless "$@" 2>"$dir/$log" || failed "$*: exited $?"
+}
+
+cd "$dir" || exit 1
+
+pattern pattern.log -y pattern.y4m
+frames=$(count pattern.log Wrote)
+same_count "pattern to Y4M" "$(count pattern.log Captured)" "$frames"
+
+play y4m.log -d pattern.y4m -y y4m.y4m -o y4m.raw
+same_count "Y4M to raw" "$frames" "$(count y4m.log Recorded)"
+same_file "Y4M to Y4M" pattern.y4m y4m.y4m
+
+play raw.log -d y4m.raw -y raw.y4m
+same_file "raw with index to Y4M" pattern.y4m raw.y4m
+
+cp y4m.raw bare.raw
+play bare.log -d bare.raw -W 320 -H 240 -p NV12 -r 30 -y bare.y4m
+same_file "bare raw to Y4M" pattern.y4m bare.y4m
+
+pattern mjpeg.log -p MJPG -m pattern.mkv
+frames=$(count mjpeg.log Recorded)
+same_count "MJPEG pattern to Matroska" "$(count mjpeg.log Captured)" "$frames"
+
+play mkv.log -d pattern.mkv -m mkv.mkv
+same_count "Matroska played" "$frames" "$(count mkv.log Captured)"
+same_count "Matroska to Matroska" "$frames" "$(count mkv.log Recorded)"
+
+if [ $fail -ne 0 ]; then
+    for log in "$dir"/*.log; do
+        echo "--- $(basename "$log")"
+        cat "$log"
+    done
+fi
+
+exit $fail